@@ -1,5 +1,6 @@
-// This file uses the 8080 emulator to run the test suite (roms in cpu_tests
-// directory). It uses a simple array as memory.
+// This file uses the 8080 emulator to run the VT100 firmware against test
+// scripts (in the t directory). It uses a simple array as memory. The CPU
+// test suite (roms in cpu_tests directory) is run by exerciser.c.
 
 // decl to get nanosleep()
 #define _POSIX_C_SOURCE 200809L
@@ -19,9 +20,26 @@
 
 #include <SDL2/SDL.h>
 
+#include "awnty.h"
+#include "boot_cache.h"
+#include "capture.h"
+#include "cov_planes.h"
 #include "coverage.h"
 #include "er1400.h"
+#include "frames.h"
+#include "hooks.h"
+#include "idle.h"
+#include "jit.h"
+#include "keyboard.h"
+#include "lockstep.h"
+#include "pty.h"
+#include "pusart.h"
+#include "screen_text.h"
+#include "script.h"
 #include "sdl_gd.h"
+#include "serial_stream.h"
+#include "snapshot.h"
+#include "stack_monitor.h"
 #include "unused.h"
 #include "vt100_memory.h"
 
@@ -66,7 +84,13 @@ unsigned long next_cov = 10000;
 // when we'd like to know about the keyboard LEDs, but there haven't been any video interrrupts
 // yet.
 unsigned long last_screen = 0;
+// The script starts when the firmware first gets to idle_loop, or failing
+// that (no symbols, or --no-auto-start), after command_pause cycles
 unsigned long command_pause = 10000000;
+bool opt_auto_start = true;
+int idle_loop_addr = -1;
+int ready_addr = -1; // idle_loop, unless --no-auto-start
+bool firmware_ready = false;
 // With plain text, autowrap and jump scrolling, rx_gap can be reduced to 3000 cycles (1ms)
 // without ever exhausting the receive buffer (and causing the terminal to send XOFF).
 unsigned long rx_gap = 30000;
@@ -81,31 +105,119 @@ int key_count = 0;
 int key_index = 0;
 int done_keys = 0;
 int key_pause = 0;
+bool key_from_host = false; // the keys being fed were typed into the window, not the script's
 int conf_pause = 10; // user-configured that becomes the pause for each key
 
 bool need_command;
 bool feeding_pause;
 long unsigned int pause_cycles;
+// A wait command holds the script until its WAIT_* condition holds, or
+// wait_limit passes
+bool feeding_wait;
+int wait_kind;
+unsigned long wait_frame, wait_limit;
+unsigned long wait_timeout = 100000000; // cycles
+int waits_timed_out = 0; // this run
 
 long unsigned int remaining_cycles = 0;
 
 long unsigned int receive_count = 0;
 long unsigned int receive_index = 0;
 int receive_feed[1000];
+// No windows: for scripts that check or capture the screen themselves
+bool opt_headless = false;
+
+// Stream standard input to the receiver as soon as the script would start
+bool opt_serial_stdin = false;
+
+// Host a shell on a pseudo-terminal, once the script (if any) has started
+bool opt_pty = false;
+const char *pty_command = NULL; // NULL for the user's shell
+unsigned long next_pty_poll = 0;
+unsigned long next_stream_poll = 0; // for more from a pipe that had nothing
+bool host_quit = false;
+
+// Skip the passes of idle loops that would only wait for the next event
+bool opt_fast_idle = true;
+// Run instructions back to back between events, see run_ahead()
+bool opt_run_ahead = true;
+// Check every instruction against the reference interpreter
+bool opt_lockstep = false;
+// Follow calls and interrupts, and report the stack's depth and overflows
+bool opt_stack_monitor = false;
+// Run the ROM as native code where it can be, see jit.h
+bool opt_jit = false;
+// Keep ROM instructions decoded, see i8080_set_rom()
+bool opt_decode_cache = true;
+// Print the CPU and hashes of memory and coverage at the end, to compare runs
+bool opt_final_state = false;
+// Set by I/O with side effects, which may have scheduled an event
+bool io_happened = false;
+
+// Called with every memory write the CPU makes, for tools built on the
+// emulator: awnty-fuzz looks for writes outside RAM
+void (*write_observer)(uint16_t addr, uint8_t val) = NULL;
+// Keep emulated time to roughly real time
+bool opt_pace = true;
+// End the run when the firmware gets to this symbol or address
+const char *opt_quit_at = NULL;
+// Start from the machine saved when an earlier run's script started
+bool opt_fast_boot = false;
+// Report the ROM code each script command newly covered, see coverage_delta_end()
+bool opt_coverage_deltas = false;
+// List the conditional instructions that only ever went one way
+bool opt_branches = false;
+
+// Keys typed into the screen window, waiting for the keyboard port. Each entry
+// is a key with its modifiers, fed as if by the "key" command.
+#define HOST_KEYS 64
+uint8_t host_keys[HOST_KEYS][3];
+int host_key_len[HOST_KEYS];
+int host_key_head = 0;
+int host_key_tail = 0;
 
 int kbdi_count = 0;
 
 bool pusart_mode = true; // if PUSART write addresses mode register
 uint8_t pusart_command = 0; // latest command byte sent (don't store mode bytes)
+uint8_t pusart_mode_byte = 0x4e; // latest mode byte: 1 stop bit, no parity, 8 bits, 16x
+uint8_t baud_speed = 0xee; // latest write to the baud rate generator (9600/9600)
+
+// With "rxgap baud", received characters arrive at the line speed rather than
+// every rx_gap cycles. baud_forced overrides the speed the firmware programmed.
+bool baud_timing = false;
+double baud_forced = 0;
+unsigned long rx_chars = 0;
+unsigned long first_rx = 0, last_rx = 0; // cycles of first and last received characters
+unsigned long xoff_count = 0;
+unsigned long first_xoff = 0;
+bool host_held = false; // host has seen XOFF (honoured only with baud timing)
 
 uint8_t nvr_latch = 0; // last value written to NVR latch (for reading back SPDI)
 
 uint8_t oldx[6];
 
 static bool test_finished = 0;
+static int screen_checks = 0;
+static int screen_failures = 0;
+static int script_errors = 0; // commands that couldn't be carried out
+static bool started_command = false;
+
+// Snapshots for rewinding, taken every snapshot_frames vertical blanks (0 = never)
+unsigned long frame_count = 0;
+unsigned long snapshot_frames = 0;
+const int max_snapshots = 256;
+bool snapshot_due = false;
+bool rewind_pending = false;
+unsigned long rewind_cycles = 0;
+// After a rewind, commands are replayed from the input log until we catch up
+size_t replay_index = 0;
+size_t replay_end = 0;
+bool replaying = false; // the command being run came from the log
+int replay_divergences = 0;
 
 /* Things this VT100 is fitted with */
-static int have_avo = 1;
+int have_avo = 1;
 static int have_gpo = 1;
 static int have_stp = 0;
 static int have_loopback = 0;
@@ -128,6 +240,9 @@ const uint16_t LOC_RX_HEAD = 0x20c0;
 const uint16_t LOC_RX_TAIL = 0x20c1;
 const uint16_t LOC_ABACK_BUFFER = 0x217b;
 const uint16_t LOC_LOCAL_MODE = 0x21a5;
+const uint16_t LOC_SCROLL_PENDING = 0x2051;
+const uint16_t LOC_SMOOTH_SCROLL = 0x2065;
+const uint16_t LOC_SHUFFLE_READY = 0x207a;
 const uint16_t LOC_SETUP_B1 = 0x21a6;
 
 const int SCREEN_LINES = 24;
@@ -142,21 +257,38 @@ SDL_Texture *scr_font2 = NULL;
 SDL_Texture *scr_fontt = NULL;
 SDL_Texture *scr_fontb = NULL;
 
-static void sdl_screen(const i8080 *c, SDL_Renderer *rend);
+static bool capture_screen(const i8080 *c);
 
 static uint8_t rb(void *userdata UNUSED, uint16_t addr) {
+    uint8_t val;
     if (bug_ram && (addr == 0x2222 || addr == 0x3222))
-        return 0x88;
-    if (addr < 0x3000)
-        return memory[addr];
+        val = 0x88;
+    else if (addr < 0x3000)
+        val = memory[addr];
     else if (have_avo)
-        return memory[addr] & 0x0f; // AVO is 4 bits wide
+        val = memory[addr] & 0x0f; // AVO is 4 bits wide
     else
-        return 0x0f;
+        val = 0x0f;
+    if (idle_tracking && addr >= 0x2000)
+        idle_read(addr, val);
+    if (lockstep_active)
+        lockstep_read(addr, val);
+    return val;
 }
 
-static void wb(void* userdata UNUSED, uint16_t addr, uint8_t val) {
+static void wb(void* userdata, uint16_t addr, uint8_t val) {
     //fprintf(logmem, "W %04x %02x\n", (unsigned int)addr, (unsigned int)val);
+    if (watch_hit(addr)) {
+        watch_write(addr, memory[addr], ((const i8080 *)userdata)->inst_pc);
+        idle_disturb();
+    }
+    if (idle_tracking)
+        idle_write(addr, memory[addr], val);
+    if (lockstep_active)
+        lockstep_write(addr, val);
+    if (write_observer)
+        write_observer(addr, val);
+    jit_written(addr);
     memory[addr] = val;
 }
 
@@ -170,20 +302,36 @@ static uint8_t int_acknowledge(void *userdata UNUSED) {
 
 
     //printf("iack %02x %s %s %s\n", iop, vbi ? "v" : " ", reci ? "r" : "", kbdi ? "k" : "");
+    if (lockstep_active)
+        lockstep_iack(iop);
     return iop;
 }
 
+static double rx_baud() {
+    return baud_forced > 0 ? baud_forced : pusart_rx_baud(baud_speed);
+}
+
+// Cycles until the next received character
+static unsigned long rx_char_gap() {
+    return baud_timing ? pusart_char_cycles(rx_baud(), pusart_mode_byte) : rx_gap;
+}
+
 static uint8_t port_in(void *userdata, uint8_t port) {
     const i8080 *c = (i8080 *) userdata;
     uint8_t val = 0;
+    if (port != 0x42) { // the flags buffer is the only input without side effects
+        idle_disturb();
+        io_happened = true;
+    }
     if (port == 0x00) {
         reci = false;
         val = 0;
+        bool received = true; // rather than the firmware reading an empty buffer
         if (receive_index < receive_count) {
             val = receive_feed[receive_index];
             ++receive_index;
             if (receive_index < receive_count) {
-                next_reci = c->cyc + rx_gap;
+                next_reci = c->cyc + rx_char_gap();
             }
             else {
                 // This particularly applies to data loopback test, where we kick off the test,
@@ -194,6 +342,33 @@ static uint8_t port_in(void *userdata, uint8_t port) {
                 next_reci = 0;
             }
         }
+        else if (serial_stream_active()) {
+            int ch = serial_stream_next();
+            if (ch >= 0)
+                val = ch & 0x7f; // as for the "serial" command
+            received = ch >= 0;
+            if (serial_stream_more()) {
+                next_reci = c->cyc + rx_char_gap();
+            }
+            else if (serial_stream_ended()) {
+                serial_stream_close();
+                need_command = !feeding_pause;
+                next_reci = 0;
+            }
+            else
+                next_reci = 0; // a pipe with nothing yet, polled by run_test()
+        }
+        else if (pty_more()) {
+            val = pty_next() & 0x7f;
+            next_reci = pty_more() ? c->cyc + rx_char_gap() : 0;
+        }
+        else
+            received = false;
+        if (received) {
+            if (rx_chars++ == 0)
+                first_rx = c->cyc;
+            last_rx = c->cyc;
+        }
         //printf("\tRX %02x\n", val);
     }
     else if (port == 0x01) {
@@ -228,7 +403,9 @@ static uint8_t port_in(void *userdata, uint8_t port) {
                     key_index = 0;
                 else {
                     key_count = 0;
-                    need_command = true;//++done_keys;
+                    // Typed keys come between commands, and don't end one
+                    if (!key_from_host)
+                        need_command = true;//++done_keys;
                 }
             }
         }
@@ -255,12 +432,22 @@ static uint8_t port_in(void *userdata, uint8_t port) {
     else {
         printf("in OTHER(%02x) -> %02x\n", port, val);
     }
+    if (lockstep_active)
+        lockstep_in(port, val);
     return val;
 }
 
 static void port_out(void *userdata, uint8_t port, uint8_t value) {
     const i8080 *c = (i8080 *) userdata;
 
+    // Idle loops keep sending the keyboard the same status
+    if (port != 0x82 || value != keyboard_status || (value & 0x40)) {
+        idle_disturb();
+        io_happened = true;
+    }
+    if (lockstep_active)
+        lockstep_out(port, value);
+
     if (port == 0x62) {
         //if (value != nvr_latch)
         //    printf("out nvr_latch %02x BIT 5 %d\n", value, (value & 0x20) != 0);
@@ -299,7 +486,17 @@ static void port_out(void *userdata, uint8_t port, uint8_t value) {
             //printf("SCAN next kbd int at cycle %lu\n", next_kbdi);
         }
     }
+    else if (port == 0x00 && pty_active()) {
+        if (value == 0x13 && xoff_count++ == 0) // XOFF
+            first_xoff = c->cyc;
+        pty_write(value);
+    }
     else if (port == 0x00) {
+        if (value == 0x13 && xoff_count++ == 0)
+            first_xoff = c->cyc;
+        // A host on a real line stops sending until XON
+        if (baud_timing && (value == 0x13 || value == 0x11))
+            host_held = value == 0x13;
         if (value < 32) {
             if (value == 0x13) // XOFF
                 printf("\t\t\033[41mTX %02x  %s\033[m\n", value, c0_names[value]);
@@ -314,11 +511,12 @@ static void port_out(void *userdata, uint8_t port, uint8_t value) {
             receive_count = 1;
             receive_index = 0;
             receive_feed[0] = value;
-            next_reci = c->cyc + rx_gap;
+            next_reci = c->cyc + rx_char_gap();
         }
     }
     else if (port == 0x02) {
         //printf("out baudrate %02x\n", value);
+        baud_speed = value;
     }
     else if (port == 0xa2) {
         switch (value & 0x0f) { // only a 4-bit value is decoded
@@ -343,6 +541,10 @@ static void port_out(void *userdata, uint8_t port, uint8_t value) {
             case  9: 
                 vbi = 0; // clear vertical blank interrupt
                 sdl_screen(c, scr_renderer);
+                if (capture_recording() && capture_screen(c))
+                    capture_record_frame();
+                if (frames_active() && capture_screen(c))
+                    frames_add(capture_take(), c->cyc);
                 break;
             case 10:
                 dc012_reverse_field = 1;
@@ -384,8 +586,10 @@ static void port_out(void *userdata, uint8_t port, uint8_t value) {
             //    printf("\t\tRTS = %d  DTR = %d\n", (pusart_command & 0x20) != 0, (pusart_command & 0x02) != 0);
             }
         }
-        else
+        else {
+            pusart_mode_byte = value;
             pusart_mode = false;
+        }
     }
     else {
         printf("out OTHER(%02x) %02x\n", port, value);
@@ -454,7 +658,57 @@ static uint16_t dma_rw(const i8080 *c, uint16_t addr) {
 
 #define LINE_SCROLLS(l) (((l) & 0x08) != 0)
 
-static void sdl_screen(const i8080 *c, SDL_Renderer *rend)
+static const SDL_Color black  =      {   0,   0,   0, 255 };
+static const SDL_Color dull_orange = {  57,  22,   5, 255 };
+static const SDL_Color grey50 =      { 128, 128, 128, 255 };
+static const SDL_Color grey75 =      { 192, 192, 192, 255 };
+static const SDL_Color white  =      { 255, 255, 255, 255 };
+static const SDL_Color orange =      { 226,  87,  20, 255 };
+
+// The raster can be drawn on the screen window or into a capture image
+typedef struct raster_ops {
+    void (*color)(void *ctx, SDL_Color col);
+    void (*dot)(void *ctx, int x, int y);
+    void (*fill)(void *ctx, int x, int y, int w, int h);
+    void (*label)(void *ctx, int x, int y, char *text, SDL_Color col); // optional
+    void *ctx;
+} raster_ops;
+
+static void sdl_color(void *ctx, SDL_Color col) {
+    SDL_SetRenderDrawColor(ctx, col.r, col.g, col.b, col.a);
+}
+
+static void sdl_dot(void *ctx, int x, int y) {
+    SDL_RenderDrawPoint(ctx, x, y);
+}
+
+static void sdl_fill(void *ctx, int x, int y, int w, int h) {
+    SDL_Rect rect = { x, y, w, h };
+    SDL_RenderFillRect(ctx, &rect);
+}
+
+static void sdl_label(void *ctx, int x, int y, char *text, SDL_Color col) {
+    sdl_gdImageString(ctx, gdFontGetSmall(), x, y, text, col);
+}
+
+static raster_ops sdl_ops = { sdl_color, sdl_dot, sdl_fill, sdl_label, NULL };
+
+static void capture_color_op(void *ctx UNUSED, SDL_Color col) {
+    capture_color(col);
+}
+
+static void capture_dot_op(void *ctx UNUSED, int x, int y) {
+    capture_dot(x, y);
+}
+
+static void capture_fill_op(void *ctx UNUSED, int x, int y, int w, int h) {
+    capture_fill(x, y, w, h);
+}
+
+static const raster_ops capture_ops = { capture_color_op, capture_dot_op, capture_fill_op, NULL, NULL };
+
+// Draw the character raster, with its top left at (x0, y0), scaled to width.
+static void draw_raster(const i8080 *c, const raster_ops *ops, int x0, int y0, int width)
 {
     const char lnat_size_mask = 0x06;
     const char lnat_size_bottom = 0x00;
@@ -463,49 +717,6 @@ static void sdl_screen(const i8080 *c, SDL_Renderer *rend)
 
     const char line_terminator = 0x7f;
 
-    int xo = 20; // room for symbols on left?
-    int yo = 0;
-    int margin = 6;
-    SDL_Color black  =      {   0,   0,   0, 255 };
-    SDL_Color dull_orange = {  57,  22,   5, 255 };
-    SDL_Color grey50 =      { 128, 128, 128, 255 };
-    SDL_Color grey75 =      { 192, 192, 192, 255 };
-    SDL_Color white  =      { 255, 255, 255, 255 };
-    SDL_Color orange =      { 226,  87,  20, 255 };
-
-    SDL_Rect wholescr = { 0, 0, xo + 10 * 80 + 2 * margin, yo + SCREEN_LINES * 20 + 40 };
-    SDL_SetRenderDrawColor(rend, black.r, black.g, black.b, black.a);
-    SDL_RenderFillRect(rend, &wholescr);
-
-    SDL_SetRenderDrawColor(rend, black.r, black.g, black.b, black.a);
-    SDL_Rect statarea = { 0, yo + SCREEN_LINES * 20 + 2 * margin, xo + 10 * 80, 40 };
-    // (still black)
-    SDL_RenderFillRect(rend, &statarea);
-
-    SDL_SetRenderDrawColor(rend, orange.r, orange.g, orange.b, orange.a);
-
-    SDL_RenderDrawLine(rend, xo + margin, yo, xo + margin + 80 * 10, yo);
-    SDL_RenderDrawLine(rend, xo + margin, yo + SCREEN_LINES * 20 + 2 * margin - 1, xo + margin + 80 * 10, yo + SCREEN_LINES * 20 + 2 * margin - 1);
-    SDL_RenderDrawLine(rend, xo, yo + margin, xo, yo + margin + SCREEN_LINES * 20);
-    SDL_RenderDrawLine(rend, xo + 2 * margin - 1 + 80 * 10, yo + margin, xo + 2 * margin - 1 + 80 * 10, yo + margin + SCREEN_LINES * 20);
-    int xc = xo + margin;
-    int yc = yo + margin;
-    SDL_Point curve_tl[] = {{ xc - 6, yc - 1 }, { xc - 6, yc - 2 }, { xc - 5, yc - 3 }, { xc - 5, yc - 4 },
-                            { xc - 4, yc - 5 }, { xc - 3, yc - 5 }, { xc - 2, yc - 6 }, { xc - 1, yc - 6 } };
-    SDL_RenderDrawPoints(rend, curve_tl, 8);
-    xc = xo + margin + 80 * 10 - 1;
-    SDL_Point curve_tr[] = {{ xc + 6, yc - 1 }, { xc + 6, yc - 2 }, { xc + 5, yc - 3 }, { xc + 5, yc - 4 },
-                            { xc + 4, yc - 5 }, { xc + 3, yc - 5 }, { xc + 2, yc - 6 }, { xc + 1, yc - 6 } };
-    SDL_RenderDrawPoints(rend, curve_tr, 8);
-    yc = yo + margin + SCREEN_LINES * 20 - 1;
-    SDL_Point curve_br[] = {{ xc + 6, yc + 1 }, { xc + 6, yc + 2 }, { xc + 5, yc + 3 }, { xc + 5, yc + 4 },
-                            { xc + 4, yc + 5 }, { xc + 3, yc + 5 }, { xc + 2, yc + 6 }, { xc + 1, yc + 6 } };
-    SDL_RenderDrawPoints(rend, curve_br, 8);
-    xc = xo + margin;
-    SDL_Point curve_bl[] = {{ xc - 6, yc + 1 }, { xc - 6, yc + 2 }, { xc - 5, yc + 3 }, { xc - 5, yc + 4 },
-                            { xc - 4, yc + 5 }, { xc - 3, yc + 5 }, { xc - 2, yc + 6 }, { xc - 1, yc + 6 } };
-    SDL_RenderDrawPoints(rend, curve_bl, 8);
-    
     uint8_t char_code[256];
     uint8_t char_attr[256];
     uint8_t line_attr = 0;
@@ -517,14 +728,12 @@ static void sdl_screen(const i8080 *c, SDL_Renderer *rend)
 
     int dots_per_char = 10;
     int chars_per_line = 80;
-    double column_scale = 1.0;
-
-    // Perform rather crude scaling of x-axis for 132 columns
     if (dc011_132_columns) {
         dots_per_char = 9;
         chars_per_line = 132;
-        column_scale = (10 * 80) / (9 * 132);
     }
+    // Perform rather crude scaling of x-axis for 132 columns
+    double column_scale = (double)width / (dots_per_char * chars_per_line);
         
     uint16_t addr = 0x2000; // Video RAM always starts here 
     uint16_t dmad = dma_rw(c, addr + 1);
@@ -571,9 +780,8 @@ static void sdl_screen(const i8080 *c, SDL_Renderer *rend)
             addr = 0x2000 | (dmad & 0xfff);
 
             if (nchline == 255) {
-                SDL_Rect raster = { xo + margin, yo + margin, 10 * 80, SCREEN_LINES * 20 };
-                SDL_SetRenderDrawColor(rend, dull_orange.r, dull_orange.g, dull_orange.b, dull_orange.a);
-                SDL_RenderFillRect(rend, &raster);
+                ops->color(ops->ctx, dull_orange);
+                ops->fill(ops->ctx, x0, y0, width, SCREEN_LINES * 20);
                 break;
             }
 
@@ -582,8 +790,8 @@ static void sdl_screen(const i8080 *c, SDL_Renderer *rend)
             char width_ch[4] = { 'B', 'T', '2', '1' };
             char buf[3];
             snprintf(buf, 3, "%s%c", LINE_SCROLLS(line_attr) ? "S" : "-", width_ch[(line_attr >> 1) & 3]);
-            if (y >= 0 && y < SCREEN_LINES * 20) // avoid the final terminator (extra line)
-                sdl_gdImageString(rend, gdFontGetSmall(), 3, yo + y + margin + 3, buf, grey75);
+            if (ops->label && y >= 0 && y < SCREEN_LINES * 20) // avoid the final terminator (extra line)
+                ops->label(ops->ctx, 3, y0 + y + 3, buf, grey75);
         }
 
         // Now we've got a new line of characters, if necessary, get onto processing the next scan line
@@ -659,7 +867,7 @@ static void sdl_screen(const i8080 *c, SDL_Renderer *rend)
             // Bold characters are 100%
             else
                 intensity = white;
-            SDL_SetRenderDrawColor(rend, intensity.r, intensity.g, intensity.b, intensity.a);
+            ops->color(ops->ctx, intensity);
             int xoff = 0;
             // Multiple attributes are involved in reversing bits in this cell. Let's work them out:
             // 1. Reverse field (black on white characters)
@@ -676,7 +884,7 @@ static void sdl_screen(const i8080 *c, SDL_Renderer *rend)
             for (int bv = 1 << numpix; bv > 1; bv >>= 1) {
                 int dot = ((clocked_dots & bv) != 0) ^ reverse;
                 if (dot && y >= 0)
-                    SDL_RenderDrawPoint(rend, xo + margin + column_scale * (x + xoff), yo + y + margin);
+                    ops->dot(ops->ctx, x0 + column_scale * (x + xoff), y0 + y);
                 ++xoff;
             }
             x += numpix;
@@ -685,6 +893,52 @@ static void sdl_screen(const i8080 *c, SDL_Renderer *rend)
         normal_scan_count = (normal_scan_count + 1) % 10;
         scan_count_in_use = (scan_count_in_use + 1) % 10;
     }
+}
+
+void sdl_screen(const i8080 *c, SDL_Renderer *rend)
+{
+    if (!rend) // headless
+        return;
+
+    int xo = 20; // room for symbols on left?
+    int yo = 0;
+    int margin = 6;
+
+    SDL_Rect wholescr = { 0, 0, xo + 10 * 80 + 2 * margin, yo + SCREEN_LINES * 20 + 40 };
+    SDL_SetRenderDrawColor(rend, black.r, black.g, black.b, black.a);
+    SDL_RenderFillRect(rend, &wholescr);
+
+    SDL_SetRenderDrawColor(rend, black.r, black.g, black.b, black.a);
+    SDL_Rect statarea = { 0, yo + SCREEN_LINES * 20 + 2 * margin, xo + 10 * 80, 40 };
+    // (still black)
+    SDL_RenderFillRect(rend, &statarea);
+
+    SDL_SetRenderDrawColor(rend, orange.r, orange.g, orange.b, orange.a);
+
+    SDL_RenderDrawLine(rend, xo + margin, yo, xo + margin + 80 * 10, yo);
+    SDL_RenderDrawLine(rend, xo + margin, yo + SCREEN_LINES * 20 + 2 * margin - 1, xo + margin + 80 * 10, yo + SCREEN_LINES * 20 + 2 * margin - 1);
+    SDL_RenderDrawLine(rend, xo, yo + margin, xo, yo + margin + SCREEN_LINES * 20);
+    SDL_RenderDrawLine(rend, xo + 2 * margin - 1 + 80 * 10, yo + margin, xo + 2 * margin - 1 + 80 * 10, yo + margin + SCREEN_LINES * 20);
+    int xc = xo + margin;
+    int yc = yo + margin;
+    SDL_Point curve_tl[] = {{ xc - 6, yc - 1 }, { xc - 6, yc - 2 }, { xc - 5, yc - 3 }, { xc - 5, yc - 4 },
+                            { xc - 4, yc - 5 }, { xc - 3, yc - 5 }, { xc - 2, yc - 6 }, { xc - 1, yc - 6 } };
+    SDL_RenderDrawPoints(rend, curve_tl, 8);
+    xc = xo + margin + 80 * 10 - 1;
+    SDL_Point curve_tr[] = {{ xc + 6, yc - 1 }, { xc + 6, yc - 2 }, { xc + 5, yc - 3 }, { xc + 5, yc - 4 },
+                            { xc + 4, yc - 5 }, { xc + 3, yc - 5 }, { xc + 2, yc - 6 }, { xc + 1, yc - 6 } };
+    SDL_RenderDrawPoints(rend, curve_tr, 8);
+    yc = yo + margin + SCREEN_LINES * 20 - 1;
+    SDL_Point curve_br[] = {{ xc + 6, yc + 1 }, { xc + 6, yc + 2 }, { xc + 5, yc + 3 }, { xc + 5, yc + 4 },
+                            { xc + 4, yc + 5 }, { xc + 3, yc + 5 }, { xc + 2, yc + 6 }, { xc + 1, yc + 6 } };
+    SDL_RenderDrawPoints(rend, curve_br, 8);
+    xc = xo + margin;
+    SDL_Point curve_bl[] = {{ xc - 6, yc + 1 }, { xc - 6, yc + 2 }, { xc - 5, yc + 3 }, { xc - 5, yc + 4 },
+                            { xc - 4, yc + 5 }, { xc - 3, yc + 5 }, { xc - 2, yc + 6 }, { xc - 1, yc + 6 } };
+    SDL_RenderDrawPoints(rend, curve_bl, 8);
+    
+    sdl_ops.ctx = rend;
+    draw_raster(c, &sdl_ops, xo + margin, yo + margin, 10 * 80);
 
     // Now extra terminal status information
     int ledstat[7];
@@ -799,6 +1053,15 @@ static void sdl_screen(const i8080 *c, SDL_Renderer *rend)
     SDL_RenderPresent(rend);
 }
 
+// Draw the raster at its natural width (80 or 132 columns) into a new capture image
+static bool capture_screen(const i8080 *c) {
+    int width = dc011_132_columns ? 9 * 132 : 10 * 80;
+    if (!capture_begin(width, SCREEN_LINES * 20))
+        return false;
+    draw_raster(c, &capture_ops, 0, 0, capture_width());
+    return true;
+}
+
 static void dump_memory(uint16_t start_addr, int num_bytes) {
     int nb = 0;
     char ch[17];
@@ -843,86 +1106,6 @@ static void dump_switches() {
         (sb2 & 0x10) ? "ON" : "OFF");
 }
 
-int parse_dump(char *cmd, uint16_t *maddr, uint8_t *mlen) {
-    int got_cmd = 0;
-    if (strlen(cmd) > 5 && strncmp(cmd, "dump ", 5) == 0) {
-        if (sscanf(&cmd[5], "%hx,%hhx", maddr, mlen) == 2)
-            got_cmd = 1;
-    }
-    return got_cmd;
-}
-
-int parse_key(char *cmd, uint8_t *hex, uint8_t maxhex) {
-    int nhex = 0;
-    if (strlen(cmd) > 4 && strncmp(cmd, "key ", 4) == 0) {
-        bool finished = false;
-        int idx = 4;
-        char strhex[3];
-        while (!finished || nhex >= maxhex) {
-            while (cmd[idx] == ' ' || cmd[idx] == ',')
-                ++idx;
-            if (isxdigit(cmd[idx]) && cmd[idx] != 0 && isxdigit(cmd[idx + 1])) {
-                strhex[0] = cmd[idx];
-                strhex[1] = cmd[idx + 1];
-                strhex[2] = 0;
-                hex[nhex] = strtol(strhex, NULL, 16);
-                ++nhex;
-                idx += 2;
-            }
-            else
-                finished = true;
-        }
-    }
-    else {
-        //printf("not key\n");
-    }
-    return nhex;
-}
-
-int parse_serial(char *cmd, uint8_t *hex, int maxhex) {
-    int nhex = 0;
-    if (strlen(cmd) > 4 && strncmp(cmd, "serial ", 7) == 0) {
-        bool finished = false;
-        size_t idx = 7;
-        char strhex[3];
-        while (!finished || nhex >= maxhex) {
-            while (cmd[idx] == ' ' || cmd[idx] == ',')
-                ++idx;
-            if (isxdigit(cmd[idx]) && cmd[idx] != 0 && isxdigit(cmd[idx + 1])) {
-                strhex[0] = cmd[idx];
-                strhex[1] = cmd[idx + 1];
-                strhex[2] = 0;
-                hex[nhex] = strtol(strhex, NULL, 16);
-                ++nhex;
-                idx += 2;
-            }
-            else if (cmd[idx] == '"') {
-                while (++idx < strlen(cmd) && nhex < maxhex && cmd[idx] != '"') {
-                    hex[nhex] = cmd[idx];
-                    ++nhex;
-                }
-                ++idx;
-                if (idx >= strlen(cmd))
-                    finished = true;
-            }
-            else
-                finished = true;
-        }
-    }
-    else {
-        //printf("not serial\n");
-    }
-    return nhex;
-}
-
-int parse_pause(char *cmd) {
-    long pause = 0;
-    if (strlen(cmd) > 6 && strncmp(cmd, "pause ", 6) == 0) {
-        pause = strtol(&cmd[6], NULL, 10);
-    }
-    return pause;
-}
-
 void display_stack(const i8080 *c) {
     printf("Stack:\n");
     for (uint16_t addr = c->sp; addr < 0x204e; addr += 2) {
@@ -951,11 +1134,574 @@ void display_stack(const i8080 *c) {
     }
 }
 
+// Diagnostic hooks that are always installed
+
+static void hook_pop_to_ground(i8080 *c, const char *name UNUSED) {
+    printf("AT POP_TO_GROUND -- stack contains\n");
+    display_stack(c);
+}
+
+static void hook_nvr_failed(i8080 *c UNUSED, const char *name UNUSED) {
+    printf("NVR FAILED\n");
+}
+
+static void hook_curkey_report(i8080 *c, const char *name UNUSED) {
+    printf("Popped curkey_queue -> %02x '%c'\n", c->b, (c->b & 0x7f) > 32 ? c->b & 0x7f : '.');
+}
+
+static void hook_send_key_byte(i8080 *c, const char *name UNUSED) {
+    printf("\n\n\nsend_key_byte: %02x '%c'\n", c->a, (c->a & 0x7f) > 32 ? c->a & 0x7f : '.');
+}
+
+// Hooks set from the script with "break" and "trace"
+
+static void hook_break(i8080 *c, const char *name) {
+    printf("BREAK %s\n", name);
+    i8080_debug_output(c, true);
+    display_stack(c);
+}
+
+static void hook_trace(i8080 *c, const char *name) {
+    printf("TRACE %-20s A=%02x BC=%02x%02x DE=%02x%02x HL=%02x%02x SP=%04x CYC=%lu\n",
+        name, c->a, c->b, c->c, c->d, c->e, c->h, c->l, c->sp, c->cyc);
+}
+
+static void hook_quit(i8080 *c, const char *name) {
+    printf("QUIT %s at cycle %lu\n", name, c->cyc);
+    host_quit = true;
+}
+
+static void hook_ready(i8080 *c, const char *name) {
+    if (!firmware_ready && !started_command)
+        printf("Firmware reached %s at cycle %lu\n", name, c->cyc);
+    firmware_ready = true;
+}
+
+static void queue_host_key(const uint8_t *keys, int nkeys) {
+    int next = (host_key_tail + 1) % HOST_KEYS;
+    if (nkeys == 0 || next == host_key_head)
+        return;
+    memcpy(host_keys[host_key_tail], keys, nkeys);
+    host_key_len[host_key_tail] = nkeys;
+    host_key_tail = next;
+}
+
+static void queue_host_char(int ch) {
+    uint8_t keys[3];
+    queue_host_key(keys, keyboard_keys_for_char(ch, keys));
+}
+
+// Collect keys typed into the screen window
+static void poll_host_events() {
+    SDL_Event ev;
+    while (SDL_PollEvent(&ev)) {
+        if (ev.type == SDL_QUIT) {
+            host_quit = true;
+        }
+        else if (ev.type == SDL_TEXTINPUT) {
+            for (const char *t = ev.text.text; *t; ++t)
+                queue_host_char(*t);
+        }
+        else if (ev.type == SDL_KEYDOWN) {
+            SDL_Keycode sym = ev.key.keysym.sym;
+            uint8_t key;
+            if ((ev.key.keysym.mod & KMOD_CTRL) && sym >= 'a' && sym <= 'z')
+                queue_host_char(sym & 0x1f);
+            else if (sym == SDLK_RETURN || sym == SDLK_BACKSPACE || sym == SDLK_TAB ||
+                    sym == SDLK_ESCAPE || sym == SDLK_DELETE)
+                queue_host_char(sym);
+            else {
+                key = sym == SDLK_UP ? KEY_UP : sym == SDLK_DOWN ? KEY_DOWN :
+                      sym == SDLK_LEFT ? KEY_LEFT : sym == SDLK_RIGHT ? KEY_RIGHT :
+                      sym == SDLK_F3 ? KEY_SETUP : 0;
+                if (key)
+                    queue_host_key(&key, 1);
+            }
+        }
+    }
+}
+
+// Start feeding the next typed key, if the keyboard port is free
+static void feed_host_key() {
+    if (key_count > 0 || host_key_head == host_key_tail)
+        return;
+    memcpy(key_feed, host_keys[host_key_head], host_key_len[host_key_head]);
+    key_count = host_key_len[host_key_head];
+    key_times = 0;
+    key_index = 0;
+    key_pause = conf_pause;
+    key_from_host = true;
+    host_key_head = (host_key_head + 1) % HOST_KEYS;
+}
+
+static void print_screen_rows(const screen_text_row *rows, int nrows) {
+    char width_ch[4] = { 'B', 'T', '2', '1' };
+    for (int r = 0; r < nrows; ++r) {
+        int len = screen_text_trimmed(rows[r].text);
+        printf("%2d %s%c \"%.*s\"\n", r + 1, LINE_SCROLLS(rows[r].line_attr) ? "S" : "-",
+            width_ch[(rows[r].line_attr >> 1) & 3], len, rows[r].text);
+        int attr_len = strlen(rows[r].attrs);
+        while (attr_len > 0 && rows[r].attrs[attr_len - 1] == '.')
+            --attr_len;
+        if (attr_len > 0)
+            printf("%2d attr \"%.*s\"\n", r + 1, attr_len, rows[r].attrs);
+    }
+}
+
+// Compare the screen against an expect-screen command
+static void expect_screen(const script_cmd *cmd) {
+    screen_text_row rows[SCREEN_TEXT_ROWS];
+    int nrows = screen_text_read(rows, have_avo);
+    int kind = cmd->payload[0];
+    int row = cmd->payload[1] - 1;
+    const char *want = (const char *)&cmd->payload[2];
+    bool pass;
+
+    if (kind == EXPECT_SHOW) {
+        print_screen_rows(rows, nrows);
+        printf("Screen hash %016llx\n", (unsigned long long)screen_text_hash(rows, nrows));
+        return;
+    }
+    if (kind == EXPECT_HASH) {
+        uint64_t want_hash = script_u32(cmd, 2) | (uint64_t)script_u32(cmd, 6) << 32;
+        uint64_t hash = screen_text_hash(rows, nrows);
+        pass = hash == want_hash;
+        if (!pass) {
+            printf("FAIL line %d: screen hash %016llx, expected %016llx\n", cmd->line,
+                (unsigned long long)hash, (unsigned long long)want_hash);
+            print_screen_rows(rows, nrows);
+        }
+    }
+    else {
+        const char *got = "";
+        if (row < nrows)
+            got = kind == EXPECT_ATTR ? rows[row].attrs : rows[row].text;
+        // Text is compared without trailing spaces, attributes without trailing "none"
+        int len = kind == EXPECT_ATTR ? (int)strlen(got) : screen_text_trimmed(got);
+        while (kind == EXPECT_ATTR && len > 0 && got[len - 1] == '.')
+            --len;
+        int want_len = strlen(want);
+        while (want_len > 0 && want[want_len - 1] == (kind == EXPECT_ATTR ? '.' : ' '))
+            --want_len;
+        pass = len == want_len && strncmp(got, want, len) == 0;
+        if (!pass)
+            printf("FAIL line %d: row %d %s\n  expected \"%.*s\"\n  actual   \"%.*s\"\n", cmd->line, row + 1,
+                kind == EXPECT_ATTR ? "attributes" : "text", want_len, want, len, got);
+    }
+    ++screen_checks;
+    if (!pass)
+        ++screen_failures;
+}
+
+void save_devices(device_state *d) {
+    d->kbdi = kbdi;
+    d->reci = reci;
+    d->vbi = vbi;
+    d->next_vbi = next_vbi;
+    d->next_reci = next_reci;
+    d->next_kbdi = next_kbdi;
+    d->next_lba7 = next_lba7;
+    d->last_screen = last_screen;
+    d->rx_gap = rx_gap;
+    d->key_gap = key_gap;
+    d->keyboard_status = keyboard_status;
+    d->lba7 = lba7;
+    memcpy(d->key_feed, key_feed, sizeof(key_feed));
+    d->key_times = key_times;
+    d->key_count = key_count;
+    d->key_index = key_index;
+    d->key_pause = key_pause;
+    d->key_from_host = key_from_host;
+    d->conf_pause = conf_pause;
+    d->need_command = need_command;
+    d->feeding_pause = feeding_pause;
+    d->started_command = started_command;
+    d->pause_cycles = pause_cycles;
+    d->feeding_wait = feeding_wait;
+    d->wait_kind = wait_kind;
+    d->wait_frame = wait_frame;
+    d->wait_limit = wait_limit;
+    d->remaining_cycles = remaining_cycles;
+    d->receive_count = receive_count;
+    d->receive_index = receive_index;
+    memcpy(d->receive_feed, receive_feed, sizeof(receive_feed));
+    d->pusart_mode = pusart_mode;
+    d->pusart_command = pusart_command;
+    d->pusart_mode_byte = pusart_mode_byte;
+    d->baud_speed = baud_speed;
+    d->baud_timing = baud_timing;
+    d->baud_forced = baud_forced;
+    d->rx_chars = rx_chars;
+    d->first_rx = first_rx;
+    d->last_rx = last_rx;
+    d->xoff_count = xoff_count;
+    d->first_xoff = first_xoff;
+    d->host_held = host_held;
+    d->nvr_latch = nvr_latch;
+    d->have_avo = have_avo;
+    d->have_gpo = have_gpo;
+    d->have_stp = have_stp;
+    d->have_loopback = have_loopback;
+    d->bug_ram = bug_ram;
+    d->bug_pusart = bug_pusart;
+    d->dc011_132_columns = dc011_132_columns;
+    d->dc012_reverse_field = dc012_reverse_field;
+    d->dc012_blink_ff = dc012_blink_ff;
+    d->dc012_scroll_latch = dc012_scroll_latch;
+    d->dc012_scroll_latch_low = dc012_scroll_latch_low;
+    d->dc012_basic_attribute_reverse = dc012_basic_attribute_reverse;
+    d->frame_count = frame_count;
+    er1400_snapshot(&d->nvr);
+    serial_stream_snapshot(&d->stream);
+}
+
+void restore_devices(const device_state *d) {
+    kbdi = d->kbdi;
+    reci = d->reci;
+    vbi = d->vbi;
+    next_vbi = d->next_vbi;
+    next_reci = d->next_reci;
+    next_kbdi = d->next_kbdi;
+    next_lba7 = d->next_lba7;
+    last_screen = d->last_screen;
+    rx_gap = d->rx_gap;
+    key_gap = d->key_gap;
+    keyboard_status = d->keyboard_status;
+    lba7 = d->lba7;
+    memcpy(key_feed, d->key_feed, sizeof(key_feed));
+    key_times = d->key_times;
+    key_count = d->key_count;
+    key_index = d->key_index;
+    key_pause = d->key_pause;
+    key_from_host = d->key_from_host;
+    conf_pause = d->conf_pause;
+    need_command = d->need_command;
+    feeding_pause = d->feeding_pause;
+    started_command = d->started_command;
+    pause_cycles = d->pause_cycles;
+    feeding_wait = d->feeding_wait;
+    wait_kind = d->wait_kind;
+    wait_frame = d->wait_frame;
+    wait_limit = d->wait_limit;
+    remaining_cycles = d->remaining_cycles;
+    receive_count = d->receive_count;
+    receive_index = d->receive_index;
+    memcpy(receive_feed, d->receive_feed, sizeof(receive_feed));
+    pusart_mode = d->pusart_mode;
+    pusart_command = d->pusart_command;
+    pusart_mode_byte = d->pusart_mode_byte;
+    baud_speed = d->baud_speed;
+    baud_timing = d->baud_timing;
+    baud_forced = d->baud_forced;
+    rx_chars = d->rx_chars;
+    first_rx = d->first_rx;
+    last_rx = d->last_rx;
+    xoff_count = d->xoff_count;
+    first_xoff = d->first_xoff;
+    host_held = d->host_held;
+    nvr_latch = d->nvr_latch;
+    have_avo = d->have_avo;
+    have_gpo = d->have_gpo;
+    have_stp = d->have_stp;
+    have_loopback = d->have_loopback;
+    bug_ram = d->bug_ram;
+    bug_pusart = d->bug_pusart;
+    dc011_132_columns = d->dc011_132_columns;
+    dc012_reverse_field = d->dc012_reverse_field;
+    dc012_blink_ff = d->dc012_blink_ff;
+    dc012_scroll_latch = d->dc012_scroll_latch;
+    dc012_scroll_latch_low = d->dc012_scroll_latch_low;
+    dc012_basic_attribute_reverse = d->dc012_basic_attribute_reverse;
+    frame_count = d->frame_count;
+    er1400_restore(&d->nvr);
+    serial_stream_restore(&d->stream);
+}
+
+// Coverage deltas: the map as it was when the last command that lets the
+// machine run (keys, serial data, pauses, waits) started, and its script line.
+// Commands that take no time aren't charged with anything.
+static cov_planes delta_before, delta_now, delta_new;
+static cov_plane delta_syms, delta_found;
+static int delta_line = -1;
+
+static void coverage_delta_init() {
+    cov_plane_table(delta_syms, symtable, 0x0000, 0x2000);
+    delta_line = -1;
+}
+
+static void coverage_delta_begin(const i8080 *c, int line) {
+    cov_planes_from(&delta_before, c->coverage);
+    delta_line = line;
+}
+
+// Report what has been executed in the ROM since coverage_delta_begin()
+static void coverage_delta_end(const i8080 *c) {
+    if (delta_line < 0)
+        return;
+    cov_planes_from(&delta_now, c->coverage);
+    cov_planes_diff(&delta_new, &delta_now, &delta_before);
+    const uint64_t *exec = cov_planes_flag(&delta_new, COV_EXEC);
+    cov_plane_and(delta_found, delta_syms, exec);
+    unsigned long bytes = cov_plane_count(exec, 0x0000, 0x2000);
+    unsigned long syms = cov_plane_count(delta_found, 0x0000, 0x2000);
+    if (bytes == 0)
+        printf("Coverage from line %d: nothing new\n", delta_line);
+    else {
+        printf("Coverage from line %d: %lu bytes, %lu symbols", delta_line, bytes, syms);
+        for (uint32_t addr = cov_plane_next(delta_found, 0x0000, 0x2000, true); addr < 0x2000;
+                addr = cov_plane_next(delta_found, addr + 1, 0x2000, true))
+            printf(" %s", symtable[addr]);
+        printf("\n");
+    }
+    delta_line = -1;
+}
+
+// Watches, hooks, snapshots and captures aren't part of a snapshot, so a
+// rewind leaves them as they were, and setting them up again would double them
+static bool survives_rewind(int opcode) {
+    return opcode == CMD_WATCH || opcode == CMD_BREAK || opcode == CMD_TRACE ||
+        opcode == CMD_SNAPSHOT || opcode == CMD_RECORD || opcode == CMD_FRAMES;
+}
+
+// Commands normally come from the script, but after a rewind they are
+// replayed from the input log, at the same cycles they were first executed,
+// until we have caught up with the point we rewound from. A command replayed
+// at a different cycle fails the run.
+//
+static bool next_command(const i8080 *c, script *s, script_cmd *cmd) {
+    replaying = replay_index < replay_end;
+    if (replaying) {
+        unsigned long logged_cyc;
+        size_t resume = s->pos;
+        s->pos = inputlog_entry(replay_index++, &logged_cyc);
+        if (logged_cyc != c->cyc) {
+            printf("Replay diverged: command logged at cycle %lu replayed at %lu\n", logged_cyc, c->cyc);
+            ++replay_divergences;
+        }
+        script_next(s, cmd);
+        s->pos = resume;
+        if (replay_index == replay_end)
+            printf("Replay caught up at cycle %lu\n", c->cyc);
+        return true;
+    }
+    size_t pos = s->pos;
+    if (!script_next(s, cmd))
+        return false;
+    // A rewind isn't replayed, or we'd never catch up
+    if (cmd->opcode != CMD_REWIND)
+        inputlog_record(c->cyc, pos);
+    return true;
+}
+
+// Nothing more for the receiver from the script, and the firmware's receive
+// buffer empty
+static bool rx_drained() {
+    return receive_index >= receive_count && !serial_stream_active() && next_reci == 0 && !reci &&
+        memory[LOC_RX_HEAD] == memory[LOC_RX_TAIL];
+}
+
+static bool wait_holds(const i8080 *c) {
+    if (!feeding_wait)
+        return false;
+    bool idle = (idle_loop_addr < 0 || c->pc == idle_loop_addr) && rx_drained();
+    switch (wait_kind) {
+    case WAIT_IDLE:
+        return idle;
+    case WAIT_SCROLL:
+        // As wait_scroll, and the shuffle that relinks the lines at the end
+        // done too. Between lines, wait_scroll's condition holds for a few
+        // instructions, so the firmware must be idle as well.
+        return idle && (memory[LOC_SMOOTH_SCROLL] | memory[LOC_SCROLL_PENDING] | memory[LOC_SHUFFLE_READY]) == 0;
+    case WAIT_RX_EMPTY:
+        return rx_drained();
+    case WAIT_FRAME:
+        return frame_count >= wait_frame;
+    }
+    return true;
+}
+
+// The cycle that an idle loop may be skipped up to: the first thing the run
+// loop would do, other than step the CPU and clock LBA7 (which idle_head()
+// keeps going). Returns 0 if something needs doing now.
+//
+static unsigned long idle_horizon(const i8080 *c) {
+    if (need_command || snapshot_due || rewind_pending || c->interrupt_pending || er1400_clocked())
+        return 0;
+    if (firmware_ready && !started_command)
+        return 0;
+    if (opt_pty && started_command && next_pty_poll == 0)
+        return 0;
+    unsigned long limit = next_vbi;
+    if (last_screen + 100000 < limit)
+        limit = last_screen + 100000;
+    if (next_reci != 0 && !host_held && next_reci < limit)
+        limit = next_reci;
+    if (next_kbdi != 0 && next_kbdi < limit)
+        limit = next_kbdi;
+    if (!started_command && command_pause < limit)
+        limit = command_pause;
+    if (pty_active() && next_pty_poll < limit)
+        limit = next_pty_poll;
+    if (serial_stream_active() && next_reci == 0 && next_stream_poll < limit)
+        limit = next_stream_poll;
+    if (opt_coverage && next_cov < limit)
+        limit = next_cov;
+    if (feeding_pause && pause_cycles < limit)
+        limit = pause_cycles;
+    if (feeding_wait && wait_limit < limit)
+        limit = wait_limit;
+    if (remaining_cycles > 0 && remaining_cycles < limit)
+        limit = remaining_cycles;
+    return limit;
+}
+
+// Cycles the CPU has spent halted, waiting for an interrupt
+unsigned long halt_cycles = 0;
+
+// A halted CPU does nothing until an interrupt, so rather than go round the
+// run loop for each cycle, move straight on to the first cycle at which the
+// loop has something to do. LBA7 keeps going, as it would for a CPU that
+// checked it every cycle.
+//
+static void halt_sleep(i8080 *c) {
+    unsigned long until = idle_horizon(c);
+    unsigned long wake = until > c->cyc ? until + 1 : c->cyc + 4;
+
+    idle_disturb();
+    if (er1400_clocked()) {
+        while (next_lba7 + 1 < wake) {
+            lba7 = !lba7;
+            er1400_clock(lba7);
+            next_lba7 += 89;
+        }
+    }
+    else if (next_lba7 + 1 < wake) {
+        // Nothing is listening, so just work out where LBA7 gets to
+        unsigned long toggles = (wake - next_lba7 - 2) / 89 + 1;
+        lba7 ^= toggles & 1;
+        next_lba7 += toggles * 89;
+    }
+    halt_cycles += wake - c->cyc;
+    c->cyc = wake;
+}
+
+// Executes one instruction, with the checks that follow each one
+static inline void step(i8080 *c) {
+    if (lockstep_active)
+        lockstep_before(c);
+    if (stack_monitor_active)
+        stack_monitor_before(c);
+    i8080_step(c);
+    if (lockstep_active && !lockstep_after(c))
+        host_quit = true;
+    if (stack_monitor_active)
+        stack_monitor_after(c);
+    if (idle_tracking)
+        idle_step(c);
+}
+
+// Translated blocks run as the instructions would, between the checks that
+// run_ahead() makes, but not with the checks that step() makes after each one.
+// Lockstep checks a whole block at once instead.
+static inline bool jit_usable() {
+    return opt_jit && !stack_monitor_active && !idle_tracking && !feeding_wait;
+}
+
+// Runs a translated block if there is one at the PC
+static inline bool jit_block(i8080 *c, unsigned long until) {
+    if (lockstep_active)
+        lockstep_before(c);
+    if (!jit_step(c, until))
+        return false;
+    if (lockstep_active && !lockstep_after_block(c))
+        host_quit = true;
+    return true;
+}
+
+// The run loop's reasons to stop running ahead that blocks can run into
+static bool jit_stop() {
+    return io_happened || watch_pending;
+}
+
+// Runs instructions until the first boundary past cycle until, with nothing
+// to do between them. Stops early where the run loop has something to do
+// before the next instruction: a hook or idle loop head, a watched write, a
+// halt, I/O that may have scheduled an event, or a wait that is over.
+//
+static void run_ahead(i8080 *c, unsigned long until) {
+    do {
+        io_happened = false;
+        if (!jit_usable() || !jit_block(c, until))
+            step(c);
+    } while (c->cyc <= until && !io_happened && !watch_pending && !c->halted &&
+             !idle_hit(c->pc) && !hook_hit(c->pc) && !wait_holds(c));
+}
+
+// Everything that decides how the terminal powers up, with the coverage map
+// as seeded, so that a fast boot never starts a run from the wrong machine
+static uint64_t boot_key(const i8080 *c) {
+    er1400_snap nvr;
+    er1400_snapshot(&nvr);
+    int options[] = { have_avo, have_gpo, have_stp, have_loopback, bug_ram, bug_pusart, nvr.is_faulty };
+    uint32_t version = BOOT_CACHE_VERSION;
+    uint64_t h = boot_cache_hash(BOOT_CACHE_SEED, &version, sizeof(version));
+    h = boot_cache_hash(h, memory, 0x2000);
+    h = boot_cache_hash(h, nvr.mem, sizeof(nvr.mem));
+    h = boot_cache_hash(h, options, sizeof(options));
+    h = boot_cache_hash(h, &command_pause, sizeof(command_pause));
+    h = boot_cache_hash(h, &ready_addr, sizeof(ready_addr));
+    return boot_cache_hash(h, c->coverage, 0x10000);
+}
+
+// Registers, flags and cycles, with hashes of memory, the coverage map and
+// the branch maps: enough to tell whether two runs ended the same way
+static void print_final_state(const i8080 *c) {
+    uint64_t branches = BOOT_CACHE_SEED;
+    if (c->taken) {
+        branches = boot_cache_hash(branches, c->taken, 0x10000 / 8);
+        branches = boot_cache_hash(branches, c->not_taken, 0x10000 / 8);
+    }
+    printf("Final state: pc %04x sp %04x a %02x bc %02x%02x de %02x%02x hl %02x%02x "
+           "flags %c%c%c%c%c%c%s cycles %lu memory %016llx coverage %016llx branches %016llx\n",
+        c->pc, c->sp, c->a, c->b, c->c, c->d, c->e, c->h, c->l,
+        c->sf ? 'S' : '-', c->zf ? 'Z' : '-', c->hf ? 'H' : '-', c->pf ? 'P' : '-',
+        c->cf ? 'C' : '-', c->iff ? 'I' : '-', c->halted ? " halted" : "", c->cyc,
+        (unsigned long long)boot_cache_hash(BOOT_CACHE_SEED, memory, MEMORY_SIZE),
+        (unsigned long long)boot_cache_hash(BOOT_CACHE_SEED, c->coverage, 0x10000),
+        (unsigned long long)branches);
+}
+
+// Scripts that make the self test fail need it run for real
+static bool script_sets_bugs(script *s) {
+    script_cmd cmd;
+    size_t pos = s->pos;
+    bool bugs = false;
+    s->pos = 0;
+    while (!bugs && script_next(s, &cmd))
+        bugs = cmd.opcode == CMD_BUG;
+    s->pos = pos;
+    return bugs;
+}
+
 // 8080 clock is main crystal 24.8832 MHz divided by 9, i.e. 2.7648 MHz
 // 60 Hz vertical blank interrupt is therefore every 46080 cycles.
 // LBA 7 changes state every 31.7778 µs, i.e. every 88 cycles (87.859)
 //
-static inline void run_test(i8080* const c, const char* filename, const char *testfile) {
+// The devices as they power up, saved by the first run and restored for each
+// run after it, which would otherwise start where the last one ended
+static device_state power_on;
+static bool have_power_on = false;
+
+void run_test(i8080* const c, const char* filename, const char *testfile) {
+    if (!have_power_on)
+        save_devices(&power_on);
+    else
+        restore_devices(&power_on);
+    have_power_on = true;
+    next_cov = 10000;
+    host_quit = false;
+    halt_cycles = 0;
+    i8080_free(c);
     i8080_init(c);
     c->userdata = c;
     c->read_byte = rb;
@@ -964,9 +1710,11 @@ static inline void run_test(i8080* const c, const char* filename, const char *te
     c->port_out = port_out;
     c->iack = int_acknowledge;
     memset(memory, 0, MEMORY_SIZE);
-    bool started_command = false;
+    started_command = false;
     need_command = false;
     feeding_pause = false;
+    feeding_wait = false;
+    waits_timed_out = 0;
     char lasttime[100];
     lasttime[0] = 0;
 
@@ -975,6 +1723,23 @@ static inline void run_test(i8080* const c, const char* filename, const char *te
     if (load_file(filename, 0) != 0) {
         return;
     }
+    if (opt_decode_cache)
+        i8080_set_rom(c, 0x2000);
+    if (opt_jit) {
+        if (jit_init(c)) {
+            jit_stop_at(hook_map);
+            jit_stop_at(idle_map);
+            jit_stop_when(jit_stop);
+        }
+        else
+            fputs("Can't translate the ROM here, so interpreting it\n", stderr);
+    }
+    if (opt_coverage && !i8080_record_branches(c))
+        fputs("Couldn't allocate branch maps\n", stderr);
+    if (opt_lockstep)
+        lockstep_start(memory, 0x2000);
+    if (opt_stack_monitor)
+        stack_monitor_start();
     printf("*** TEST: %s\n", filename);
 
     er1400_load("er1400.bin");
@@ -986,53 +1751,157 @@ static inline void run_test(i8080* const c, const char* filename, const char *te
 
     c->pc = 0;
 
-    FILE *cmdf = fopen(testfile, "r");
-    if (!cmdf) {
-        fprintf(stderr, "No command file\n");
-        exit(1);
-    }
-
     coverage_read_sym("vt100.sym");
     coverage_read_equ("vt100.equ");
+    if (opt_coverage_deltas)
+        coverage_delta_init();
+
+    // The whole script is compiled (and checked) before the run starts. A
+    // pseudo-terminal session doesn't need a script.
+    script cmds = { NULL, 0, 0, 0 };
+    if (testfile[0] != 0 && !script_load(&cmds, testfile)) {
+        fprintf(stderr, "No usable command file\n");
+        exit(1);
+    }
 
     watch_init();
 
+    hooks_init();
+    hook_add(0x0a14, hook_pop_to_ground, "pop_to_ground", NULL); // about to pop stack
+    hook_add(0x00ca, hook_nvr_failed, "nvr_failed", NULL);
+    hook_add(0x0ea4, hook_curkey_report, "curkey_report", NULL);
+    hook_add(0x0f18, hook_send_key_byte, "send_key_byte", NULL);
+    if (opt_quit_at) {
+        int addr = hook_parse_addr(opt_quit_at);
+        if (addr < 0) {
+            fprintf(stderr, "Unknown address %s\n", opt_quit_at);
+            exit(1);
+        }
+        hook_add(addr, hook_quit, opt_quit_at, NULL);
+    }
+    firmware_ready = false;
+    idle_loop_addr = hook_parse_addr("idle_loop");
+    ready_addr = opt_auto_start ? idle_loop_addr : -1;
+    if (ready_addr >= 0)
+        hook_add(ready_addr, hook_ready, "idle_loop", NULL);
+
+    idle_init();
+    idle_clock(&lba7, &next_lba7, 88, 0x42, 0x40);
+    if (opt_fast_idle)
+        idle_load("vt100-coverage.txt");
+
+    snapshot_init(sizeof(device_state), max_snapshots);
+    replay_index = replay_end = 0;
+    replay_divergences = 0;
+    script_errors = 0;
+    frame_count = 0;
+    snapshot_due = rewind_pending = false;
+    next_stream_poll = 0;
+
     test_finished = 0;
 
+    // Without a cached boot, the machine is held at the top of each pass
+    // that may start the script, and the last one held is saved
+    bool boot_saving = false;
+    uint64_t key = 0;
+    if (opt_fast_boot && script_sets_bugs(&cmds))
+        printf("Fast boot: the script sets bugs, so running the self test\n");
+    else if (opt_fast_boot) {
+        device_state devices;
+        boot_cache_init(sizeof(device_state));
+        key = boot_key(c);
+        if (boot_cache_load(key, c, &devices)) {
+            restore_devices(&devices);
+            printf("Fast boot: restored the machine at cycle %lu\n", c->cyc);
+        }
+        else
+            boot_saving = true;
+    }
+
     sdl_screen(c, scr_renderer);
 
     while (!test_finished) {
 
-        // uncomment following line to have a debug output of machine state
-        // warning: will output multiple GB of data for the whole test suite
-        if (c->pc == 0x0a14) { // about to pop stack
-            printf("AT POP_TO_GROUND -- stack contains\n");
-            display_stack(c);
-            //dump_memory(c->sp, 2);
+        bool boot_held = false;
+        if (boot_saving && (c->cyc + 1000 > command_pause || c->pc == ready_addr ||
+                            ((c->halted || idle_hit(c->pc)) && idle_horizon(c) == command_pause))) {
+            device_state devices;
+            save_devices(&devices);
+            boot_cache_hold(c, &devices);
+            boot_held = true;
         }
-        //if (c->pc >= 0x186d && c->pc <= 0x1889) {
-        //    i8080_debug_output(c, false);
-        //}
 
-        if (c->pc == 0xca) {
-            printf("NVR FAILED\n");
+        // Snapshots are taken and restored at the top of the loop, so that a
+        // restored machine picks up at exactly the point it was saved.
+        if (snapshot_due) {
+            device_state devices;
+            snapshot_due = false;
+            save_devices(&devices);
+            snapshot_take(c, &devices, replay_index < replay_end ? replay_index : inputlog_count());
+        }
+        if (rewind_pending) {
+            unsigned long target = c->cyc > rewind_cycles ? c->cyc - rewind_cycles : 0;
+            unsigned long from = c->cyc;
+            device_state devices;
+            size_t log_index;
+            rewind_pending = false;
+            if (opt_pty) {
+                // Neither the shell nor keys typed into the window can be
+                // taken back, and they aren't in the input log to replay
+                fprintf(stderr, "Can't rewind with a pseudo-terminal attached\n");
+                ++script_errors;
+            }
+            else if (snapshot_restore(target, c, &devices, &log_index)) {
+                restore_devices(&devices);
+                idle_reset();
+                // Memory below rom_end may have been poked since the snapshot
+                if (c->decoded)
+                    memset(c->decoded, 0, c->rom_end * sizeof(i8080_decoded));
+                jit_flush();
+                replay_index = log_index;
+                replay_end = inputlog_count();
+                printf("Rewound from cycle %lu to snapshot at %lu, replaying %zu commands\n",
+                    from, c->cyc, replay_end - replay_index);
+            }
+            else {
+                fprintf(stderr, "No snapshot at or before cycle %lu\n", target);
+            }
         }
 
-        i8080_step(c);
+        // A wait for the firmware could end part way through a pass, so
+        // passes aren't skipped while there is one
+        if (idle_hit(c->pc))
+            idle_head(c, memory, feeding_wait && wait_kind != WAIT_FRAME ? 0 : idle_horizon(c));
 
-        //dumpx();
-        watch_check();
+        if (hook_hit(c->pc)) {
+            idle_disturb();
+            hook_run(c);
+        }
 
-        if (c->pc == 0xea4) // in curkey_report
-            printf("Popped curkey_queue -> %02x '%c'\n", c->b, (c->b & 0x7f) > 32 ? c->b & 0x7f : '.');
-        if (c->pc == 0x0f18) { // send_key_byte
-            printf("\n\n\nsend_key_byte: %02x '%c'\n", c->a, (c->a & 0x7f) > 32 ? c->a & 0x7f : '.');
+        // Nothing but LBA7 changes before the horizon
+        if (opt_run_ahead) {
+            unsigned long until = idle_horizon(c);
+            run_ahead(c, until < next_lba7 ? until : next_lba7);
         }
+        else
+            step(c);
+        if (c->halted)
+            halt_sleep(c);
+
+        //dumpx();
+        if (watch_pending)
+            watch_check();
 
         if (c->cyc > next_vbi) {
             //sdl_screen(c, scr_renderer);
             vbi = true;
             next_vbi += vbi_cycles;
+            ++frame_count;
+            if (opt_pty) {
+                poll_host_events();
+                feed_host_key();
+            }
+            snapshot_due = snapshot_frames && frame_count % snapshot_frames == 0;
         }
 
         // Although screen is normally refreshed when the vertical blank interrupt
@@ -1045,7 +1914,7 @@ static inline void run_test(i8080* const c, const char* filename, const char *te
             last_screen = c->cyc;
         }
 
-        if (next_reci != 0 && !reci && c->cyc > next_reci) {
+        if (next_reci != 0 && !reci && !host_held && c->cyc > next_reci) {
             reci = true;
         }
 
@@ -1061,161 +1930,239 @@ static inline void run_test(i8080* const c, const char* filename, const char *te
 
         // Level rather than edge!
         c->interrupt_pending = vbi || reci || kbdi;
-
-        if (!started_command && c->cyc > command_pause) {
+        if (c->interrupt_pending)
+            idle_disturb();
+
+        if (!started_command && (firmware_ready || c->cyc > command_pause)) {
+            if (boot_saving && boot_held && boot_cache_save(key))
+                printf("Fast boot: saved the machine for later runs\n");
+            boot_saving = false;
+            // The hook would stop every idle loop pass from being skipped
+            if (ready_addr >= 0)
+                hook_remove(ready_addr, hook_ready);
             started_command = need_command = true;
+            if (opt_serial_stdin && serial_stream_open("-")) {
+                need_command = false;
+                next_reci = serial_stream_more() ? c->cyc + rx_char_gap() : 0;
+            }
+        }
+
+        if (opt_pty && started_command && !pty_active() && next_pty_poll == 0) {
+            if (pty_open(pty_command))
+                printf("Started %s on pseudo-terminal\n", pty_command ? pty_command : "shell");
+            next_pty_poll = c->cyc;
+        }
+        // Only look for shell output when the receiver has nothing else to do
+        if (pty_active() && c->cyc > next_pty_poll) {
+            next_pty_poll = c->cyc + rx_char_gap();
+            pty_flush();
+            if (next_reci == 0 && receive_index >= receive_count && !serial_stream_active() && pty_poll())
+                next_reci = c->cyc + rx_char_gap();
+        }
+
+        // A stream that had nothing ready: see whether more has come, or
+        // whether it has ended
+        if (serial_stream_active() && next_reci == 0 && c->cyc > next_stream_poll) {
+            next_stream_poll = c->cyc + rx_char_gap();
+            if (serial_stream_more())
+                next_reci = c->cyc + rx_char_gap();
+            else if (serial_stream_ended()) {
+                serial_stream_close();
+                need_command = !feeding_pause;
+            }
         }
 
         if (need_command) {
-            char buffer[4096];
-            uint16_t addr;
-
-            if (fgets(buffer, sizeof(buffer), cmdf) != NULL) {
-                printf("Command: %s", buffer); // buffer has LF already
-                uint8_t hex[100];
-                uint8_t nhex;
-                if (( nhex = parse_key(buffer, hex, 100) )) {
+            script_cmd cmd;
+
+            if (next_command(c, &cmds, &cmd)) {
+                if (opt_coverage_deltas)
+                    coverage_delta_end(c);
+                printf("Command: %s", cmd.text); // text has LF already
+                idle_disturb(); // commands can poke memory or registers
+                bool skip = replaying && survives_rewind(cmd.opcode);
+                if (skip)
+                    printf("Not replayed, as it survived the rewind\n");
+                switch (skip ? CMD_NOTE : cmd.opcode) {
+                case CMD_KEY:
                     need_command = false;
-                    for (int i = 0; i < nhex; ++i)
-                        key_feed[i] = hex[i] & 0x7f;
-                    key_count = nhex;
+                    for (int i = 0; i < cmd.payload_len; ++i)
+                        key_feed[i] = cmd.payload[i] & 0x7f;
+                    key_count = cmd.payload_len;
                     key_times = 0;
                     key_index = 0;
                     key_pause = conf_pause;
-                }
-                else if ( strncmp(buffer, "reset", 5) == 0) {
+                    key_from_host = false;
+                    break;
+                case CMD_RESET:
                     c->pc = 0;
+                    c->halted = false;
+                    break;
+                case CMD_KEYGAP:
+                    conf_pause = script_u32(&cmd, 0);
+                    printf("Setting keygap to %d\n", conf_pause);
+                    break;
+                case CMD_RXBAUD: {
+                    double baud = script_u32(&cmd, 0) / 10.0;
+                    if (baud > 0 && pusart_baud_code(baud) < 0)
+                        printf("Warning: the VT100 can't receive at %g baud\n", baud);
+                    baud_timing = true;
+                    baud_forced = baud;
+                    printf("Receiving at %g baud, %lu cycles per character\n", rx_baud(), rx_char_gap());
+                    break;
                 }
-                else if ( strncmp(buffer, "keygap ", 7) == 0) {
-                    int gap;
-                    if (sscanf(&buffer[7], "%d", &gap) == 1) {
-                        printf("Setting keygap to %d\n", gap);
-                        conf_pause = gap;
-                    }
-                }
-                else if (strncmp(buffer, "rxgap ", 6) == 0) {
-                    long gap;
-                    gap = strtol(&buffer[6], NULL, 10);
-                    printf("Setting rxgap to %ld cycles\n", gap);
-                    rx_gap = gap;
-                }
-                else if (( nhex = parse_serial(buffer, hex, 100) )) {
+                case CMD_RXGAP:
+                    rx_gap = script_u32(&cmd, 0);
+                    printf("Setting rxgap to %ld cycles\n", (long)rx_gap);
+                    baud_timing = host_held = false;
+                    break;
+                case CMD_SERIAL:
                     need_command = false;
-                    for (int i = 0; i < nhex; ++i)
-                        receive_feed[i] = hex[i] & 0x7f;
-                    receive_count = nhex;
+                    for (int i = 0; i < cmd.payload_len; ++i)
+                        receive_feed[i] = cmd.payload[i] & 0x7f;
+                    receive_count = cmd.payload_len;
                     receive_index = 0;
-                    next_reci = c->cyc + rx_gap;
-                }
-                else if (( pause_cycles = parse_pause(buffer) )) {
+                    next_reci = c->cyc + rx_char_gap();
+                    break;
+                case CMD_SERIAL_FILE:
+                    if (serial_stream_open((const char *)cmd.payload)) {
+                        printf("Streaming serial data from %s\n", (const char *)cmd.payload);
+                        need_command = false;
+                        next_reci = serial_stream_more() ? c->cyc + rx_char_gap() : 0;
+                    }
+                    break;
+                case CMD_PAUSE:
+                    pause_cycles = script_u32(&cmd, 0);
                     printf("Pause for %lu cycles\n", pause_cycles);
                     need_command = false;
                     feeding_pause = true;
                     pause_cycles = c->cyc + pause_cycles;
-                }
-                else if ( strncmp(buffer, "local", 5) == 0 ) {
+                    break;
+                case CMD_WAIT:
+                    wait_kind = cmd.payload[0];
+                    if ((wait_kind == WAIT_IDLE || wait_kind == WAIT_SCROLL) && idle_loop_addr < 0)
+                        printf("No idle_loop symbol, so not waiting for the firmware to be idle\n");
+                    wait_frame = frame_count + script_u32(&cmd, 1);
+                    wait_limit = c->cyc + wait_timeout;
+                    need_command = false;
+                    feeding_wait = true;
+                    break;
+                case CMD_LOCAL:
                     printf("Forcing local mode\n");
                     memory[LOC_LOCAL_MODE] = 0x20;
-                }
-                else if ( strncmp(buffer, "online", 6) == 0 ) {
+                    break;
+                case CMD_ONLINE:
                     printf("Forcing online mode\n");
                     memory[LOC_LOCAL_MODE] = 0;
-                }
-                else if (parse_dump(buffer, &addr, &nhex)) {
-                    dump_memory(addr, nhex);
-                }
-                else if (strncmp(buffer, "log ", 4) == 0) {
-                    // already echoing commands - do something
-                    // else if we don't echo commands by default
-                }
-                else if (strncmp(buffer, "have ", 5) == 0) {
-                    if (strncmp(&buffer[5], "avo", 3) == 0)
-                        have_avo = 1;
-                    else if (strncmp(&buffer[5], "gpo", 3) == 0)
-                        have_gpo = 1;
-                    else if (strncmp(&buffer[5], "stp", 3) == 0)
-                        have_stp = 1;
-                    else if (strncmp(&buffer[5], "loopback", 8) == 0) {
-                        have_loopback = 1;
-                        printf("FITTED loopback connector\n");
-                    }
-                }
-                else if (strncmp(buffer, "missing ", 8) == 0) {
-                    if (strncmp(&buffer[8], "avo", 3) == 0)
-                        have_avo = 0;
-                    else if (strncmp(&buffer[8], "gpo", 3) == 0)
-                        have_gpo = 0;
-                    else if (strncmp(&buffer[8], "stp", 3) == 0)
-                        have_gpo = 0;
-                    else if (strncmp(&buffer[8], "loopback", 8) == 0) {
-                        have_loopback = 0;
-                        printf("REMOVED loopback connector\n");
-                    }
-                }
-                else if (strncmp(buffer, "bug ", 4) == 0) {
-                    if (strncmp(&buffer[4], "nvr", 3) == 0) {
-                        er1400_bug(1); 
-                    }
-                    else if (strncmp(&buffer[4], "ram", 3) == 0) {
-                        bug_ram = 1;
-                    }
-                    else if (strncmp(&buffer[4], "pusart", 6) == 0) {
-                        bug_pusart = 1;
+                    break;
+                case CMD_DUMP:
+                    dump_memory(script_u16(&cmd, 0), cmd.payload[2]);
+                    break;
+                case CMD_HAVE:
+                case CMD_MISSING: {
+                    int fitted = cmd.opcode == CMD_HAVE;
+                    switch (cmd.payload[0]) {
+                    case OPTION_AVO: have_avo = fitted; break;
+                    case OPTION_GPO: have_gpo = fitted; break;
+                    case OPTION_STP: have_stp = fitted; break;
+                    case OPTION_LOOPBACK:
+                        have_loopback = fitted;
+                        printf(fitted ? "FITTED loopback connector\n" : "REMOVED loopback connector\n");
+                        break;
                     }
+                    break;
                 }
-                else if (strncmp(buffer, "nobug ", 6) == 0) {
-                    if (strncmp(&buffer[6], "nvr", 3) == 0) {
-                        er1400_bug(0);
-                    }
-                    else if (strncmp(&buffer[6], "ram", 3) == 0) {
-                        bug_ram = 0;
-                    }
-                    else if (strncmp(&buffer[6], "pusart", 6) == 0) {
-                        bug_pusart = 0;
+                case CMD_BUG:
+                case CMD_NOBUG: {
+                    int bug = cmd.opcode == CMD_BUG;
+                    switch (cmd.payload[0]) {
+                    case BUG_NVR: er1400_bug(bug); break;
+                    case BUG_RAM: bug_ram = bug; break;
+                    case BUG_PUSART: bug_pusart = bug; break;
                     }
+                    break;
                 }
-                else if (strncmp(buffer, "poke ", 5) == 0) {
-                    uint16_t loc;
-                    uint8_t  val;
-                    if (sscanf(&buffer[5], "%4hx,%2hhx", &loc, &val) == 2) {
-                        printf("POKE %04x <- %02x\n", loc, val);
-                        memory[loc] = val;
-                    }
+                case CMD_POKE: {
+                    uint16_t loc = script_u16(&cmd, 0);
+                    uint8_t val = cmd.payload[2];
+                    printf("POKE %04x <- %02x\n", loc, val);
+                    if (watch_hit(loc))
+                        watch_write(loc, memory[loc], c->pc);
+                    memory[loc] = val;
+                    i8080_invalidate(c, loc);
+                    break;
                 }
-                else if (strncmp(buffer, "dumpx", 5) == 0) {
+                case CMD_DUMPX:
                     dumpx();
-                }
-                else if (strncmp(buffer, "switches", 8) == 0) {
+                    break;
+                case CMD_SWITCHES:
                     dump_switches();
-                }
-                else if (strncmp(buffer, "covrw ", 6) == 0) {
-                    uint16_t loc, len;
-                    if (sscanf(&buffer[6], "%4hx,%4hx", &loc, &len) == 2) {
-                        printf("COVERAGE\n");
-                        coverage_rw(c, loc, len);
+                    break;
+                case CMD_COVRW:
+                    printf("COVERAGE\n");
+                    coverage_rw(c, script_u16(&cmd, 0), script_u16(&cmd, 2));
+                    break;
+                case CMD_WATCH:
+                    watch_add(script_u16(&cmd, 0), cmd.payload[2]);
+                    break;
+                case CMD_STACK:
+                    display_stack(c);
+                    if (stack_monitor_active) {
+                        printf("Call path:\n");
+                        stack_monitor_print_path(c);
                     }
-                    else {
-                        fprintf(stderr, "Couldn't read <addr>,<len> from: %s", buffer);
+                    break;
+                case CMD_BREAK:
+                case CMD_TRACE: {
+                    hook_cond cond;
+                    cond.operand = cmd.payload[2];
+                    cond.mem_addr = script_u16(&cmd, 3);
+                    cond.op = cmd.payload[5];
+                    cond.value = script_u16(&cmd, 6);
+                    if (!hook_add(script_u16(&cmd, 0), cmd.opcode == CMD_BREAK ? hook_break : hook_trace,
+                            (const char *)&cmd.payload[8], &cond)) {
+                        fprintf(stderr, "%s:%d: too many hooks to add %s\n", testfile, cmd.line,
+                            cmd.opcode == CMD_BREAK ? "break" : "trace");
+                        ++script_errors;
                     }
+                    break;
                 }
-                else if (strncmp(buffer, "watch ", 6) == 0) {
-                    uint16_t loc;
-                    int interp = 0;
-                    int params = sscanf(&buffer[6], "%4hx,%d", &loc, &interp);
-                    if (params >= 1) {
-                        watch_add(loc, interp);
-                    }
-                    else {
-                        fprintf(stderr, "Couldn't read <addr> from: %s", buffer);
-                    }
+                case CMD_SNAPSHOT:
+                    snapshot_frames = script_u32(&cmd, 0);
+                    printf("Snapshot every %lu frames\n", snapshot_frames);
+                    break;
+                case CMD_REWIND:
+                    rewind_cycles = script_u32(&cmd, 0);
+                    rewind_pending = true;
+                    break;
+                case CMD_EXPECT_SCREEN:
+                    expect_screen(&cmd);
+                    break;
+                case CMD_SCREENSHOT:
+                    if (capture_screen(c) && capture_write_png((const char *)cmd.payload))
+                        printf("Screenshot saved to %s\n", (const char *)cmd.payload);
+                    break;
+                case CMD_FRAMES: {
+                    const char *dir = (const char *)&cmd.payload[9];
+                    int frames = script_u32(&cmd, 1);
+                    if (frames_start(dir, frames, cmd.payload[0], script_u32(&cmd, 5)))
+                        printf("%s %d frames %s %s\n", cmd.payload[0] ? "Saving" : "Checking", frames,
+                            cmd.payload[0] ? "to" : "against", dir);
+                    break;
                 }
-                else if (strncmp(buffer, "stack", 5) == 0) {
-                    display_stack(c);
+                case CMD_RECORD:
+                    if (capture_record_start((const char *)&cmd.payload[4], script_u32(&cmd, 0)))
+                        printf("Recording %u frames to %s\n", script_u32(&cmd, 0), (const char *)&cmd.payload[4]);
+                    break;
                 }
+                if (opt_coverage_deltas && !need_command)
+                    coverage_delta_begin(c, cmd.line);
             }
             else {
-                printf("Finished commands\n");
-                remaining_cycles = c->cyc + 5000000;
+                if (remaining_cycles == 0) {
+                    printf("Finished commands\n");
+                    remaining_cycles = c->cyc + 5000000;
+                }
                 need_command = false;
             }
         }
@@ -1232,78 +2179,98 @@ static inline void run_test(i8080* const c, const char* filename, const char *te
             need_command = true;
         }
 
-        test_finished = remaining_cycles > 0 && c->cyc > remaining_cycles;
-
-        char timestr[100];
-        sprintf(timestr, "Time %.4f\n", c->cyc / 2764800.0);
-        if (strcmp(timestr, lasttime) != 0) {
-            //printf(timestr);
-            strcpy(lasttime, timestr);
-            SLEEP_100US();
+        if (feeding_wait && (wait_holds(c) || c->cyc > wait_limit)) {
+            if (wait_holds(c))
+                printf("Waited until cycle %lu\n", c->cyc);
+            else {
+                printf("Wait timed out at cycle %lu\n", c->cyc);
+                ++waits_timed_out;
+            }
+            feeding_wait = false;
+            need_command = true;
         }
 
-    }
+        test_finished = (remaining_cycles > 0 && c->cyc > remaining_cycles && !pty_active()) || host_quit;
 
-    int numexec = 0;
-    int totsyms = 0;
-    for (uint16_t symaddr = 0; symaddr < 0x2000; ++symaddr) {
-        if (symtable[symaddr]) {
-            ++totsyms;
-            if (c->coverage[symaddr] & (COV_EXEC | COV_DATA)) {
-                ++numexec;
-            }
-            else {
-                // Don't count or print unexecuted symbols in unreachable sections!
-                if (!(c->coverage[symaddr] & COV_UNREACH)) {
-                    //printf("sym %04x %s\n", symaddr, symname);
-                }
-                else
-                    --totsyms;
+        if (opt_pace) {
+            char timestr[100];
+            sprintf(timestr, "Time %.4f\n", c->cyc / 2764800.0);
+            if (strcmp(timestr, lasttime) != 0) {
+                //printf(timestr);
+                strcpy(lasttime, timestr);
+                SLEEP_100US();
             }
-            c->coverage[symaddr] |= COV_SYMBOL; // mark we have symbol
         }
+
     }
+
+    if (opt_coverage_deltas)
+        coverage_delta_end(c);
+
+    // The counts and runs come from the coverage map as bit planes
+    static cov_planes planes;
+    static cov_plane syms, used, scratch;
+    cov_planes_from(&planes, c->coverage);
+    cov_plane_table(syms, symtable, 0x0000, 0x2000);
+    cov_plane_any(used, &planes, COV_EXEC | COV_DATA);
+
+    // Don't count unexecuted symbols in unreachable sections!
+    cov_plane_and(scratch, syms, used);
+    int numexec = cov_plane_count(scratch, 0x0000, 0x2000);
+    cov_plane_andnot(scratch, syms, used);
+    cov_plane_and(scratch, scratch, cov_planes_flag(&planes, COV_UNREACH));
+    int totsyms = cov_plane_count(syms, 0x0000, 0x2000) - cov_plane_count(scratch, 0x0000, 0x2000);
+    for (uint32_t symaddr = cov_plane_next(syms, 0x0000, 0x2000, true); symaddr < 0x2000;
+            symaddr = cov_plane_next(syms, symaddr + 1, 0x2000, true))
+        c->coverage[symaddr] |= COV_SYMBOL; // mark we have symbol
     printf("%4d/%4d reachable symbols executed\n", numexec, totsyms);
 
     // Unreachable and uncovered (ROM)
     if (opt_coverage) {
+        // Uncovered: nothing but perhaps a symbol. Unreachable, but used anyway:
+        // reported in address order along with the uncovered runs.
+        cov_plane covered, unreach_used;
+        cov_plane_any(covered, &planes, (uint8_t)~COV_SYMBOL);
+        cov_plane_any(unreach_used, &planes, (uint8_t)~(COV_UNREACH | COV_SYMBOL));
+        cov_plane_and(unreach_used, unreach_used, cov_planes_flag(&planes, COV_UNREACH));
+
         int uncovered_bytes = 0;
-        int start_uncovered = -1;
-        for (int addr = 0x0000; addr < 0x2000; ++addr) {
-            if (c->coverage[addr] == 0 || c->coverage[addr] == COV_SYMBOL) {
-                if (start_uncovered < 0) // not currently in a section
-                    start_uncovered = addr;
-            }
-            else {
-                if (start_uncovered >= 0) {
-                    int foundback = -1;
-                    for (int back = 0; back < 32; ++back) {
-                        if (symtable[start_uncovered - back]) {
-                            foundback = back;
-                            break;
-                        }
-                    }
-                    if (foundback >= 0)
-                        printf("uncovered %04x - %04x (%2d bytes) %s + %d\n", start_uncovered, addr - 1, addr - start_uncovered,
-                                symtable[start_uncovered - foundback], foundback);
-                    else
-                        printf("uncovered %04x - %04x (%2d bytes)\n", start_uncovered, addr - 1, addr - start_uncovered);
-                    uncovered_bytes += addr - start_uncovered;
-                    start_uncovered = -1;
-                }
-            }
-            if ( (c->coverage[addr] & COV_UNREACH) && (c->coverage[addr] & ~(COV_UNREACH | COV_SYMBOL)) ) {
+        uint32_t next_unreach = cov_plane_next(unreach_used, 0x0000, 0x2000, true);
+        uint32_t addr = 0x0000;
+        for (;;) {
+            uint32_t start_uncovered = cov_plane_next(covered, addr, 0x2000, false);
+            // A run that reaches the end of the ROM isn't reported
+            addr = cov_plane_next(covered, start_uncovered, 0x2000, true);
+            for (; next_unreach < addr; next_unreach = cov_plane_next(unreach_used, next_unreach + 1, 0x2000, true)) {
+                uint8_t cov = c->coverage[next_unreach];
                 char also[100];
                 also[0] = 0;
-                if (c->coverage[addr] & COV_EXEC) strcat(also, " exec");
-                if (c->coverage[addr] & COV_READ) strcat(also, " read");
-                if (c->coverage[addr] & COV_WRITE) strcat(also, " write");
-                if (c->coverage[addr] & COV_DATA) strcat(also, " data");
-                //if (c->coverage[addr] & COV_SYMBOL) strcat(also, " symbol");
-                printf("unreachable %04x also %s\n", addr, also);
+                if (cov & COV_EXEC) strcat(also, " exec");
+                if (cov & COV_READ) strcat(also, " read");
+                if (cov & COV_WRITE) strcat(also, " write");
+                if (cov & COV_DATA) strcat(also, " data");
+                //if (cov & COV_SYMBOL) strcat(also, " symbol");
+                printf("unreachable %04x also %s\n", next_unreach, also);
+            }
+            if (addr >= 0x2000)
+                break;
+
+            int foundback = -1;
+            for (uint32_t back = 0; back < 32 && back <= start_uncovered; ++back) {
+                if (symtable[start_uncovered - back]) {
+                    foundback = back;
+                    break;
+                }
             }
+            if (foundback >= 0)
+                printf("uncovered %04x - %04x (%2d bytes) %s + %d\n", start_uncovered, addr - 1, addr - start_uncovered,
+                        symtable[start_uncovered - foundback], foundback);
+            else
+                printf("uncovered %04x - %04x (%2d bytes)\n", start_uncovered, addr - 1, addr - start_uncovered);
+            uncovered_bytes += addr - start_uncovered;
         }
         printf("Total uncovered bytes = %d\n", uncovered_bytes);
+        coverage_branches(c, opt_branches);
 
         coverage_rw(c, 0x2000, 0x1000);
 
@@ -1315,67 +2282,54 @@ static inline void run_test(i8080* const c, const char* filename, const char *te
     dump_memory(LOC_ABACK_BUFFER, 0x33);
 
     printf("Total cycles: %ld ~ %.1f seconds\n", c->cyc, c->cyc / 2768000.0);
-
-}
-
-int main(int argc, char *argv[]) {
-    if (!memory_init()) {
-        fputs("Couldn't allocate 64K memory\n", stderr);
-        return 1;
-    }
-
-    //logmem = fopen("logmem.txt", "w");
-
-    i8080 cpu;
-    char testfile[255];
-    if (argc > 1)
-        strcpy(testfile, argv[1]);
-    else
-        strcpy(testfile, "t/vt100-tests.txt"); 
-  
-    FILE *charf = fopen("../bin/23-018E2.bin", "rb");
-    if (charf) {
-        fread(chargen, 1, 2048, charf);
-        fclose(charf);
-    }
-    else {
-        fputs("Missing chargen ROM ../bin/23-018E2.bin\n", stderr);
-    }
-
-    charf = fopen("alt-chargen.bin", "rb");
-    if (charf) {
-        fread(alt_chargen, 1, 2048, charf);
-        fclose(charf);
-    }
-    else {
-        fputs("Missing alt chargen ROM alt-chargen.bin\n", stderr);
-        memset(alt_chargen, 0xff, 2048);
-    }
-
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-        fprintf(stderr, "Could not init: %s\n", SDL_GetError());
+    if (opt_fast_idle)
+        printf("Idle loops: skipped %lu passes, %lu cycles (%.1f%%)\n",
+            idle_passes_skipped(), idle_cycles_skipped(), 100.0 * idle_cycles_skipped() / c->cyc);
+    if (halt_cycles > 0)
+        printf("Halted for %lu cycles\n", halt_cycles);
+    jit_report(c->cyc);
+    jit_free();
+    if (opt_final_state)
+        print_final_state(c);
+    if (opt_lockstep)
+        lockstep_finish();
+    if (opt_stack_monitor)
+        stack_monitor_finish();
+
+    if (baud_timing) {
+        double seconds = (last_rx - first_rx + 1) / (double)CPU_HZ;
+        printf("Received %lu characters at %g baud (%.0f chars/s), ", rx_chars, rx_baud(), rx_chars / seconds);
+        if (xoff_count > 0)
+            printf("%lu XOFF, first at cycle %lu\n", xoff_count, first_xoff);
+        else
+            printf("no XOFF\n");
     }
 
-    if (opt_coverage) {
-        if (SDL_CreateWindowAndRenderer(129 * 7 - 1 + 20, 98 * 7 - 1 + 8, 0, &cov_window, &cov_renderer) < 0) {
-            fprintf(stderr, "Could not create window: %s\n", SDL_GetError());
-        }
-        SDL_SetWindowTitle(cov_window, "Awnty Coverage");
+    if (opt_pty) {
+        double seconds = c->cyc / 2764800.0;
+        printf("PTY: received %lu bytes (%.0f chars/s), sent %lu bytes, %lu XOFF\n",
+            pty_bytes_received(), pty_bytes_received() / seconds, pty_bytes_sent(), xoff_count);
+        pty_close();
     }
 
-    int screen_scale = 1;
-    if (SDL_CreateWindowAndRenderer(screen_scale * (20 + 10 * 80 + 2 * 6), screen_scale * (0 + SCREEN_LINES * 20 + 40 + 2 * 6), 0, &scr_window, &scr_renderer) < 0) {
-        fprintf(stderr, "Could not create window: %s\n", SDL_GetError());
-    }
-    SDL_SetWindowTitle(scr_window, "Awnty Screen");
-    SDL_RenderSetScale(scr_renderer, screen_scale, screen_scale);
+    capture_record_stop();
+    frames_finish();
 
-    run_test(&cpu, "../bin/vt100.bin", testfile);
+    if (screen_checks > 0)
+        printf("Screen checks: %d passed, %d failed\n", screen_checks - screen_failures, screen_failures);
 
-    free(memory);
-    free(cpu.coverage);
+    if (snapshot_count() > 0)
+        printf("Snapshots: %d holding %zu pages\n", snapshot_count(), snapshot_pages_in_use());
+    if (replay_divergences > 0)
+        printf("Replay diverged %d times\n", replay_divergences);
+    if (script_errors > 0)
+        printf("Script errors: %d\n", script_errors);
+    snapshot_free();
+    boot_cache_free();
+    script_free(&cmds);
 
-    SDL_Quit();
+}
 
-    return 0;
+int run_failures() {
+    return screen_failures + frames_failures() + lockstep_failures() + replay_divergences + script_errors;
 }
@@ -0,0 +1,109 @@
+#ifndef AWNTY_H
+#define AWNTY_H
+
+#include "i8080.h"
+
+// The emulated VT100 that runs test scripts, shared by awnty itself and the
+// tools built on it (awnty-bench, awnty-fuzz). run_test() boots the terminal
+// from the ROM and runs a script to the end, as set up by the options below.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <SDL2/SDL.h>
+
+#include "er1400.h"
+#include "serial_stream.h"
+
+extern uint8_t chargen[2048];
+extern uint8_t alt_chargen[2048];
+
+extern const int SCREEN_LINES;
+extern int have_avo;
+
+// Options, normally from the command line
+extern int opt_coverage;
+extern bool opt_headless;
+extern bool opt_serial_stdin;
+extern bool opt_pty;
+extern const char *pty_command; // NULL for the user's shell
+extern bool opt_auto_start;
+extern bool opt_fast_idle;
+extern bool opt_run_ahead;
+extern bool opt_lockstep;
+extern bool opt_stack_monitor;
+extern bool opt_jit;
+extern bool opt_decode_cache;
+extern bool opt_final_state;
+extern bool opt_pace;
+extern const char *opt_quit_at;
+extern bool opt_fast_boot;
+extern bool opt_coverage_deltas;
+extern bool opt_branches;
+
+extern unsigned long wait_timeout; // cycles
+extern int waits_timed_out;        // this run
+extern unsigned long next_cov;
+extern bool host_quit;
+extern unsigned long halt_cycles;
+
+// Called with every memory write the CPU makes
+extern void (*write_observer)(uint16_t addr, uint8_t val);
+
+// Windows, when not headless
+extern SDL_Window *cov_window;
+extern SDL_Renderer *cov_renderer;
+extern SDL_Window *scr_window;
+extern SDL_Renderer *scr_renderer;
+
+// Everything outside the CPU and memory that determines what the machine does
+// next, so that a rewound machine re-executes exactly as it did first time.
+typedef struct device_state {
+    bool kbdi, reci, vbi;
+    unsigned long next_vbi, next_reci, next_kbdi, next_lba7;
+    unsigned long last_screen;
+    unsigned long rx_gap, key_gap;
+    uint8_t keyboard_status;
+    int lba7;
+    uint8_t key_feed[4];
+    int key_times, key_count, key_index, key_pause, conf_pause;
+    bool key_from_host;
+    bool need_command, feeding_pause, started_command;
+    unsigned long pause_cycles, remaining_cycles;
+    bool feeding_wait;
+    int wait_kind;
+    unsigned long wait_frame, wait_limit;
+    unsigned long receive_count, receive_index;
+    int receive_feed[1000];
+    bool pusart_mode;
+    uint8_t pusart_command, pusart_mode_byte, baud_speed;
+    bool baud_timing;
+    double baud_forced;
+    unsigned long rx_chars, first_rx, last_rx, xoff_count, first_xoff;
+    bool host_held;
+    uint8_t nvr_latch;
+    int have_avo, have_gpo, have_stp, have_loopback;
+    int bug_ram, bug_pusart;
+    bool dc011_132_columns;
+    int dc012_reverse_field, dc012_blink_ff, dc012_scroll_latch, dc012_scroll_latch_low, dc012_basic_attribute_reverse;
+    unsigned long frame_count;
+    er1400_snap nvr;
+    serial_stream_snap stream;
+} device_state;
+
+void save_devices(device_state *d);
+void restore_devices(const device_state *d);
+
+// Draw the screen, as the firmware has set it up, on rend (NULL draws nothing)
+void sdl_screen(const i8080 *c, SDL_Renderer *rend);
+
+// Run testfile on the terminal with the ROM in filename. Memory must have been
+// allocated with memory_init(), and the character generator ROMs loaded.
+// c must be zeroed, or have been run before: each run starts from power-on,
+// and frees the maps the last run of c left (see i8080_free()).
+void run_test(i8080 *const c, const char *filename, const char *testfile);
+
+// Checks that failed, replays that diverged and script commands that couldn't
+// be carried out, over all runs
+int run_failures();
+
+#endif
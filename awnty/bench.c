@@ -0,0 +1,424 @@
+// Microbenchmarks for the paths awnty spends its time in, reported as JSON:
+//
+//   i8080_step            the VT100 ROM on flat memory, through the decode cache
+//   i8080_step_uncached   the same, with every instruction fetched and decoded
+//   i8080_jit             the same, translated into native code; an operation
+//                         is a block, or an instruction the JIT left alone
+//   sdl_screen            a full screen into an offscreen software renderer
+//   coverage_graphic_sdl  the coverage map, likewise
+//   cov_planes            the coverage map as bit planes, merged and counted
+//   watch_check           a write to each of many watched locations, then the check
+//   er1400_clock          one edge of the NVR clock
+//   boot                  the whole emulator, from reset to idle_loop
+//   idle_pause            t/idle.txt, a long pause in idle_loop
+//   idle_pause_no_skip    the same, running every idle loop pass
+//
+// Each benchmark is run a number of times (--repeat, default 5) and the
+// fastest run is reported, as ns per operation and, for those that emulate
+// the CPU, emulated cycles per second. Names on the command line select
+// benchmarks. Run from the awnty directory, as for awnty itself.
+//
+// The emulator comes from the same library as awnty's, so each benchmark
+// drives the code awnty runs.
+
+#define SDL_MAIN_HANDLED // main() is our own
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <SDL2/SDL.h>
+
+#include "awnty.h"
+#include "cov_planes.h"
+#include "coverage.h"
+#include "er1400.h"
+#include "i8080.h"
+#include "jit.h"
+#include "quiet.h"
+#include "unused.h"
+#include "vt100_memory.h"
+
+typedef struct bench_result {
+    double seconds;
+    unsigned long ops;
+    unsigned long cycles; // emulated, 0 if not emulating
+} bench_result;
+
+typedef bool (*bench_fn)(bench_result *r);
+
+static double now() {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// Raw CPU: the ROM at 0x0000, RAM above, no devices. Ports read as 0xff, so
+// the firmware settles into its self tests and wait loops, which is as
+// representative an instruction mix as it gets without the rest of awnty.
+static uint8_t flat[0x10000];
+
+static uint8_t flat_rb(void *userdata UNUSED, uint16_t addr) {
+    return flat[addr];
+}
+
+static void flat_wb(void *userdata UNUSED, uint16_t addr, uint8_t val) {
+    if (addr >= 0x2000)
+        flat[addr] = val;
+}
+
+static uint8_t flat_in(void *userdata UNUSED, uint8_t port UNUSED) {
+    return 0xff;
+}
+
+static void flat_out(void *userdata UNUSED, uint8_t port UNUSED, uint8_t value UNUSED) {
+}
+
+static uint8_t flat_iack(void *userdata UNUSED) {
+    return 0xff; // RST 7
+}
+
+static bool bench_step_rom(bench_result *r, bool cached, bool jit) {
+    const unsigned long steps = 20000000;
+    FILE *f = fopen("../bin/vt100.bin", "rb");
+    if (!f) {
+        fprintf(stderr, "Can't open ../bin/vt100.bin\n");
+        return false;
+    }
+    memset(flat, 0, sizeof(flat));
+    size_t len = fread(flat, 1, 0x2000, f);
+    fclose(f);
+    if (len == 0)
+        return false;
+
+    i8080 cpu;
+    i8080_init(&cpu);
+    cpu.read_byte = flat_rb;
+    cpu.write_byte = flat_wb;
+    cpu.port_in = flat_in;
+    cpu.port_out = flat_out;
+    cpu.iack = flat_iack;
+    if (cached)
+        i8080_set_rom(&cpu, 0x2000);
+    if (jit && !jit_init(&cpu)) {
+        fprintf(stderr, "Can't translate the ROM here\n");
+        i8080_free(&cpu);
+        return false;
+    }
+
+    double start = now();
+    for (unsigned long i = 0; i < steps; ++i) {
+        if (!jit || !jit_step(&cpu, ULONG_MAX))
+            i8080_step(&cpu);
+        if (cpu.halted) { // start again rather than time nothing
+            cpu.halted = false;
+            cpu.pc = 0;
+        }
+    }
+    r->seconds = now() - start;
+    r->ops = steps;
+    r->cycles = cpu.cyc;
+    if (jit)
+        jit_free();
+    i8080_free(&cpu);
+    return true;
+}
+
+static bool bench_step(bench_result *r) {
+    return bench_step_rom(r, true, false);
+}
+
+static bool bench_step_uncached(bench_result *r) {
+    return bench_step_rom(r, false, false);
+}
+
+static bool bench_jit(bench_result *r) {
+    return bench_step_rom(r, true, true);
+}
+
+// The emulator, from reset to the firmware's idle loop. This leaves memory,
+// coverage and the rest as a booted terminal has them, for the renderers.
+static i8080 booted;
+static bool have_booted = false;
+
+static bool boot(i8080 *c) {
+    opt_headless = true;
+    opt_pace = false;
+    opt_quit_at = "idle_loop";
+    quiet_begin();
+    run_test(c, "../bin/vt100.bin", "");
+    quiet_end();
+    if (!host_quit) {
+        fprintf(stderr, "The firmware didn't reach idle_loop\n");
+        return false;
+    }
+    return true;
+}
+
+static bool bench_boot(bench_result *r) {
+    double start = now();
+    if (!boot(&booted))
+        return false;
+    r->seconds = now() - start;
+    r->ops = 1;
+    r->cycles = booted.cyc;
+    have_booted = true;
+    return true;
+}
+
+// A long pause, which is mostly spent going round idle_loop
+static bool bench_idle(bench_result *r, bool fast) {
+    static i8080 c;
+    opt_headless = true;
+    opt_pace = false;
+    opt_quit_at = NULL;
+    opt_fast_idle = fast;
+    double start = now();
+    quiet_begin();
+    run_test(&c, "../bin/vt100.bin", "t/idle.txt");
+    quiet_end();
+    r->seconds = now() - start;
+    r->ops = 1;
+    r->cycles = c.cyc;
+    opt_fast_idle = true;
+    return c.cyc >= 200000000;
+}
+
+static bool bench_idle_pause(bench_result *r) {
+    return bench_idle(r, true);
+}
+
+static bool bench_idle_pause_no_skip(bench_result *r) {
+    return bench_idle(r, false);
+}
+
+// Something to draw on every line: the booted screen is blank
+static void fill_screen() {
+    uint16_t addr = 0x2000;
+    uint16_t dmad = (memory[addr + 1] << 8) | memory[addr + 2];
+    for (int row = 0; row < SCREEN_LINES; ++row) {
+        addr = 0x2000 | (dmad & 0xfff);
+        int n = 0;
+        while (n < 255 && memory[addr] != 0x7f) {
+            memory[addr] = 0x21 + (row * 7 + n) % 0x5e;
+            if (have_avo)
+                memory[addr + 0x1000] = 0x0f ^ ((row + n) & 0x07);
+            ++n;
+            addr = 0x2000 | ((addr + 1) & 0xfff);
+        }
+        if (n == 255)
+            break;
+        dmad = (memory[addr + 1] << 8) | memory[(uint16_t)(addr + 2)];
+    }
+}
+
+static bool need_booted() {
+    if (have_booted)
+        return true;
+    have_booted = boot(&booted);
+    return have_booted;
+}
+
+// Offscreen targets, the size of the windows awnty opens
+static SDL_Surface *surface;
+static SDL_Renderer *renderer;
+
+static bool offscreen(int w, int h) {
+    if (renderer)
+        SDL_DestroyRenderer(renderer);
+    if (surface)
+        SDL_FreeSurface(surface);
+    renderer = NULL;
+    surface = SDL_CreateRGBSurface(0, w, h, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
+    if (surface)
+        renderer = SDL_CreateSoftwareRenderer(surface);
+    if (!renderer) {
+        fprintf(stderr, "Could not create offscreen renderer: %s\n", SDL_GetError());
+        return false;
+    }
+    return true;
+}
+
+static bool bench_screen(bench_result *r) {
+    const unsigned long frames = 200;
+    if (!need_booted() || !offscreen(20 + 10 * 80 + 2 * 6, SCREEN_LINES * 20 + 40 + 2 * 6))
+        return false;
+    fill_screen();
+    double start = now();
+    for (unsigned long i = 0; i < frames; ++i)
+        sdl_screen(&booted, renderer);
+    r->seconds = now() - start;
+    r->ops = frames;
+    r->cycles = 0;
+    return true;
+}
+
+static bool bench_coverage(bench_result *r) {
+    const unsigned long frames = 200;
+    if (!need_booted() || !offscreen(129 * 7 - 1 + 20, 98 * 7 - 1 + 8))
+        return false;
+    double start = now();
+    for (unsigned long i = 0; i < frames; ++i)
+        coverage_graphic_sdl(&booted, renderer);
+    r->seconds = now() - start;
+    r->ops = frames;
+    r->cycles = 0;
+    return true;
+}
+
+// What the end-of-run reports and per-command deltas do with the map
+static bool bench_planes(bench_result *r) {
+    const unsigned long rounds = 2000;
+    static cov_planes map, total, delta;
+    if (!need_booted())
+        return false;
+    memset(&total, 0, sizeof(total));
+    unsigned long sink = 0;
+    double start = now();
+    for (unsigned long i = 0; i < rounds; ++i) {
+        cov_planes_from(&map, booted.coverage);
+        sink += cov_planes_diff(&delta, &map, &total);
+        cov_planes_merge(&total, &map);
+        sink += cov_plane_count(cov_planes_flag(&total, COV_EXEC), 0x0000, 0x2000);
+    }
+    r->seconds = now() - start;
+    r->ops = rounds;
+    r->cycles = 0;
+    return sink > 0;
+}
+
+static void watch_ignore(const watch_event *ev UNUSED) {
+}
+
+// As many watches as a script can set, half of them on words
+static bool bench_watch(bench_result *r) {
+    const int nwatch = 1000;
+    const unsigned long rounds = 200;
+    watch_set_handler(watch_ignore);
+    watch_init();
+    for (int w = 0; w < nwatch; ++w)
+        watch_add(0x2000 + 2 * w, w & 1);
+
+    double start = now();
+    for (unsigned long i = 0; i < rounds; ++i) {
+        for (int w = 0; w < nwatch; ++w) {
+            uint16_t addr = 0x2000 + 2 * w;
+            watch_write(addr, memory[addr], 0);
+            ++memory[addr];
+            watch_check();
+        }
+    }
+    r->seconds = now() - start;
+    r->ops = rounds * nwatch;
+    r->cycles = 0;
+    watch_init();
+    watch_set_handler(NULL);
+    return true;
+}
+
+static bool bench_er1400(bench_result *r) {
+    const unsigned long edges = 10000000;
+    er1400_init();
+    double start = now();
+    for (unsigned long i = 0; i < edges; ++i)
+        er1400_clock(i & 1);
+    r->seconds = now() - start;
+    r->ops = edges;
+    r->cycles = 0;
+    return true;
+}
+
+typedef struct bench {
+    const char *name;
+    bench_fn fn;
+} bench;
+
+static const bench benches[] = {
+    { "i8080_step", bench_step },
+    { "i8080_step_uncached", bench_step_uncached },
+    { "i8080_jit", bench_jit },
+    { "boot", bench_boot },
+    { "idle_pause", bench_idle_pause },
+    { "idle_pause_no_skip", bench_idle_pause_no_skip },
+    { "sdl_screen", bench_screen },
+    { "coverage_graphic_sdl", bench_coverage },
+    { "cov_planes", bench_planes },
+    { "watch_check", bench_watch },
+    { "er1400_clock", bench_er1400 },
+};
+
+static bool selected(const char *name, char **names, int nnames) {
+    if (nnames == 0)
+        return true;
+    for (int n = 0; n < nnames; ++n) {
+        if (strcmp(names[n], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char *argv[]) {
+    int repeat = 5;
+    char *names[64];
+    int nnames = 0;
+    for (int arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "--repeat") == 0 && arg + 1 < argc)
+            repeat = atoi(argv[++arg]);
+        else if (nnames < 64)
+            names[nnames++] = argv[arg];
+    }
+    if (repeat < 1)
+        repeat = 1;
+
+    if (!memory_init()) {
+        fputs("Couldn't allocate 64K memory\n", stderr);
+        return 1;
+    }
+    FILE *charf = fopen("../bin/23-018E2.bin", "rb");
+    if (charf) {
+        if (fread(chargen, 1, 2048, charf) != 2048)
+            fputs("Short chargen ROM ../bin/23-018E2.bin\n", stderr);
+        fclose(charf);
+    }
+    memset(alt_chargen, 0xff, 2048);
+
+    int failures = 0;
+    bool first = true;
+    printf("[\n");
+    for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); ++b) {
+        if (!selected(benches[b].name, names, nnames))
+            continue;
+        bench_result best = { 0, 0, 0 };
+        bool ok = true;
+        for (int run = 0; run < repeat && ok; ++run) {
+            bench_result r = { 0, 0, 0 };
+            ok = benches[b].fn(&r);
+            if (ok && (run == 0 || r.seconds < best.seconds))
+                best = r;
+        }
+        if (!ok) {
+            ++failures;
+            continue;
+        }
+        if (best.seconds <= 0)
+            best.seconds = 1e-9;
+        printf("%s  { \"name\": \"%s\", \"runs\": %d, \"ops\": %lu, \"seconds\": %.6f, \"ns_per_op\": %.1f",
+            first ? "" : ",\n", benches[b].name, repeat, best.ops, best.seconds, best.seconds * 1e9 / best.ops);
+        if (best.cycles > 0)
+            printf(", \"cycles\": %lu, \"cycles_per_second\": %.0f", best.cycles, best.cycles / best.seconds);
+        printf(" }");
+        first = false;
+    }
+    printf("\n]\n");
+
+    if (renderer)
+        SDL_DestroyRenderer(renderer);
+    if (surface)
+        SDL_FreeSurface(surface);
+    i8080_free(&booted);
+    free(memory);
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,157 @@
+#include "boot_cache.h"
+
+#include "vt100_memory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char magic[8] = "AWNTYBC2";
+
+#define BRANCH_MAP_SIZE (0x10000 / 8)
+
+typedef struct cache_header {
+    char magic[8];
+    uint64_t key;
+    uint32_t cpu_size;
+    uint32_t memory_size;
+    uint32_t device_size;
+    uint32_t reserved;
+} cache_header;
+
+static i8080 held_cpu;
+static uint8_t *held_memory = NULL;
+static uint8_t *held_coverage = NULL;
+static uint64_t *held_branches = NULL; // taken, then not taken
+static void *held_devices = NULL;
+static size_t cache_device_size = 0;
+static bool holding = false;
+
+uint64_t boot_cache_hash(uint64_t h, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+void boot_cache_init(size_t device_size) {
+    boot_cache_free();
+    held_memory = malloc(MEMORY_SIZE);
+    held_coverage = malloc(0x10000);
+    held_branches = malloc(2 * BRANCH_MAP_SIZE);
+    held_devices = malloc(device_size);
+    if (!held_memory || !held_coverage || !held_branches || !held_devices) {
+        fputs("Couldn't allocate boot cache\n", stderr);
+        boot_cache_free();
+        return;
+    }
+    cache_device_size = device_size;
+}
+
+void boot_cache_free() {
+    free(held_memory);
+    free(held_coverage);
+    free(held_branches);
+    free(held_devices);
+    held_memory = held_coverage = NULL;
+    held_branches = NULL;
+    held_devices = NULL;
+    cache_device_size = 0;
+    holding = false;
+}
+
+void boot_cache_hold(const i8080 *c, const void *devices) {
+    if (!held_memory)
+        return;
+    held_cpu = *c;
+    memcpy(held_memory, memory, MEMORY_SIZE);
+    memcpy(held_coverage, c->coverage, 0x10000);
+    if (c->taken) {
+        memcpy(held_branches, c->taken, BRANCH_MAP_SIZE);
+        memcpy(&held_branches[BRANCH_MAP_SIZE / 8], c->not_taken, BRANCH_MAP_SIZE);
+    }
+    else
+        memset(held_branches, 0, 2 * BRANCH_MAP_SIZE);
+    memcpy(held_devices, devices, cache_device_size);
+    holding = true;
+}
+
+static void cache_name(uint64_t key, char *name, size_t len) {
+    snprintf(name, len, "fast-boot-%016llx.bin", (unsigned long long)key);
+}
+
+static uint64_t checksum() {
+    uint64_t h = boot_cache_hash(BOOT_CACHE_SEED, &held_cpu, sizeof(held_cpu));
+    h = boot_cache_hash(h, held_memory, MEMORY_SIZE);
+    h = boot_cache_hash(h, held_coverage, 0x10000);
+    h = boot_cache_hash(h, held_branches, 2 * BRANCH_MAP_SIZE);
+    return boot_cache_hash(h, held_devices, cache_device_size);
+}
+
+bool boot_cache_save(uint64_t key) {
+    if (!holding)
+        return false;
+    char name[40];
+    cache_name(key, name, sizeof(name));
+    FILE *f = fopen(name, "wb");
+    if (!f) {
+        fprintf(stderr, "Can't write %s\n", name);
+        return false;
+    }
+    cache_header header = { { 0 }, key, sizeof(i8080), MEMORY_SIZE, cache_device_size, 0 };
+    memcpy(header.magic, magic, sizeof(magic));
+    uint64_t sum = checksum();
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(&held_cpu, sizeof(held_cpu), 1, f) == 1 &&
+        fwrite(held_memory, MEMORY_SIZE, 1, f) == 1 &&
+        fwrite(held_coverage, 0x10000, 1, f) == 1 &&
+        fwrite(held_branches, 2 * BRANCH_MAP_SIZE, 1, f) == 1 &&
+        fwrite(held_devices, cache_device_size, 1, f) == 1 &&
+        fwrite(&sum, sizeof(sum), 1, f) == 1;
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Can't write %s\n", name);
+        remove(name);
+        return false;
+    }
+    return true;
+}
+
+bool boot_cache_load(uint64_t key, i8080 *c, void *devices) {
+    if (!held_memory)
+        return false;
+    char name[40];
+    cache_name(key, name, sizeof(name));
+    FILE *f = fopen(name, "rb");
+    if (!f)
+        return false;
+
+    cache_header header;
+    uint64_t sum;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+        memcmp(header.magic, magic, sizeof(magic)) == 0 && header.key == key &&
+        header.cpu_size == sizeof(i8080) && header.memory_size == MEMORY_SIZE &&
+        header.device_size == cache_device_size &&
+        fread(&held_cpu, sizeof(held_cpu), 1, f) == 1 &&
+        fread(held_memory, MEMORY_SIZE, 1, f) == 1 &&
+        fread(held_coverage, 0x10000, 1, f) == 1 &&
+        fread(held_branches, 2 * BRANCH_MAP_SIZE, 1, f) == 1 &&
+        fread(held_devices, cache_device_size, 1, f) == 1 &&
+        fread(&sum, sizeof(sum), 1, f) == 1 && sum == checksum();
+    fclose(f);
+    if (!ok) {
+        printf("Fast boot: ignoring %s, which doesn't match this build\n", name);
+        holding = false;
+        return false;
+    }
+
+    i8080_restore_state(c, &held_cpu);
+    memcpy(memory, held_memory, MEMORY_SIZE);
+    memcpy(c->coverage, held_coverage, 0x10000);
+    if (c->taken) {
+        memcpy(c->taken, held_branches, BRANCH_MAP_SIZE);
+        memcpy(c->not_taken, &held_branches[BRANCH_MAP_SIZE / 8], BRANCH_MAP_SIZE);
+    }
+    memcpy(devices, held_devices, cache_device_size);
+    holding = true;
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef BOOT_CACHE_H
+#define BOOT_CACHE_H
+
+#include "i8080.h"
+
+// Fast boot: the machine as it stands when the script starts, saved to a file
+// by the first run, so that later runs can restore it and skip the self test,
+// RAM clear and NVR recall that every power-up goes through.
+//
+// A cache file is named for a key, a hash of everything that decides how the
+// terminal powers up (ROM, NVR contents, fitted options and so on), and holds
+// the key, the sizes of the saved structures and a checksum, all of which must
+// match before it is used. Anything else is ignored, and the self test runs.
+//
+// The saved state is the CPU, memory, coverage and branch maps and an opaque
+// block of peripheral state from the caller, as for snapshots.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BOOT_CACHE_SEED 0xcbf29ce484222325ULL
+
+// Hashed into every key. Bump it when a build changes what the saved state
+// means or how the machine gets there, so that older files stop matching.
+#define BOOT_CACHE_VERSION 2
+
+// FNV-1a, for building a key from BOOT_CACHE_SEED
+uint64_t boot_cache_hash(uint64_t h, const void *data, size_t len);
+
+void boot_cache_init(size_t device_size);
+void boot_cache_free();
+
+// Keep a copy of the machine, which boot_cache_save() writes. The run loop
+// holds the state at the top of each pass just before the script starts.
+void boot_cache_hold(const i8080 *c, const void *devices);
+bool boot_cache_save(uint64_t key);
+
+// Restore the machine saved for key. The CPU's interface, coverage and branch
+// map and decode cache pointers are kept; the maps' contents are restored.
+bool boot_cache_load(uint64_t key, i8080 *c, void *devices);
+
+#endif
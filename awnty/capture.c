@@ -0,0 +1,159 @@
+#include "capture.h"
+
+#include <stdio.h>
+
+static gdImagePtr image = NULL;
+static int color = 0;
+
+static FILE *record_file = NULL;
+static char record_path[256];
+static gdImagePtr record_prev = NULL;
+// libgd leaves out a frame that is the same as the one before, delay and all,
+// so a repeated frame is held back and its delay added to the one it repeats
+static gdImagePtr record_held = NULL;
+static int record_held_delay = 0;
+static int record_frames = 0;
+static int record_count = 0;
+static int record_width = 0, record_height = 0;
+
+// Every image gets the same palette, in the same order, so that animation
+// frames can share the global colour map.
+static const SDL_Color palette[] = {
+    {   0,   0,   0, 255 },  // black (background)
+    {  57,  22,   5, 255 },  // dull orange
+    { 128, 128, 128, 255 },  // grey50
+    { 192, 192, 192, 255 },  // grey75
+    { 255, 255, 255, 255 },  // white
+};
+
+bool capture_begin(int width, int height) {
+    if (image)
+        gdImageDestroy(image);
+    // A recording keeps the size of its first frame
+    if (record_file && record_count > 0) {
+        width = record_width;
+        height = record_height;
+    }
+    image = gdImageCreate(width, height);
+    if (!image) {
+        fputs("Couldn't create capture image\n", stderr);
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(palette) / sizeof(palette[0]); ++i)
+        gdImageColorAllocate(image, palette[i].r, palette[i].g, palette[i].b);
+    color = 0;
+    return true;
+}
+
+int capture_width() {
+    return image ? gdImageSX(image) : 0;
+}
+
+void capture_color(SDL_Color col) {
+    if (!image)
+        return;
+    color = gdImageColorExact(image, col.r, col.g, col.b);
+    if (color < 0)
+        color = gdImageColorResolve(image, col.r, col.g, col.b);
+}
+
+void capture_dot(int x, int y) {
+    if (image)
+        gdImageSetPixel(image, x, y, color);
+}
+
+void capture_fill(int x, int y, int w, int h) {
+    if (image)
+        gdImageFilledRectangle(image, x, y, x + w - 1, y + h - 1, color);
+}
+
+gdImagePtr capture_take() {
+    gdImagePtr im = image;
+    image = NULL;
+    return im;
+}
+
+bool capture_write_png(const char *path) {
+    if (!image)
+        return false;
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Can't create '%s'\n", path);
+        return false;
+    }
+    gdImagePng(image, f);
+    fclose(f);
+    gdImageDestroy(image);
+    image = NULL;
+    return true;
+}
+
+bool capture_record_start(const char *path, int frames) {
+    capture_record_stop();
+    record_file = fopen(path, "wb");
+    if (!record_file) {
+        fprintf(stderr, "Can't create '%s'\n", path);
+        return false;
+    }
+    snprintf(record_path, sizeof(record_path), "%s", path);
+    record_frames = frames;
+    record_count = 0;
+    return true;
+}
+
+bool capture_recording() {
+    return record_file != NULL;
+}
+
+// Write the frame held back, if any
+static void record_flush() {
+    if (!record_held)
+        return;
+    gdImageGifAnimAdd(record_held, record_file, 0, 0, 0, record_held_delay, gdDisposalNone, record_prev);
+    if (record_prev)
+        gdImageDestroy(record_prev);
+    record_prev = record_held;
+    record_held = NULL;
+}
+
+bool capture_record_frame() {
+    if (!record_file || !image)
+        return false;
+    if (record_count == 0) {
+        record_width = gdImageSX(image);
+        record_height = gdImageSY(image);
+        gdImageGifAnimBegin(image, record_file, 1, 0);
+    }
+    // GIF delays are in hundredths of a second, so spread 60 Hz frames over them
+    int delay = (record_count + 1) * 100 / 60 - record_count * 100 / 60;
+    if (record_held && !(gdImageCompare(record_held, image) & GD_CMP_IMAGE)) {
+        record_held_delay += delay;
+        gdImageDestroy(image);
+    }
+    else {
+        record_flush();
+        record_held = image;
+        record_held_delay = delay;
+    }
+    image = NULL;
+    if (++record_count >= record_frames) {
+        capture_record_stop();
+        return false;
+    }
+    return true;
+}
+
+void capture_record_stop() {
+    if (!record_file)
+        return;
+    record_flush();
+    if (record_count > 0)
+        gdImageGifAnimEnd(record_file);
+    fclose(record_file);
+    record_file = NULL;
+    printf("Recorded %d frames to %s\n", record_count, record_path);
+    if (record_prev) {
+        gdImageDestroy(record_prev);
+        record_prev = NULL;
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// Screen captures, drawn dot for dot like the screen window but into a libgd
+// image, so they need no display. A single capture is written as PNG, and a
+// recording of consecutive frames as an animated GIF.
+
+#include <gd.h>
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+
+// Start a new image. Everything drawn goes into it until it is written.
+// Recordings keep the size of their first frame, so check capture_width().
+bool capture_begin(int width, int height);
+int capture_width();
+void capture_color(SDL_Color col);
+void capture_dot(int x, int y);
+void capture_fill(int x, int y, int w, int h);
+
+// Hand the image over to the caller, to keep or destroy
+gdImagePtr capture_take();
+
+// Write the image as PNG, and discard it
+bool capture_write_png(const char *path);
+
+// Recording: each image is added as a frame, at 60 frames per second
+bool capture_record_start(const char *path, int frames);
+bool capture_recording();
+// Add the image as the next frame, finishing the file after the last frame.
+// Returns false once the recording has finished.
+bool capture_record_frame();
+void capture_record_stop();
+
+#endif
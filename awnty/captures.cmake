@@ -0,0 +1,65 @@
+# Runs a script that takes a screenshot and records a few frames, writing
+# both to OUTPUT_DIR, and checks the PNG and the animated GIF are there with
+# the screen's size, and the GIF lasts as long as the frames recorded.
+
+if(NOT DEFINED AWNTY)
+    message(FATAL_ERROR "AWNTY is required")
+endif()
+if(NOT DEFINED OUTPUT_DIR)
+    message(FATAL_ERROR "OUTPUT_DIR is required")
+endif()
+
+set(SHOT "${OUTPUT_DIR}/capture-shot.png")
+set(RECORDING "${OUTPUT_DIR}/capture-recording.gif")
+set(SCRIPT "${OUTPUT_DIR}/captures.txt")
+file(REMOVE "${SHOT}" "${RECORDING}")
+file(WRITE "${SCRIPT}"
+    "serial 1b,\"[H\",1b,\"[2J\",\"Captured\"\n"
+    "pause 300000\n"
+    "expect-screen 1 \"Captured\"\n"
+    "screenshot ${SHOT}\n"
+    "record ${RECORDING} 10\n"
+    "serial 0d,0a,\"Recorded\"\n"
+    "pause 500000\n"
+)
+
+execute_process(
+    COMMAND "${AWNTY}" --headless --no-pace "${SCRIPT}"
+    OUTPUT_VARIABLE OUTPUT
+    ERROR_VARIABLE OUTPUT
+    RESULT_VARIABLE RESULT
+)
+if(NOT RESULT EQUAL 0)
+    message(FATAL_ERROR "The capture script failed with exit status ${RESULT}\n${OUTPUT}")
+endif()
+if(NOT OUTPUT MATCHES "Screenshot saved to [^\n]*\n" OR NOT OUTPUT MATCHES "Recorded 10 frames to [^\n]*\n")
+    message(FATAL_ERROR "The capture script didn't save both captures\n${OUTPUT}")
+endif()
+
+# 800 x 480 dots, for 80 columns: the PNG's IHDR has them big-endian, the
+# GIF's screen descriptor little-endian
+file(READ "${SHOT}" PNG_HEADER LIMIT 24 HEX)
+if(NOT PNG_HEADER STREQUAL "89504e470d0a1a0a0000000d4948445200000320000001e0")
+    message(FATAL_ERROR "${SHOT} isn't an 800 x 480 PNG: ${PNG_HEADER}")
+endif()
+file(READ "${RECORDING}" GIF_HEADER LIMIT 10 HEX)
+if(NOT GIF_HEADER STREQUAL "4749463839612003e001")
+    message(FATAL_ERROR "${RECORDING} isn't an 800 x 480 GIF: ${GIF_HEADER}")
+endif()
+# Each frame has a graphic control extension with its delay, and together
+# they must cover 10 frames at 60 Hz, 16 hundredths of a second, however many
+# repeated frames were merged
+file(READ "${RECORDING}" GIF HEX)
+string(REGEX MATCHALL "21f904..(....)" GIF_CONTROLS "${GIF}")
+set(GIF_DELAY 0)
+foreach(CONTROL IN LISTS GIF_CONTROLS)
+    string(SUBSTRING "${CONTROL}" 8 2 LOW)
+    string(SUBSTRING "${CONTROL}" 10 2 HIGH)
+    math(EXPR GIF_DELAY "${GIF_DELAY} + 0x${LOW} + 0x${HIGH} * 256")
+endforeach()
+list(LENGTH GIF_CONTROLS GIF_FRAME_COUNT)
+if(GIF_FRAME_COUNT LESS 2 OR NOT GIF_DELAY EQUAL 16)
+    message(FATAL_ERROR "${RECORDING} has ${GIF_FRAME_COUNT} frames lasting ${GIF_DELAY}/100 s, not 16/100")
+endif()
+
+message(STATUS "Screenshot and recording written")
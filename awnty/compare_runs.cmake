@@ -0,0 +1,59 @@
+# Runs an awnty script as usual, with any OPTIONS (e.g. --jit), and again
+# with the plain interpreter stepping one instruction at a time, without the
+# decode cache, and every idle loop pass executed. Checks the output, final
+# machine state included, is the same apart from the idle loop and translator
+# statistics, and that the run passed its own checks (screen, frames, replay).
+
+if(NOT DEFINED AWNTY)
+    message(FATAL_ERROR "AWNTY is required")
+endif()
+if(NOT DEFINED SCRIPT)
+    message(FATAL_ERROR "SCRIPT is required")
+endif()
+if(NOT DEFINED OUTPUT_DIR)
+    message(FATAL_ERROR "OUTPUT_DIR is required")
+endif()
+
+separate_arguments(OPTIONS)
+
+execute_process(
+    COMMAND "${AWNTY}" --headless --no-pace --final-state ${OPTIONS} "${SCRIPT}"
+    OUTPUT_VARIABLE FAST_OUTPUT
+    ERROR_VARIABLE FAST_OUTPUT
+    RESULT_VARIABLE FAST_RESULT
+)
+execute_process(
+    COMMAND "${AWNTY}" --headless --no-pace --no-decode-cache --no-fast-idle --no-run-ahead
+        --final-state "${SCRIPT}"
+    OUTPUT_VARIABLE REFERENCE_OUTPUT
+    ERROR_VARIABLE REFERENCE_OUTPUT
+    RESULT_VARIABLE REFERENCE_RESULT
+)
+
+string(REGEX REPLACE "Idle loops: [^\n]*\n" "" FAST_OUTPUT "${FAST_OUTPUT}")
+string(REGEX REPLACE "(JIT: |Can't translate the ROM here)[^\n]*\n" "" FAST_OUTPUT "${FAST_OUTPUT}")
+
+if(NOT FAST_OUTPUT STREQUAL REFERENCE_OUTPUT OR NOT FAST_RESULT STREQUAL REFERENCE_RESULT)
+    get_filename_component(SCRIPT_NAME "${SCRIPT}" NAME_WE)
+    if(OPTIONS)
+        string(REGEX REPLACE "[^a-z0-9]+" "-" OPTIONS_NAME "${OPTIONS}")
+        string(REGEX REPLACE "^-+|-+$" "" OPTIONS_NAME "${OPTIONS_NAME}")
+        set(SCRIPT_NAME "${SCRIPT_NAME}.${OPTIONS_NAME}")
+    endif()
+    set(FAST_FILE "${OUTPUT_DIR}/${SCRIPT_NAME}.fast.txt")
+    set(REFERENCE_FILE "${OUTPUT_DIR}/${SCRIPT_NAME}.reference.txt")
+    file(WRITE "${FAST_FILE}" "${FAST_OUTPUT}")
+    file(WRITE "${REFERENCE_FILE}" "${REFERENCE_OUTPUT}")
+    message(FATAL_ERROR
+        "${SCRIPT} runs differently\n"
+        "Exit status: ${FAST_RESULT}, reference ${REFERENCE_RESULT}\n"
+        "Output: ${FAST_FILE}\n"
+        "Reference: ${REFERENCE_FILE}\n"
+    )
+endif()
+
+if(NOT FAST_RESULT EQUAL 0)
+    message(FATAL_ERROR "${SCRIPT} failed with exit status ${FAST_RESULT}")
+endif()
+
+message(STATUS "${SCRIPT} runs the same")
@@ -0,0 +1,62 @@
+# Compiles an awnty script with --compile, runs the compiled file, and checks
+# it prints what the text script does, final machine state included. The
+# compiled file is written to OUTPUT_DIR.
+
+if(NOT DEFINED AWNTY)
+    message(FATAL_ERROR "AWNTY is required")
+endif()
+if(NOT DEFINED SCRIPT)
+    message(FATAL_ERROR "SCRIPT is required")
+endif()
+if(NOT DEFINED OUTPUT_DIR)
+    message(FATAL_ERROR "OUTPUT_DIR is required")
+endif()
+
+get_filename_component(SCRIPT_NAME "${SCRIPT}" NAME_WE)
+set(COMPILED "${OUTPUT_DIR}/${SCRIPT_NAME}.bin")
+
+execute_process(
+    COMMAND "${AWNTY}" --compile "${COMPILED}" "${SCRIPT}"
+    OUTPUT_VARIABLE COMPILE_OUTPUT
+    ERROR_VARIABLE COMPILE_OUTPUT
+    RESULT_VARIABLE COMPILE_RESULT
+)
+if(NOT COMPILE_RESULT EQUAL 0)
+    message(FATAL_ERROR "${SCRIPT} didn't compile\n${COMPILE_OUTPUT}")
+endif()
+
+execute_process(
+    COMMAND "${AWNTY}" --headless --no-pace --final-state "${SCRIPT}"
+    OUTPUT_VARIABLE TEXT_OUTPUT
+    ERROR_VARIABLE TEXT_OUTPUT
+    RESULT_VARIABLE TEXT_RESULT
+)
+execute_process(
+    COMMAND "${AWNTY}" --headless --no-pace --final-state "${COMPILED}"
+    OUTPUT_VARIABLE COMPILED_OUTPUT
+    ERROR_VARIABLE COMPILED_OUTPUT
+    RESULT_VARIABLE COMPILED_RESULT
+)
+
+if(NOT COMPILED_OUTPUT MATCHES "Final state: ")
+    message(FATAL_ERROR "${COMPILED} didn't run to the end\n${COMPILED_OUTPUT}")
+endif()
+
+if(NOT COMPILED_OUTPUT STREQUAL TEXT_OUTPUT OR NOT COMPILED_RESULT STREQUAL TEXT_RESULT)
+    set(COMPILED_FILE "${OUTPUT_DIR}/${SCRIPT_NAME}.compiled.txt")
+    set(TEXT_FILE "${OUTPUT_DIR}/${SCRIPT_NAME}.text.txt")
+    file(WRITE "${COMPILED_FILE}" "${COMPILED_OUTPUT}")
+    file(WRITE "${TEXT_FILE}" "${TEXT_OUTPUT}")
+    message(FATAL_ERROR
+        "${COMPILED} runs differently from ${SCRIPT}\n"
+        "Exit status: ${COMPILED_RESULT}, text ${TEXT_RESULT}\n"
+        "Output: ${COMPILED_FILE}\n"
+        "Text script: ${TEXT_FILE}\n"
+    )
+endif()
+
+if(NOT TEXT_RESULT EQUAL 0)
+    message(FATAL_ERROR "${SCRIPT} failed with exit status ${TEXT_RESULT}")
+endif()
+
+message(STATUS "${COMPILED} runs the same as ${SCRIPT}")
@@ -0,0 +1,15 @@
+#ifndef COV_FLAGS_H
+#define COV_FLAGS_H
+
+// What the coverage map records for each address. The CPU sets the first
+// three as it runs; coverage.c adds the rest from the annotations.
+
+#define COV_EXEC 1
+#define COV_READ 2
+#define COV_WRITE 4
+#define COV_DATA 8
+#define COV_SYMBOL 16
+#define COV_UNREACH 32
+#define COV_DMA 64
+
+#endif
@@ -0,0 +1,131 @@
+#include "cov_planes.h"
+
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline int popcount64(uint64_t w) {
+    return (int)__popcnt64(w);
+}
+static inline int lowest_bit(uint64_t w) {
+    unsigned long bit;
+    _BitScanForward64(&bit, w);
+    return (int)bit;
+}
+#else
+static inline int popcount64(uint64_t w) {
+    return __builtin_popcountll(w);
+}
+static inline int lowest_bit(uint64_t w) {
+    return __builtin_ctzll(w);
+}
+#endif
+
+// Mask of the bits for addresses [start, end) within word w
+static uint64_t range_mask(uint32_t w, uint32_t start, uint32_t end) {
+    uint32_t lo = w * 64;
+    uint64_t mask = ~0ULL;
+    if (start > lo)
+        mask &= ~0ULL << (start - lo);
+    if (end < lo + 64)
+        mask &= ~(~0ULL << (end - lo));
+    return mask;
+}
+
+const uint64_t *cov_planes_flag(const cov_planes *p, uint8_t flag) {
+    return p->plane[lowest_bit(flag)];
+}
+
+// Eight map bytes at a time, little endian: the multiply gathers bit 0 of
+// each byte into the top byte, the first address's in its lowest bit
+static inline uint64_t gather(uint64_t bytes, int flag) {
+    return (((bytes >> flag) & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+}
+
+void cov_planes_from(cov_planes *p, const uint8_t *coverage) {
+    for (int w = 0; w < COV_PLANE_WORDS; ++w) {
+        uint64_t bits[COV_PLANE_COUNT] = { 0 };
+        for (int b = 0; b < 8; ++b) {
+            uint64_t bytes;
+            memcpy(&bytes, &coverage[w * 64 + b * 8], sizeof(bytes));
+            if (!bytes)
+                continue;
+            for (int f = 0; f < COV_PLANE_COUNT; ++f)
+                bits[f] |= gather(bytes, f) << (b * 8);
+        }
+        for (int f = 0; f < COV_PLANE_COUNT; ++f)
+            p->plane[f][w] = bits[f];
+    }
+}
+
+void cov_planes_merge(cov_planes *into, const cov_planes *from) {
+    uint64_t *out = &into->plane[0][0];
+    const uint64_t *in = &from->plane[0][0];
+    for (int w = 0; w < COV_PLANE_COUNT * COV_PLANE_WORDS; ++w)
+        out[w] |= in[w];
+}
+
+unsigned long cov_planes_diff(cov_planes *out, const cov_planes *now, const cov_planes *before) {
+    uint64_t *o = &out->plane[0][0];
+    const uint64_t *n = &now->plane[0][0];
+    const uint64_t *b = &before->plane[0][0];
+    unsigned long count = 0;
+    for (int w = 0; w < COV_PLANE_COUNT * COV_PLANE_WORDS; ++w) {
+        o[w] = n[w] & ~b[w];
+        count += popcount64(o[w]);
+    }
+    return count;
+}
+
+void cov_plane_any(uint64_t *out, const cov_planes *p, uint8_t flags) {
+    memset(out, 0, sizeof(cov_plane));
+    for (int f = 0; f < COV_PLANE_COUNT; ++f) {
+        if (flags & (1 << f)) {
+            for (int w = 0; w < COV_PLANE_WORDS; ++w)
+                out[w] |= p->plane[f][w];
+        }
+    }
+}
+
+void cov_plane_table(uint64_t *out, char *const *table, uint16_t base, uint32_t len) {
+    memset(out, 0, sizeof(cov_plane));
+    for (uint32_t i = 0; i < len && base + i < 0x10000; ++i) {
+        if (table[i])
+            out[(base + i) >> 6] |= 1ULL << ((base + i) & 63);
+    }
+}
+
+void cov_plane_and(uint64_t *out, const uint64_t *a, const uint64_t *b) {
+    for (int w = 0; w < COV_PLANE_WORDS; ++w)
+        out[w] = a[w] & b[w];
+}
+
+void cov_plane_andnot(uint64_t *out, const uint64_t *a, const uint64_t *b) {
+    for (int w = 0; w < COV_PLANE_WORDS; ++w)
+        out[w] = a[w] & ~b[w];
+}
+
+void cov_plane_xor(uint64_t *out, const uint64_t *a, const uint64_t *b) {
+    for (int w = 0; w < COV_PLANE_WORDS; ++w)
+        out[w] = a[w] ^ b[w];
+}
+
+unsigned long cov_plane_count(const uint64_t *plane, uint32_t start, uint32_t end) {
+    unsigned long count = 0;
+    if (end > 0x10000)
+        end = 0x10000;
+    for (uint32_t w = start / 64; w * 64 < end; ++w)
+        count += popcount64(plane[w] & range_mask(w, start, end));
+    return count;
+}
+
+uint32_t cov_plane_next(const uint64_t *plane, uint32_t from, uint32_t end, bool set) {
+    if (end > 0x10000)
+        end = 0x10000;
+    for (uint32_t w = from / 64; w * 64 < end; ++w) {
+        uint64_t bits = (set ? plane[w] : ~plane[w]) & range_mask(w, from, end);
+        if (bits)
+            return w * 64 + lowest_bit(bits);
+    }
+    return end;
+}
@@ -0,0 +1,56 @@
+#ifndef COV_PLANES_H
+#define COV_PLANES_H
+
+// The coverage map as bit planes: one bit per address for each COV_* flag,
+// 64 addresses to a word, so that maps can be merged, compared and counted a
+// word at a time rather than a byte at a time. The byte map in the CPU is
+// still what the emulator marks as it runs; planes are built from it when a
+// report wants them.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define COV_PLANE_COUNT 7 // COV_EXEC to COV_DMA
+#define COV_PLANE_WORDS (0x10000 / 64)
+
+typedef uint64_t cov_plane[COV_PLANE_WORDS];
+
+typedef struct cov_planes {
+    cov_plane plane[COV_PLANE_COUNT];
+} cov_planes;
+
+// The plane for a single COV_* flag
+const uint64_t *cov_planes_flag(const cov_planes *p, uint8_t flag);
+
+void cov_planes_from(cov_planes *p, const uint8_t *coverage);
+
+// into |= from
+void cov_planes_merge(cov_planes *into, const cov_planes *from);
+
+// out = now & ~before: what has been covered since before. Returns the number
+// of bits set in out, over all planes.
+unsigned long cov_planes_diff(cov_planes *out, const cov_planes *now, const cov_planes *before);
+
+// out = the addresses with any of flags set
+void cov_plane_any(uint64_t *out, const cov_planes *p, uint8_t flags);
+
+// out = the addresses, base to base + len - 1, whose entries in table are
+// non-NULL, as for symtable and equtable
+void cov_plane_table(uint64_t *out, char *const *table, uint16_t base, uint32_t len);
+
+void cov_plane_and(uint64_t *out, const uint64_t *a, const uint64_t *b);
+void cov_plane_andnot(uint64_t *out, const uint64_t *a, const uint64_t *b);
+void cov_plane_xor(uint64_t *out, const uint64_t *a, const uint64_t *b);
+
+static inline bool cov_plane_test(const uint64_t *plane, uint16_t addr) {
+    return (plane[addr >> 6] >> (addr & 63)) & 1;
+}
+
+// Number of bits set in [start, end)
+unsigned long cov_plane_count(const uint64_t *plane, uint32_t start, uint32_t end);
+
+// The first address in [from, end) whose bit is set (or clear), or end if
+// there isn't one
+uint32_t cov_plane_next(const uint64_t *plane, uint32_t from, uint32_t end, bool set);
+
+#endif
@@ -1,5 +1,6 @@
 #include "coverage.h"
 
+#include "cov_planes.h"
 #include "vt100_memory.h"
 #include "sdl_gd.h"
 
@@ -24,63 +25,168 @@ int num_watch = 0;
 const int max_watch = 1000;
 uint16_t watch_addr[1000];
 uint16_t watch_lastval[1000];
-bool     watch_hadval[1000];
 uint8_t  watch_interp[1000];
+bool     watch_changed[1000]; // written during the current instruction
+uint16_t watch_pc[1000];
+
+// The watches on each address, chained through watch_next, and the word
+// watches whose high byte is at each address, chained through
+// watch_next_high. Entries are watch numbers plus one, 0 ending the chain.
+static uint16_t watch_at[0x10000], watch_high_at[0x10000];
+static uint16_t watch_next[1000], watch_next_high[1000];
+
+// The watches written during the current instruction
+static uint16_t watch_written[1000];
+static int num_written = 0;
+
+uint8_t watch_map[0x10000 / 8];
+int watch_pending = 0;
+
+static void watch_print(const watch_event *ev);
+static watch_handler watch_report = watch_print;
+
+void rom_symbol(uint16_t addr, char *st, size_t len) {
+    st[0] = 0;
+    if (addr >= 0x2000)
+        return;
+    for (int back = 0; back < 64 && back <= addr; ++back) {
+        if (symtable[addr - back]) {
+            if (back == 0)
+                snprintf(st, len, "%s", symtable[addr]);
+            else
+                snprintf(st, len, "%s + %d", symtable[addr - back], back);
+            return;
+        }
+    }
+}
+
+static void watch_print(const watch_event *ev)
+{
+    char st[16];
+    char ps[40];
+    // Symbol we're watching -- will be in RAM (equ table)
+    if (ev->addr >= equoffset && ev->addr < equoffset + 0x1000 && equtable[ev->addr - equoffset])
+        strncpy(st, equtable[ev->addr - equoffset], 16);
+    else
+        snprintf(st, 16, "%-11s%04x", "", ev->addr);
+    st[15] = 0;
+    if (ev->initial)
+        ps[0] = 0;
+    else {
+        char sym[30];
+        rom_symbol(ev->pc, sym, sizeof(sym));
+        snprintf(ps, sizeof(ps), "[%04x %s]", ev->pc, sym);
+    }
+    if (ev->interp == 0) {
+        printf("\t\t\t\t%-15s  %02x -> %02x    %s\n", st, ev->oldval, ev->newval, ps);
+    }
+    else {
+        char pt[30];
+        // Pointer -- into ROM
+        if (ev->newval < 0x2000 && symtable[ev->newval])
+            snprintf(pt, 30, "%04x  %s", ev->newval, symtable[ev->newval]);
+        else
+            snprintf(pt, 30, "%04x", ev->newval);
+        pt[29] = 0;
+        printf("\t\t\t\t%-15s  %04x -> %-24s %s\n", st, ev->oldval, pt, ps);
+    }
+}
+
+static uint16_t watch_value(int w) {
+    if (watch_interp[w] == 1)
+        return memory[watch_addr[w]] | (memory[(uint16_t)(watch_addr[w] + 1)] << 8);
+    return memory[watch_addr[w]];
+}
 
 void watch_init() {
+    for (int w = 0; w < num_watch; ++w) {
+        watch_at[watch_addr[w]] = 0;
+        watch_high_at[(uint16_t)(watch_addr[w] + 1)] = 0;
+    }
     num_watch = 0;
+    num_written = 0;
+    watch_pending = 0;
+    memset(watch_map, 0, sizeof(watch_map));
+}
+
+void watch_set_handler(watch_handler handler) {
+    watch_report = handler ? handler : watch_print;
 }
 
 void watch_add(uint16_t addr, int interp) {
     if (num_watch < max_watch) {
         watch_addr[num_watch] = addr;
-        watch_hadval[num_watch] = false;
-        watch_lastval[num_watch] = 0;
         watch_interp[num_watch] = interp;
+        watch_changed[num_watch] = false;
+        watch_lastval[num_watch] = watch_value(num_watch);
+        watch_map[addr >> 3] |= 1 << (addr & 7);
+        watch_next[num_watch] = watch_at[addr];
+        watch_at[addr] = num_watch + 1;
+        if (interp == 1) {
+            uint16_t high = addr + 1;
+            watch_map[high >> 3] |= 1 << (high & 7);
+            watch_next_high[num_watch] = watch_high_at[high];
+            watch_high_at[high] = num_watch + 1;
+        }
+        // Report the starting value, as if it had been written
+        watch_event ev = { addr, interp, 0, watch_lastval[num_watch], 0, true };
+        watch_report(&ev);
         ++num_watch;
     }
 }
 
+static void watch_written_by(int w, uint16_t pc) {
+    watch_changed[w] = true;
+    watch_pc[w] = pc;
+    watch_written[num_written++] = w;
+    watch_pending = 1;
+}
+
+// Called from the write path, only for watched addresses, before the byte is
+// stored. Remember the value each affected watch had at the start of the
+// instruction so that watch_check() can compare.
+//
+void watch_write(uint16_t addr, uint8_t oldval, uint16_t pc)
+{
+    for (int w = watch_at[addr] - 1; w >= 0; w = watch_next[w] - 1) {
+        if (watch_changed[w])
+            continue;
+        watch_written_by(w, pc);
+        if (watch_interp[w] == 1)
+            watch_lastval[w] = oldval | (memory[(uint16_t)(addr + 1)] << 8);
+        else
+            watch_lastval[w] = oldval;
+    }
+    for (int w = watch_high_at[addr] - 1; w >= 0; w = watch_next_high[w] - 1) {
+        if (watch_changed[w])
+            continue;
+        watch_written_by(w, pc);
+        watch_lastval[w] = memory[watch_addr[w]] | (oldval << 8);
+    }
+}
+
 void watch_check()
 {
-    for (int w = 0; w < num_watch; ++w) {
-        if (watch_interp[w] == 0) { // byte watch
-            uint16_t newval = memory[watch_addr[w]];
-            if (!watch_hadval[w] || newval != watch_lastval[w]) {
-                char st[16];
-                if (watch_addr[w] >= equoffset && equtable[watch_addr[w] - equoffset])
-                    strncpy(st, equtable[watch_addr[w] - equoffset], 16);
-                else
-                    snprintf(st, 16, "%-11s%04x", "", watch_addr[w]);
-                st[15] = 0;
-                printf("\t\t\t\t%-15s  %02x -> %02x\n", st, watch_lastval[w], newval);
-            }
-            watch_lastval[w] = newval;
-            watch_hadval[w] = true;
-        }
-        else if (watch_interp[w] == 1) { // word watch
-            uint16_t newval = memory[watch_addr[w]] | (memory[watch_addr[w] + 1] << 8);
-            if (!watch_hadval[w] || newval != watch_lastval[w]) {
-                char st[16];
-                char pt[30];
-                // Symbol we're watching -- will be in RAM (equ table)
-                if (watch_addr[w] >= equoffset && equtable[watch_addr[w] - equoffset])
-                    strncpy(st, equtable[watch_addr[w] - equoffset], 16);
-                else
-                    snprintf(st, 16, "%-11s%04x", "", watch_addr[w]);
-                st[15] = 0;
-                // Pointer -- into ROM
-                if (newval < 0x2000 && symtable[newval])
-                    snprintf(pt, 30, "%04x  %s", newval, symtable[newval]);
-                else
-                    snprintf(pt, 30, "%04x", newval);
-                pt[29] = 0;
-                printf("\t\t\t\t%-15s  %04x -> %s\n", st, watch_lastval[w], pt);
-            }
-            watch_lastval[w] = newval;
-            watch_hadval[w] = true;
+    // Reported in the order the watches were set, as few are written at once
+    for (int i = 1; i < num_written; ++i) {
+        uint16_t w = watch_written[i];
+        int j = i;
+        for (; j > 0 && watch_written[j - 1] > w; --j)
+            watch_written[j] = watch_written[j - 1];
+        watch_written[j] = w;
+    }
+    for (int i = 0; i < num_written; ++i) {
+        int w = watch_written[i];
+        uint16_t newval = watch_value(w);
+        if (newval != watch_lastval[w]) {
+            watch_event ev = { watch_addr[w], watch_interp[w], watch_lastval[w], newval, watch_pc[w], false };
+            watch_report(&ev);
         }
+        watch_lastval[w] = newval;
+        watch_changed[w] = false;
     }
+    num_written = 0;
+    watch_pending = 0;
 }
 
 void coverage_read_sym(const char *fname) {
@@ -88,8 +194,10 @@ void coverage_read_sym(const char *fname) {
     if (symf) {
         uint16_t symaddr;
         char symname[50];
-        for (int i = 0; i < 0x2000; ++i)
+        for (int i = 0; i < 0x2000; ++i) {
+            free(symtable[i]);
             symtable[i] = 0;
+        }
         while (fscanf(symf, "%4hx %s\n", &symaddr, symname) == 2) {
             if (symaddr < 0x3000) {
                 symtable[symaddr] = (char *)malloc(strlen(symname) + 1);
@@ -110,8 +218,10 @@ void coverage_read_equ(const char *fname) {
     if (equf) {
         uint16_t symaddr;
         char symname[50];
-        for (int i = 0; i < 0x1000; ++i)
+        for (int i = 0; i < 0x1000; ++i) {
+            free(equtable[i]);
             equtable[i] = 0;
+        }
         while (fscanf(equf, "%4hx %s\n", &symaddr, symname) == 2) {
             if (symaddr >= equoffset && symaddr < equoffset + 0x1000) {
                 symaddr -= equoffset; // table offset
@@ -148,6 +258,8 @@ void coverage_load(const i8080* c, const char *fname)
                 covitype = COV_DATA;
             else if (covctype == 'u')
                 covitype = COV_UNREACH;
+            else if (covctype == 'i')
+                continue; // idle loop head, for idle_load()
             else {
                 fprintf(stderr, "Ignoring unknown coverage type '%c' in file\n", covctype);
                 continue;
@@ -258,8 +370,45 @@ void coverage_rw(const i8080 *c, uint16_t area_start, uint16_t area_len) {
         cov_report(in_unread, in_unwritten, unwritten_start, area_start + area_len - 1);
 }
 
+// The instruction at a ROM address, with its address operand filled in
+static void branch_text(uint16_t addr, char *text, size_t len) {
+    const char *mnem = i8080_disassemble(memory[addr]);
+    const char *operand = strchr(mnem, '$');
+    if (operand)
+        snprintf(text, len, "%.*s%04x", (int)(operand - mnem), mnem, memory[addr + 1] | memory[addr + 2] << 8);
+    else
+        snprintf(text, len, "%s", mnem);
+}
+
+void coverage_branches(const i8080 *c, bool list) {
+    if (!c->taken)
+        return;
+    static cov_plane both, one_way;
+    cov_plane_and(both, c->taken, c->not_taken);
+    cov_plane_xor(one_way, c->taken, c->not_taken);
+    unsigned long taken_only = 0;
+    for (uint32_t addr = cov_plane_next(one_way, 0x0000, 0x2000, true); addr < 0x2000;
+            addr = cov_plane_next(one_way, addr + 1, 0x2000, true)) {
+        bool taken = cov_plane_test(c->taken, addr);
+        if (taken)
+            ++taken_only;
+        if (list) {
+            char text[16];
+            char st[40];
+            branch_text(addr, text, sizeof(text));
+            rom_symbol(addr, st, sizeof(st));
+            printf("branch %04x %-8s only %-9s %s\n", addr, text, taken ? "taken" : "not taken", st);
+        }
+    }
+    printf("Branches: %lu both ways, %lu taken only, %lu not taken only\n", cov_plane_count(both, 0x0000, 0x2000),
+        taken_only, cov_plane_count(one_way, 0x0000, 0x2000) - taken_only);
+}
+
 void coverage_graphic_sdl(const i8080 *c, SDL_Renderer *rend)
 {
+    if (!rend) // headless
+        return;
+
     int isc = 7; // size of each dot + gap
     int xo = 20;
     int yo =  8;
@@ -5,16 +5,11 @@
 
 // Coverage and watch functionality.
 
+#include <stddef.h>
 #include <stdint.h>
 #include <SDL2/SDL.h>
 
-#define COV_EXEC 1
-#define COV_READ 2
-#define COV_WRITE 4
-#define COV_DATA 8
-#define COV_SYMBOL 16
-#define COV_UNREACH 32
-#define COV_DMA 64
+#include "cov_flags.h"
 
 // Symbols are for the ROM, 0x0000 to 0x1fff
 extern char *symtable[];
@@ -24,9 +19,37 @@ extern char *symtable[];
 extern char *equtable[];
 extern const uint16_t equoffset;// = 0x2000; // equtable[0] is for address 0x2000
 
+// Watches are only examined when a watched address is written. The write path
+// tests a bit per address, and records a hit; the run loop calls watch_check()
+// after the instruction has finished, only if watch_pending is set, so that
+// both halves of a word write are seen together.
+//
+extern uint8_t watch_map[0x10000 / 8];
+extern int watch_pending;
+
+static inline bool watch_hit(uint16_t addr) {
+    return (watch_map[addr >> 3] & (1 << (addr & 7))) != 0;
+}
+
+typedef struct watch_event {
+    uint16_t addr;      // watched location
+    int interp;         // 0 = byte, 1 = word
+    uint16_t oldval;
+    uint16_t newval;
+    uint16_t pc;        // instruction that made the change
+    bool initial;       // reporting the value when the watch was set
+} watch_event;
+
+typedef void (*watch_handler)(const watch_event *ev);
+
 void watch_init();
 void watch_add(uint16_t addr, int interp);
+void watch_write(uint16_t addr, uint8_t oldval, uint16_t pc);
 void watch_check();
+void watch_set_handler(watch_handler handler);
+
+// Find the symbol at or before a ROM address, as "name + offset"
+void rom_symbol(uint16_t addr, char *st, size_t len);
 
 void coverage_read_sym(const char *fname);
 void coverage_read_equ(const char *fname);
@@ -38,6 +61,10 @@ void coverage_load(const i8080 *c, const char *fname);
 
 void coverage_rw(const i8080 *c, uint16_t area_start, uint16_t area_len);
 
+// Count the ROM's conditional jumps, calls and returns by which ways they
+// went, and if list, list those that only went one way
+void coverage_branches(const i8080 *c, bool list);
+
 void coverage_graphic_sdl(const i8080 *c, SDL_Renderer *rend);
 
 #endif
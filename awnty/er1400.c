@@ -1,5 +1,6 @@
 #include "er1400.h"
 #include <stdio.h>
+#include <string.h>
 
 int er1400_state = 0;
 int er1400_addr = 0;
@@ -93,6 +94,10 @@ void er1400_clock(int clock) {
     }
 }
 
+int er1400_clocked() {
+    return er1400_state == 5;
+}
+
 // Data out goes through inverting comparator (E48) so back to positive logic
 int er1400_read() {
     return er1400_data ^ 1;
@@ -120,3 +125,25 @@ void er1400_save() {
 void er1400_bug(int buggy) {
     er1400_is_faulty = buggy;
 }
+
+void er1400_snapshot(er1400_snap *snap) {
+    snap->state = er1400_state;
+    snap->addr = er1400_addr;
+    snap->count = er1400_count;
+    snap->reg = er1400_reg;
+    memcpy(snap->mem, er1400_mem, sizeof(er1400_mem));
+    snap->data = er1400_data;
+    snap->last_clock = er1400_last_clock;
+    snap->is_faulty = er1400_is_faulty;
+}
+
+void er1400_restore(const er1400_snap *snap) {
+    er1400_state = snap->state;
+    er1400_addr = snap->addr;
+    er1400_count = snap->count;
+    er1400_reg = snap->reg;
+    memcpy(er1400_mem, snap->mem, sizeof(er1400_mem));
+    er1400_data = snap->data;
+    er1400_last_clock = snap->last_clock;
+    er1400_is_faulty = snap->is_faulty;
+}
@@ -7,10 +7,27 @@ void er1400_init();
 void er1400_write(uint8_t command, uint8_t data);
 void er1400_erase();
 void er1400_clock(int clock);
+// Non-zero while the clock has any effect on the chip
+int er1400_clocked();
 int er1400_read();
 void er1400_bug(int buggy);
 
 void er1400_load(const char *fname);
 void er1400_save();
 
+// Complete chip state, for machine snapshots
+typedef struct er1400_snap {
+    int state;
+    int addr;
+    int count;
+    uint16_t reg;
+    uint16_t mem[100];
+    int data;
+    int last_clock;
+    int is_faulty;
+} er1400_snap;
+
+void er1400_snapshot(er1400_snap *snap);
+void er1400_restore(const er1400_snap *snap);
+
 #endif
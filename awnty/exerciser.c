@@ -0,0 +1,188 @@
+// Runs the standard 8080 CPU exercisers (TST8080, 8080PRE, CPUTEST and
+// 8080EXM, from the cpu_tests directory) on the emulator, with just enough of
+// CP/M for them to print, and reports whether each passed and how fast the
+// emulator ran it.
+//
+// The programs load at 0x0100. BDOS calls (CALL 5) reach an OUT 1 at 0x0005,
+// where functions 2 (print E) and 9 (print the string at DE, up to '$') are
+// handled; warm boot (JMP 0) reaches an OUT 0, which ends the run.
+
+#include "i8080.h"
+#include "unused.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OUTPUT_SIZE 0x10000
+
+static uint8_t memory[0x10000];
+static char output[OUTPUT_SIZE];
+static size_t output_len;
+static bool finished;
+static bool quiet = false;
+
+// How each exerciser reports success and failure
+typedef struct verdict {
+    const char *file;
+    const char *pass;
+    const char *fail;
+} verdict;
+
+static const verdict verdicts[] = {
+    { "TST8080.COM", "CPU IS OPERATIONAL", "CPU HAS FAILED" },
+    { "8080PRE.COM", "Preliminary tests complete", "ERROR" },
+    { "CPUTEST.COM", "CPU TESTS OK", "CPU FAILED" },
+    { "8080EXM.COM", "Tests complete", "ERROR" },
+    { "8080EXER.COM", "Tests complete", "ERROR" },
+};
+
+static void print_char(char ch) {
+    if (output_len < OUTPUT_SIZE - 1)
+        output[output_len++] = ch;
+    if (!quiet)
+        putchar(ch);
+}
+
+static uint8_t rb(void *userdata UNUSED, uint16_t addr) {
+    return memory[addr];
+}
+
+static void wb(void *userdata UNUSED, uint16_t addr, uint8_t val) {
+    memory[addr] = val;
+}
+
+static uint8_t port_in(void *userdata UNUSED, uint8_t port UNUSED) {
+    return 0x00;
+}
+
+static void port_out(void *userdata, uint8_t port, uint8_t value UNUSED) {
+    i8080 *c = (i8080 *)userdata;
+    if (port == 0) {
+        finished = true;
+    }
+    else if (port == 1) {
+        if (c->c == 2) {
+            print_char(c->e);
+        }
+        else if (c->c == 9) {
+            uint16_t addr = (c->d << 8) | c->e;
+            while (memory[addr] != '$')
+                print_char(memory[addr++]);
+        }
+    }
+}
+
+static uint8_t iack(void *userdata UNUSED) {
+    return 0xff;
+}
+
+static bool load(const char *fname) {
+    FILE *f = fopen(fname, "rb");
+    if (!f) {
+        fprintf(stderr, "Can't open %s\n", fname);
+        return false;
+    }
+    memset(memory, 0, sizeof(memory));
+    size_t len = fread(&memory[0x100], 1, sizeof(memory) - 0x100, f);
+    fclose(f);
+    if (len == 0) {
+        fprintf(stderr, "Empty file %s\n", fname);
+        return false;
+    }
+    memory[0x0000] = 0xd3; // OUT 0: warm boot ends the run
+    memory[0x0001] = 0x00;
+    memory[0x0005] = 0xd3; // OUT 1; RET: BDOS
+    memory[0x0006] = 0x01;
+    memory[0x0007] = 0xc9;
+    return true;
+}
+
+static const verdict *find_verdict(const char *fname) {
+    const char *base = strrchr(fname, '/');
+    base = base ? base + 1 : fname;
+    for (size_t v = 0; v < sizeof(verdicts) / sizeof(verdicts[0]); ++v) {
+        if (strcmp(base, verdicts[v].file) == 0)
+            return &verdicts[v];
+    }
+    return NULL;
+}
+
+// Runs one exerciser, returning true if it passed
+static bool run(const char *fname) {
+    if (!load(fname))
+        return false;
+
+    i8080 cpu;
+    i8080_init(&cpu);
+    cpu.userdata = &cpu;
+    cpu.read_byte = rb;
+    cpu.write_byte = wb;
+    cpu.port_in = port_in;
+    cpu.port_out = port_out;
+    cpu.iack = iack;
+    cpu.pc = 0x100;
+
+    output_len = 0;
+    finished = false;
+    printf("*** %s\n", fname);
+
+    unsigned long instructions = 0;
+    clock_t start = clock();
+    while (!finished && !cpu.halted) {
+        i8080_step(&cpu);
+        ++instructions;
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    output[output_len] = 0;
+    i8080_free(&cpu);
+
+    const verdict *v = find_verdict(fname);
+    bool passed;
+    if (cpu.halted) {
+        printf("\nHalted at %04x\n", cpu.pc - 1);
+        passed = false;
+    }
+    else if (v)
+        passed = strstr(output, v->pass) != NULL && strstr(output, v->fail) == NULL;
+    else
+        passed = strstr(output, "ERROR") == NULL && strstr(output, "FAIL") == NULL;
+
+    if (seconds <= 0)
+        seconds = 1.0 / CLOCKS_PER_SEC;
+    printf("\n%s: %s, %lu instructions, %lu cycles in %.2fs, %.1f million instructions/s (%.1f MHz)\n",
+        fname, passed ? "passed" : "FAILED", instructions, cpu.cyc, seconds,
+        instructions / seconds / 1e6, cpu.cyc / seconds / 1e6);
+    return passed;
+}
+
+int main(int argc, char *argv[]) {
+    static const char *defaults[] = {
+        "cpu_tests/TST8080.COM",
+        "cpu_tests/8080PRE.COM",
+        "cpu_tests/CPUTEST.COM",
+        "cpu_tests/8080EXM.COM",
+    };
+    const char *files[64];
+    int nfiles = 0;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "--quiet") == 0)
+            quiet = true;
+        else if (nfiles < 64)
+            files[nfiles++] = argv[arg];
+    }
+    if (nfiles == 0) {
+        for (size_t f = 0; f < sizeof(defaults) / sizeof(defaults[0]); ++f)
+            files[nfiles++] = defaults[f];
+    }
+
+    int failures = 0;
+    for (int f = 0; f < nfiles; ++f) {
+        if (!run(files[f]))
+            ++failures;
+    }
+    printf("%d of %d exercisers passed\n", nfiles - failures, nfiles);
+    return failures > 0 ? 1 : 0;
+}
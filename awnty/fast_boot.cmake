@@ -0,0 +1,73 @@
+# Runs an awnty script twice with --fast-boot, and checks the second run
+# restores the machine saved by the first and from there on prints what a
+# full boot does, apart from the idle loop statistics. Cache files the runs
+# write are removed afterwards.
+
+if(NOT DEFINED AWNTY)
+    message(FATAL_ERROR "AWNTY is required")
+endif()
+if(NOT DEFINED SCRIPT)
+    message(FATAL_ERROR "SCRIPT is required")
+endif()
+if(NOT DEFINED OUTPUT_DIR)
+    message(FATAL_ERROR "OUTPUT_DIR is required")
+endif()
+
+file(GLOB OLD_CACHE_FILES fast-boot-*.bin)
+
+execute_process(
+    COMMAND "${AWNTY}" --headless --no-pace "${SCRIPT}"
+    OUTPUT_VARIABLE FULL_OUTPUT
+    ERROR_VARIABLE FULL_OUTPUT
+    RESULT_VARIABLE FULL_RESULT
+)
+foreach(RUN IN ITEMS SAVE RESTORE)
+    execute_process(
+        COMMAND "${AWNTY}" --headless --no-pace --fast-boot "${SCRIPT}"
+        OUTPUT_VARIABLE ${RUN}_OUTPUT
+        ERROR_VARIABLE ${RUN}_OUTPUT
+        RESULT_VARIABLE ${RUN}_RESULT
+    )
+endforeach()
+
+file(GLOB CACHE_FILES fast-boot-*.bin)
+if(OLD_CACHE_FILES)
+    list(REMOVE_ITEM CACHE_FILES ${OLD_CACHE_FILES})
+endif()
+if(CACHE_FILES)
+    file(REMOVE ${CACHE_FILES})
+endif()
+
+if(NOT RESTORE_OUTPUT MATCHES "Fast boot: restored the machine at cycle [0-9]+\n")
+    message(FATAL_ERROR "${SCRIPT} wasn't restored by a second fast boot\n${RESTORE_OUTPUT}")
+endif()
+
+# Compare from the firmware reaching the point where the script starts
+foreach(RUN IN ITEMS FULL RESTORE)
+    string(FIND "${${RUN}_OUTPUT}" "Firmware reached " START)
+    if(START EQUAL -1)
+        message(FATAL_ERROR "${SCRIPT} never started its commands\n${${RUN}_OUTPUT}")
+    endif()
+    string(SUBSTRING "${${RUN}_OUTPUT}" ${START} -1 ${RUN}_OUTPUT)
+    string(REGEX REPLACE "Idle loops: [^\n]*\n" "" ${RUN}_OUTPUT "${${RUN}_OUTPUT}")
+endforeach()
+
+if(NOT RESTORE_OUTPUT STREQUAL FULL_OUTPUT OR NOT RESTORE_RESULT STREQUAL FULL_RESULT)
+    get_filename_component(SCRIPT_NAME "${SCRIPT}" NAME_WE)
+    set(RESTORE_FILE "${OUTPUT_DIR}/${SCRIPT_NAME}.fast-boot.txt")
+    set(FULL_FILE "${OUTPUT_DIR}/${SCRIPT_NAME}.full-boot.txt")
+    file(WRITE "${RESTORE_FILE}" "${RESTORE_OUTPUT}")
+    file(WRITE "${FULL_FILE}" "${FULL_OUTPUT}")
+    message(FATAL_ERROR
+        "${SCRIPT} runs differently after a fast boot\n"
+        "Exit status: ${RESTORE_RESULT}, full boot ${FULL_RESULT}\n"
+        "Output: ${RESTORE_FILE}\n"
+        "Full boot: ${FULL_FILE}\n"
+    )
+endif()
+
+if(NOT FULL_RESULT EQUAL 0)
+    message(FATAL_ERROR "${SCRIPT} failed with exit status ${FULL_RESULT}")
+endif()
+
+message(STATUS "${SCRIPT} runs the same after a fast boot")
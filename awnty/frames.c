@@ -0,0 +1,285 @@
+#include "frames.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+typedef struct frame_run {
+    uint64_t hash;
+    int count;
+} frame_run;
+
+static bool active = false;
+static bool saving;
+static char ref_dir[256];
+static int total_frames;
+static int tolerance_dots;
+static int frame_number;
+static int failures = 0;
+
+// Saving: the runs seen so far. Checking: the reference runs.
+static frame_run *runs = NULL;
+static int nruns = 0;
+static int runs_alloc = 0;
+static int run_index;       // checking: run the next frame should be in
+static int run_used;        // checking: frames of it already seen
+static int near_frames;     // checking: frames accepted within tolerance
+
+static bool add_run(uint64_t hash) {
+    if (nruns > 0 && runs[nruns - 1].hash == hash) {
+        ++runs[nruns - 1].count;
+        return true;
+    }
+    if (nruns == runs_alloc) {
+        int new_alloc = runs_alloc ? 2 * runs_alloc : 64;
+        frame_run *grown = realloc(runs, new_alloc * sizeof(frame_run));
+        if (!grown) {
+            fputs("Couldn't grow frame list\n", stderr);
+            return false;
+        }
+        runs = grown;
+        runs_alloc = new_alloc;
+    }
+    runs[nruns].hash = hash;
+    runs[nruns].count = 1;
+    ++nruns;
+    return true;
+}
+
+static bool seen_before(uint64_t hash) {
+    for (int r = 0; r < nruns - 1; ++r) {
+        if (runs[r].hash == hash)
+            return true;
+    }
+    return false;
+}
+
+static uint64_t image_hash(gdImagePtr im) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int sx = gdImageSX(im), sy = gdImageSY(im);
+    for (int y = 0; y < sy; ++y) {
+        for (int x = 0; x < sx; ++x) {
+            int p = gdImageGetPixel(im, x, y);
+            h = (h ^ (gdImageRed(im, p) << 16 | gdImageGreen(im, p) << 8 | gdImageBlue(im, p))) * 0x100000001b3ULL;
+        }
+    }
+    return h;
+}
+
+static void frame_path(char *path, size_t size, const char *name) {
+    snprintf(path, size, "%s/%s", ref_dir, name);
+}
+
+static bool write_png(gdImagePtr im, const char *name) {
+    char path[512];
+    frame_path(path, sizeof(path), name);
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Can't create '%s'\n", path);
+        return false;
+    }
+    gdImagePng(im, f);
+    fclose(f);
+    return true;
+}
+
+static gdImagePtr read_png(uint64_t hash) {
+    char name[40], path[512];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".png", hash);
+    frame_path(path, sizeof(path), name);
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    gdImagePtr im = gdImageCreateFromPng(f);
+    fclose(f);
+    return im;
+}
+
+static bool read_reference() {
+    char path[512], line[100];
+    frame_path(path, sizeof(path), "frames.txt");
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "No reference frames in %s\n", ref_dir);
+        return false;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        uint64_t hash;
+        int count;
+        if (line[0] == '#' || sscanf(line, "%" SCNx64 " %d", &hash, &count) != 2)
+            continue;
+        add_run(hash);
+        runs[nruns - 1].count = count;
+    }
+    fclose(f);
+    return true;
+}
+
+bool frames_start(const char *dir, int frames, bool save, int tolerance) {
+    frames_finish();
+    snprintf(ref_dir, sizeof(ref_dir), "%s", dir);
+    saving = save;
+    total_frames = frames;
+    tolerance_dots = tolerance;
+    frame_number = 0;
+    nruns = 0;
+    run_index = run_used = near_frames = 0;
+    if (saving) {
+        mkdir(ref_dir, 0777);
+    }
+    else if (!read_reference()) {
+        ++failures;
+        return false;
+    }
+    active = true;
+    return true;
+}
+
+bool frames_active() {
+    return active;
+}
+
+// Write the actual frame and a diff against the reference: dots only in the
+// actual frame are red, dots only in the reference are green, and dots in
+// both are dim. Returns the number of dots that differ.
+static int diff_frame(gdImagePtr im, gdImagePtr ref, bool write) {
+    int sx = gdImageSX(im), sy = gdImageSY(im);
+    if (gdImageSX(ref) != sx || gdImageSY(ref) != sy)
+        return sx * sy;
+    gdImagePtr diff = write ? gdImageCreate(sx, sy) : NULL;
+    int black = 0, dim = 0, red = 0, green = 0;
+    if (diff) {
+        black = gdImageColorAllocate(diff, 0, 0, 0);
+        dim = gdImageColorAllocate(diff, 64, 64, 64);
+        red = gdImageColorAllocate(diff, 255, 0, 0);
+        green = gdImageColorAllocate(diff, 0, 255, 0);
+    }
+    int differ = 0;
+    for (int y = 0; y < sy; ++y) {
+        for (int x = 0; x < sx; ++x) {
+            int p = gdImageGetPixel(im, x, y);
+            int q = gdImageGetPixel(ref, x, y);
+            int lit = gdImageRed(im, p) | gdImageGreen(im, p) | gdImageBlue(im, p);
+            int ref_lit = gdImageRed(ref, q) | gdImageGreen(ref, q) | gdImageBlue(ref, q);
+            bool same = gdImageRed(im, p) == gdImageRed(ref, q) && gdImageGreen(im, p) == gdImageGreen(ref, q)
+                && gdImageBlue(im, p) == gdImageBlue(ref, q);
+            if (!same)
+                ++differ;
+            if (diff)
+                gdImageSetPixel(diff, x, y, same ? (lit ? dim : black) : (lit >= ref_lit ? red : green));
+        }
+    }
+    if (diff) {
+        char name[60];
+        snprintf(name, sizeof(name), "diff-%d.png", frame_number);
+        write_png(diff, name);
+        snprintf(name, sizeof(name), "actual-%d.png", frame_number);
+        write_png(im, name);
+        gdImageDestroy(diff);
+    }
+    return differ;
+}
+
+static void check_frame(gdImagePtr im, unsigned long cyc) {
+    if (run_index >= nruns) {
+        printf("FAIL frame %d at cycle %lu: reference has only %d frames\n", frame_number, cyc, frame_number);
+        ++failures;
+        active = false;
+        return;
+    }
+    uint64_t want = runs[run_index].hash;
+    if (++run_used == runs[run_index].count) {
+        ++run_index;
+        run_used = 0;
+    }
+    if (image_hash(im) == want)
+        return;
+
+    gdImagePtr ref = read_png(want);
+    if (!ref) {
+        char name[40];
+        snprintf(name, sizeof(name), "actual-%d.png", frame_number);
+        write_png(im, name);
+        printf("FAIL frame %d at cycle %lu: differs from reference, see %s/%s"
+            " (save the frames of a good build there for a diff)\n",
+            frame_number, cyc, ref_dir, name);
+        ++failures;
+        active = false;
+        return;
+    }
+    int differ = diff_frame(im, ref, false);
+    if (differ <= tolerance_dots) {
+        ++near_frames;
+    }
+    else {
+        diff_frame(im, ref, true);
+        printf("FAIL frame %d at cycle %lu: %d dots differ from reference, see %s/diff-%d.png\n",
+            frame_number, cyc, differ, ref_dir, frame_number);
+        ++failures;
+        active = false; // later frames would only repeat the news
+    }
+    gdImageDestroy(ref);
+}
+
+bool frames_add(gdImagePtr im, unsigned long cyc) {
+    if (!active) {
+        gdImageDestroy(im);
+        return false;
+    }
+    if (saving) {
+        uint64_t hash = image_hash(im);
+        if (add_run(hash) && !seen_before(hash) && runs[nruns - 1].count == 1) {
+            char name[40];
+            snprintf(name, sizeof(name), "%016" PRIx64 ".png", hash);
+            write_png(im, name);
+        }
+    }
+    else {
+        check_frame(im, cyc);
+    }
+    gdImageDestroy(im);
+    if (active && ++frame_number >= total_frames)
+        frames_finish();
+    return active;
+}
+
+void frames_finish() {
+    if (!active) {
+        free(runs);
+        runs = NULL;
+        nruns = runs_alloc = 0;
+        return;
+    }
+    active = false;
+    if (saving) {
+        char path[512];
+        frame_path(path, sizeof(path), "frames.txt");
+        FILE *f = fopen(path, "w");
+        if (f) {
+            fprintf(f, "# frame hash, number of identical frames\n");
+            for (int r = 0; r < nruns; ++r)
+                fprintf(f, "%016" PRIx64 " %d\n", runs[r].hash, runs[r].count);
+            fclose(f);
+        }
+        printf("Saved %d frames (%d runs) to %s\n", frame_number, nruns, ref_dir);
+    }
+    else {
+        printf("Checked %d frames against %s", frame_number, ref_dir);
+        if (near_frames > 0)
+            printf(", %d within %d dots", near_frames, tolerance_dots);
+        printf("\n");
+    }
+    free(runs);
+    runs = NULL;
+    nruns = runs_alloc = 0;
+}
+
+int frames_failures() {
+    return failures;
+}
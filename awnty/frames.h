@@ -0,0 +1,25 @@
+#ifndef FRAMES_H
+#define FRAMES_H
+
+// Frame-by-frame regression checks of the rendered screen. A reference is a
+// directory holding frames.txt, which lists the hash of every frame as runs of
+// identical frames. Only frames.txt is committed.
+//
+// Saving writes frames.txt and one PNG per distinct frame, named by its hash.
+// Checking compares each frame's hash with the reference; at the first frame
+// that differs, the actual frame is written next to the reference. If saving
+// left a PNG of the reference frame there, it is compared dot by dot: frames
+// within the tolerance (in dots) pass, and others get a diff image too.
+
+#include <gd.h>
+#include <stdbool.h>
+
+bool frames_start(const char *dir, int frames, bool save, int tolerance);
+bool frames_active();
+// Add the next frame, taking ownership of the image. Returns false once all
+// the frames have been seen.
+bool frames_add(gdImagePtr im, unsigned long cyc);
+void frames_finish();
+int frames_failures();
+
+#endif
@@ -0,0 +1,444 @@
+// A coverage-guided fuzzer for the firmware's escape sequence parser.
+//
+// Each input is a stream of bytes for the receiver. It is run on the terminal
+// as it stands at idle_loop after power-up, restored from the fast boot cache
+// rather than booted again, by a script that streams the input and waits for
+// the firmware to go idle:
+//
+//   serial-file <corpus>/input.bin
+//   wait-idle
+//
+// The ROM bytes executed and the conditional branches taken each way are the
+// feedback. Inputs that reach any the corpus hasn't are kept, and mutated in
+// turn. Inputs are reported, and saved to the crashes directory, when
+//
+//   the firmware doesn't get back to idle_loop (a hang)
+//   the stack grows down past STACK_BOTTOM (an overflow, see stack_monitor.h)
+//   anything is written outside RAM (and attribute RAM with the AVO fitted)
+//
+// Options: --runs N (default 1000), --seed N, --max-len N (default 64),
+// --timeout cycles (default 20000000), --corpus dir (default fuzz-corpus),
+// --crashes dir (default fuzz-crashes). The corpus is saved as id-NNNNNN.bin
+// and read back on the next run. Each instance takes the first free number
+// for each file it saves, and has its own input and script files, named with
+// its process id, so instances with different seeds sharing a corpus
+// directory can work in parallel. Run from the awnty directory, as for awnty
+// itself. The result is 1 if anything was found.
+//
+// The emulator comes from the same library as awnty's.
+
+#define SDL_MAIN_HANDLED // main() is our own
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "awnty.h"
+#include "cov_flags.h"
+#include "cov_planes.h"
+#include "i8080.h"
+#include "quiet.h"
+#include "stack_monitor.h"
+#include "unused.h"
+#include "vt100_memory.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#define make_dir(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#define make_dir(path) mkdir(path, 0777)
+#endif
+
+#define MAX_INPUT 4096
+#define MAX_CORPUS 10000
+
+typedef struct input {
+    uint8_t *data;
+    int len;
+} input;
+
+static input corpus[MAX_CORPUS];
+static int corpus_count = 0;
+static int corpus_next_id = 0;
+static const char *corpus_dir = "fuzz-corpus";
+static const char *crashes_dir = "fuzz-crashes";
+static int crash_next_id = 0;
+
+static i8080 cpu;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+// Everything seen so far, and the writes outside RAM that a run with nothing
+// received makes
+static cov_planes run_planes;
+static cov_plane seen_exec, seen_taken, seen_not_taken, boot_writes, scratch;
+static cov_plane outside_ram, run_writes;
+
+static uint64_t rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static int rng_below(int n) {
+    return (int)(rng() % (uint64_t)n);
+}
+
+// Escape sequences to start from, and pieces for mutations to insert
+static const char *seeds[] = {
+    "hello",
+    "\033[H\033[2J",
+    "\033[5;10H*",
+    "\033[1;24r\033[24H\n",
+    "\033[0;1;4;5;7m",
+    "\033[?3h\033[?3l",
+    "\033[?6h\033[?7l",
+    "\033#8",
+    "\033#3\033#6",
+    "\033(0lqk\033(B",
+    "\033[c\033[5n\033[6n",
+    "\033Z\033[?2l\033Y%%\033<",
+    "\033[3g\033H\033[g",
+    "\033[2;1y",
+    "\0337\0338\033D\033M\033E",
+};
+
+static const char *tokens[] = {
+    "\033", "\033[", "\033[?", "\033#", "\033(", "\033)", ";", "?", "0", "1",
+    "9", "255", "65535", "\r", "\n", "\b", "\t", "\016", "\017", "\030", "\032",
+};
+
+static bool add_corpus(const uint8_t *data, int len) {
+    if (corpus_count >= MAX_CORPUS)
+        return false;
+    uint8_t *copy = malloc(len > 0 ? len : 1);
+    if (!copy)
+        return false;
+    memcpy(copy, data, len);
+    corpus[corpus_count].data = copy;
+    corpus[corpus_count].len = len;
+    ++corpus_count;
+    return true;
+}
+
+static bool write_to(FILE *f, const char *path, const uint8_t *data, int len) {
+    bool ok = fwrite(data, 1, len, f) == (size_t)len;
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Can't write %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+static bool write_file(const char *path, const uint8_t *data, int len) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Can't write %s\n", path);
+        return false;
+    }
+    return write_to(f, path, data, len);
+}
+
+// Saves to dir/prefix-NNNNNN.bin, with the first number from *next_id that
+// no other instance has taken. The path is left in path.
+static bool write_new_file(const char *dir, const char *prefix, int *next_id, const uint8_t *data, int len,
+        char *path, size_t size) {
+    for (;;) {
+        snprintf(path, size, "%s/%s-%06d.bin", dir, prefix, (*next_id)++);
+        FILE *f = fopen(path, "wbx");
+        if (f)
+            return write_to(f, path, data, len);
+        if (errno != EEXIST) {
+            fprintf(stderr, "Can't write %s\n", path);
+            return false;
+        }
+    }
+}
+
+static void save_corpus(const uint8_t *data, int len) {
+    char path[300];
+    write_new_file(corpus_dir, "id", &corpus_next_id, data, len, path, sizeof(path));
+}
+
+// id-000000.bin onwards, until one is missing
+static void load_corpus() {
+    for (;;) {
+        char path[300];
+        snprintf(path, sizeof(path), "%s/id-%06d.bin", corpus_dir, corpus_next_id);
+        FILE *f = fopen(path, "rb");
+        if (!f)
+            break;
+        uint8_t data[MAX_INPUT];
+        int len = (int)fread(data, 1, sizeof(data), f);
+        fclose(f);
+        add_corpus(data, len);
+        ++corpus_next_id;
+    }
+}
+
+static bool write_script(const char *path, const char *input_path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Can't write %s\n", path);
+        return false;
+    }
+    fprintf(f, "serial-file %s\nwait-idle\n", input_path);
+    return fclose(f) == 0;
+}
+
+static void note_write(uint16_t addr, uint8_t val UNUSED) {
+    if (cov_plane_test(outside_ram, addr))
+        run_writes[addr >> 6] |= 1ULL << (addr & 63);
+}
+
+typedef struct outcome {
+    bool hang, overflow;
+    unsigned long stray_writes;
+    unsigned long new_exec, new_branches;
+} outcome;
+
+static bool run_input(const uint8_t *data, int len, const char *script_path, const char *input_path,
+        outcome *out) {
+    if (!write_file(input_path, data, len))
+        return false;
+    memset(run_writes, 0, sizeof(run_writes));
+    quiet_begin();
+    run_test(&cpu, "../bin/vt100.bin", script_path);
+    quiet_end();
+    if (!cpu.taken) {
+        fputs("No branch maps\n", stderr);
+        return false;
+    }
+
+    cov_planes_from(&run_planes, cpu.coverage);
+    out->hang = waits_timed_out > 0;
+    out->overflow = stack_monitor_alerts() > 0;
+    cov_plane_andnot(scratch, run_writes, boot_writes);
+    out->stray_writes = cov_plane_count(scratch, 0x0000, 0x10000);
+
+    const uint64_t *exec = cov_planes_flag(&run_planes, COV_EXEC);
+    cov_plane_andnot(scratch, exec, seen_exec);
+    out->new_exec = cov_plane_count(scratch, 0x0000, 0x2000);
+    cov_plane_andnot(scratch, cpu.taken, seen_taken);
+    out->new_branches = cov_plane_count(scratch, 0x0000, 0x2000);
+    cov_plane_andnot(scratch, cpu.not_taken, seen_not_taken);
+    out->new_branches += cov_plane_count(scratch, 0x0000, 0x2000);
+    for (int w = 0; w < COV_PLANE_WORDS; ++w) {
+        seen_exec[w] |= exec[w];
+        seen_taken[w] |= cpu.taken[w];
+        seen_not_taken[w] |= cpu.not_taken[w];
+    }
+    return true;
+}
+
+static void print_input(const uint8_t *data, int len) {
+    for (int i = 0; i < len; ++i) {
+        if (data[i] == 0x1b)
+            printf("<ESC>");
+        else if (data[i] < 0x20 || data[i] >= 0x7f)
+            printf("<%02x>", data[i]);
+        else
+            putchar(data[i]);
+    }
+}
+
+static void report(const char *what, const uint8_t *data, int len) {
+    char path[300];
+    bool saved = write_new_file(crashes_dir, what, &crash_next_id, data, len, path, sizeof(path));
+    printf("Found %s: ", what);
+    print_input(data, len);
+    if (saved)
+        printf(" (saved to %s)", path);
+    printf("\n");
+}
+
+static int mutate(uint8_t *data, int len, int max_len) {
+    int rounds = 1 + rng_below(4);
+    for (int r = 0; r < rounds; ++r) {
+        int pos = len > 0 ? rng_below(len) : 0;
+        switch (rng_below(7)) {
+        case 0: // flip a bit
+            if (len > 0)
+                data[pos] ^= 1 << rng_below(8);
+            break;
+        case 1: // any byte
+            if (len > 0)
+                data[pos] = (uint8_t)rng();
+            break;
+        case 2: // printable byte, as most final and intermediate characters are
+            if (len > 0)
+                data[pos] = 0x20 + rng_below(0x5f);
+            break;
+        case 3: { // insert a token
+            const char *t = tokens[rng_below(sizeof(tokens) / sizeof(tokens[0]))];
+            int n = (int)strlen(t);
+            if (len + n <= max_len) {
+                memmove(&data[pos + n], &data[pos], len - pos);
+                memcpy(&data[pos], t, n);
+                len += n;
+            }
+            break;
+        }
+        case 4: // delete a run
+            if (len > 0) {
+                int n = 1 + rng_below(len - pos < 4 ? len - pos : 4);
+                memmove(&data[pos], &data[pos + n], len - pos - n);
+                len -= n;
+            }
+            break;
+        case 5: // repeat a run
+            if (len > 0) {
+                int n = 1 + rng_below(len - pos < 8 ? len - pos : 8);
+                if (len + n <= max_len) {
+                    memmove(&data[pos + n], &data[pos], len - pos);
+                    len += n;
+                }
+            }
+            break;
+        case 6: { // splice in part of another input
+            const input *other = &corpus[rng_below(corpus_count)];
+            if (other->len > 0) {
+                int from = rng_below(other->len);
+                int n = other->len - from;
+                if (len + n > max_len)
+                    n = max_len - len;
+                if (n > 0) {
+                    memmove(&data[pos + n], &data[pos], len - pos);
+                    memcpy(&data[pos], &other->data[from], n);
+                    len += n;
+                }
+            }
+            break;
+        }
+        }
+    }
+    return len;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long runs = 1000;
+    int max_len = 64;
+    wait_timeout = 20000000;
+    for (int arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "--runs") == 0 && arg + 1 < argc)
+            runs = strtoul(argv[++arg], NULL, 0);
+        else if (strcmp(argv[arg], "--seed") == 0 && arg + 1 < argc)
+            rng_state ^= strtoull(argv[++arg], NULL, 0) * 0xbf58476d1ce4e5b9ULL;
+        else if (strcmp(argv[arg], "--max-len") == 0 && arg + 1 < argc)
+            max_len = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "--timeout") == 0 && arg + 1 < argc)
+            wait_timeout = strtoul(argv[++arg], NULL, 0);
+        else if (strcmp(argv[arg], "--corpus") == 0 && arg + 1 < argc)
+            corpus_dir = argv[++arg];
+        else if (strcmp(argv[arg], "--crashes") == 0 && arg + 1 < argc)
+            crashes_dir = argv[++arg];
+        else {
+            fprintf(stderr, "Unknown option %s\n", argv[arg]);
+            return 2;
+        }
+    }
+    if (max_len < 1 || max_len > MAX_INPUT)
+        max_len = MAX_INPUT;
+    if (rng_state == 0)
+        rng_state = 1;
+
+    if (!memory_init()) {
+        fputs("Couldn't allocate 64K memory\n", stderr);
+        return 1;
+    }
+    FILE *charf = fopen("../bin/23-018E2.bin", "rb");
+    if (charf) {
+        if (fread(chargen, 1, 2048, charf) != 2048)
+            fputs("Short chargen ROM ../bin/23-018E2.bin\n", stderr);
+        fclose(charf);
+    }
+    make_dir(corpus_dir);
+    make_dir(crashes_dir);
+    char script_path[300], input_path[300];
+    snprintf(script_path, sizeof(script_path), "%s/script-%d.txt", corpus_dir, (int)getpid());
+    snprintf(input_path, sizeof(input_path), "%s/input-%d.bin", corpus_dir, (int)getpid());
+    if (!write_script(script_path, input_path))
+        return 1;
+
+    opt_headless = true;
+    opt_pace = false;
+    opt_fast_boot = true;
+    opt_stack_monitor = true;
+    for (int w = 0; w < COV_PLANE_WORDS; ++w) {
+        uint32_t addr = w * 64;
+        bool ram = addr >= 0x2000 && addr < (have_avo ? 0x4000u : 0x3000u);
+        outside_ram[w] = ram ? 0 : ~0ULL;
+    }
+    write_observer = note_write;
+
+    // Nothing received: what the firmware writes anyway
+    outcome out;
+    if (!run_input(NULL, 0, script_path, input_path, &out))
+        return 1;
+    memcpy(boot_writes, run_writes, sizeof(cov_plane));
+
+    load_corpus();
+    int loaded = corpus_count;
+    if (corpus_count == 0) {
+        for (size_t s = 0; s < sizeof(seeds) / sizeof(seeds[0]); ++s) {
+            const uint8_t *data = (const uint8_t *)seeds[s];
+            int len = (int)strlen(seeds[s]);
+            if (add_corpus(data, len))
+                save_corpus(data, len);
+        }
+    }
+    // Everything the corpus covers already counts as seen
+    for (int i = 0; i < corpus_count; ++i)
+        run_input(corpus[i].data, corpus[i].len, script_path, input_path, &out);
+    printf("Fuzz: %d inputs in the corpus (%d loaded), %lu ROM bytes executed\n",
+        corpus_count, loaded, cov_plane_count(seen_exec, 0x0000, 0x2000));
+
+    int hangs = 0, overflows = 0, strays = 0;
+    for (unsigned long run = 0; run < runs; ++run) {
+        uint8_t data[MAX_INPUT * 2];
+        const input *parent = &corpus[rng_below(corpus_count)];
+        memcpy(data, parent->data, parent->len);
+        int len = mutate(data, parent->len, max_len);
+        if (!run_input(data, len, script_path, input_path, &out))
+            return 1;
+        if (out.hang) {
+            ++hangs;
+            report("hang", data, len);
+        }
+        if (out.overflow) {
+            ++overflows;
+            report("stack", data, len);
+        }
+        if (out.stray_writes) {
+            ++strays;
+            report("write", data, len);
+        }
+        if ((out.new_exec || out.new_branches) && !out.hang && add_corpus(data, len)) {
+            save_corpus(data, len);
+            printf("Run %lu: %lu new ROM bytes, %lu new branch outcomes from ", run, out.new_exec, out.new_branches);
+            print_input(data, len);
+            printf("\n");
+        }
+    }
+
+    printf("Fuzz: %lu runs, %d inputs in the corpus, %lu ROM bytes executed, %lu branches taken, %lu not taken\n",
+        runs, corpus_count, cov_plane_count(seen_exec, 0x0000, 0x2000),
+        cov_plane_count(seen_taken, 0x0000, 0x2000), cov_plane_count(seen_not_taken, 0x0000, 0x2000));
+    printf("Fuzz: %d hangs, %d stack overflows, %d stray writes\n", hangs, overflows, strays);
+
+    remove(script_path);
+    remove(input_path);
+    for (int i = 0; i < corpus_count; ++i)
+        free(corpus[i].data);
+    i8080_free(&cpu);
+    free(memory);
+    return hangs + overflows + strays > 0 ? 1 : 0;
+}
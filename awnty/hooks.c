@@ -0,0 +1,183 @@
+#include "hooks.h"
+
+#include "coverage.h"
+#include "vt100_memory.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint8_t hook_map[0x10000 / 8];
+
+#define OP_EQ 0
+#define OP_NE 1
+#define OP_LT 2
+#define OP_GT 3
+#define OP_LE 4
+#define OP_GE 5
+
+typedef struct hook_entry {
+    uint16_t addr;
+    hook_handler handler;
+    char name[40];
+    bool has_cond;
+    hook_cond cond;
+} hook_entry;
+
+static const int max_hooks = 256;
+static hook_entry hooks[256];
+static int num_hooks = 0;
+
+void hooks_init() {
+    num_hooks = 0;
+    memset(hook_map, 0, sizeof(hook_map));
+}
+
+bool hook_add(uint16_t addr, hook_handler handler, const char *name, const hook_cond *cond) {
+    if (num_hooks >= max_hooks)
+        return false;
+    hook_entry *h = &hooks[num_hooks++];
+    h->addr = addr;
+    h->handler = handler;
+    snprintf(h->name, sizeof(h->name), "%s", name ? name : "");
+    h->has_cond = cond != NULL && cond->operand != HOOK_NONE;
+    if (h->has_cond)
+        h->cond = *cond;
+    hook_map[addr >> 3] |= 1 << (addr & 7);
+    return true;
+}
+
+void hook_remove(uint16_t addr, hook_handler handler) {
+    bool others = false;
+    int kept = 0;
+    for (int i = 0; i < num_hooks; ++i) {
+        if (hooks[i].addr == addr && hooks[i].handler == handler)
+            continue;
+        others = others || hooks[i].addr == addr;
+        hooks[kept++] = hooks[i];
+    }
+    num_hooks = kept;
+    if (!others)
+        hook_map[addr >> 3] &= ~(1 << (addr & 7));
+}
+
+static uint16_t cond_operand(const i8080 *c, const hook_cond *cond) {
+    switch (cond->operand) {
+        case HOOK_A:   return c->a;
+        case HOOK_B:   return c->b;
+        case HOOK_C:   return c->c;
+        case HOOK_D:   return c->d;
+        case HOOK_E:   return c->e;
+        case HOOK_H:   return c->h;
+        case HOOK_L:   return c->l;
+        case HOOK_BC:  return (c->b << 8) | c->c;
+        case HOOK_DE:  return (c->d << 8) | c->e;
+        case HOOK_HL:  return (c->h << 8) | c->l;
+        case HOOK_SP:  return c->sp;
+        case HOOK_MEM: return memory[cond->mem_addr];
+    }
+    return 0;
+}
+
+static bool cond_holds(const i8080 *c, const hook_cond *cond) {
+    uint16_t v = cond_operand(c, cond);
+    switch (cond->op) {
+        case OP_EQ: return v == cond->value;
+        case OP_NE: return v != cond->value;
+        case OP_LT: return v < cond->value;
+        case OP_GT: return v > cond->value;
+        case OP_LE: return v <= cond->value;
+        case OP_GE: return v >= cond->value;
+    }
+    return false;
+}
+
+void hook_run(i8080 *c) {
+    uint16_t pc = c->pc;
+    for (int i = 0; i < num_hooks; ++i) {
+        hook_entry *h = &hooks[i];
+        if (h->addr == pc && (!h->has_cond || cond_holds(c, &h->cond)))
+            h->handler(c, h->name);
+    }
+}
+
+int hook_parse_addr(const char *text) {
+    char name[50];
+    if (sscanf(text, "%49s", name) != 1)
+        return -1;
+    for (int addr = 0; addr < 0x2000; ++addr) {
+        if (symtable[addr] && strcmp(symtable[addr], name) == 0)
+            return addr;
+    }
+    char *end;
+    long addr = strtol(name, &end, 16);
+    if (*end != 0 || addr < 0 || addr > 0xffff)
+        return -1;
+    return addr;
+}
+
+// Parse a RAM location, either a hex address or an equate
+static int parse_ram(const char *name) {
+    for (int i = 0; i < 0x1000; ++i) {
+        if (equtable[i] && strcmp(equtable[i], name) == 0)
+            return equoffset + i;
+    }
+    char *end;
+    long addr = strtol(name, &end, 16);
+    if (*end != 0 || addr < 0 || addr > 0xffff)
+        return -1;
+    return addr;
+}
+
+bool hook_parse_cond(const char *text, hook_cond *cond) {
+    const char *regs[] = { "", "a", "b", "c", "d", "e", "h", "l", "bc", "de", "hl", "sp" };
+    const char *ops[] = { "==", "!=", "<", ">", "<=", ">=" };
+    char lhs[50];
+    int n = 0;
+
+    while (isspace((unsigned char)*text))
+        ++text;
+    while (n < 49 && *text && strchr("=!<>", *text) == NULL && !isspace((unsigned char)*text))
+        lhs[n++] = *text++;
+    lhs[n] = 0;
+    while (isspace((unsigned char)*text))
+        ++text;
+
+    cond->operand = HOOK_NONE;
+    if (lhs[0] == '(' && lhs[n - 1] == ')') {
+        lhs[n - 1] = 0;
+        int addr = parse_ram(&lhs[1]);
+        if (addr < 0)
+            return false;
+        cond->operand = HOOK_MEM;
+        cond->mem_addr = addr;
+    }
+    else {
+        for (int r = HOOK_A; r <= HOOK_SP; ++r) {
+            if (strcmp(lhs, regs[r]) == 0)
+                cond->operand = r;
+        }
+    }
+    if (cond->operand == HOOK_NONE)
+        return false;
+
+    // Try two character operators before one character ones
+    cond->op = -1;
+    for (int o = OP_GE; o >= OP_EQ; --o) {
+        if (strncmp(text, ops[o], strlen(ops[o])) == 0) {
+            cond->op = o;
+            text += strlen(ops[o]);
+            break;
+        }
+    }
+    if (cond->op < 0)
+        return false;
+
+    char *end;
+    long value = strtol(text, &end, 16);
+    if (end == text)
+        return false;
+    cond->value = value;
+    return true;
+}
@@ -0,0 +1,57 @@
+#ifndef HOOKS_H
+#define HOOKS_H
+
+#include "i8080.h"
+
+// PC hooks: handlers run just before the instruction at a given address is
+// executed. The run loop tests one bit per instruction, so addresses that
+// aren't hooked cost nothing more than that.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+extern uint8_t hook_map[0x10000 / 8];
+
+static inline bool hook_hit(uint16_t pc) {
+    return (hook_map[pc >> 3] & (1 << (pc & 7))) != 0;
+}
+
+// Optional condition on a hook, e.g. "a==1b", "hl!=2050" or "(curs_row)>=5"
+typedef struct hook_cond {
+    int operand;        // HOOK_* below
+    uint16_t mem_addr;  // for HOOK_MEM
+    int op;             // comparison operator
+    uint16_t value;
+} hook_cond;
+
+#define HOOK_NONE 0
+#define HOOK_A 1
+#define HOOK_B 2
+#define HOOK_C 3
+#define HOOK_D 4
+#define HOOK_E 5
+#define HOOK_H 6
+#define HOOK_L 7
+#define HOOK_BC 8
+#define HOOK_DE 9
+#define HOOK_HL 10
+#define HOOK_SP 11
+#define HOOK_MEM 12
+
+typedef void (*hook_handler)(i8080 *c, const char *name);
+
+void hooks_init();
+// name is for reporting (a copy is kept); cond may be NULL. Returns false if
+// the hook table is full.
+bool hook_add(uint16_t addr, hook_handler handler, const char *name, const hook_cond *cond);
+// Remove the hooks at addr with this handler. Not from within a handler.
+void hook_remove(uint16_t addr, hook_handler handler);
+// Run all handlers for c->pc whose conditions hold
+void hook_run(i8080 *c);
+
+// Parse "<sym|hex addr>" using ROM symbols. Returns -1 if not recognised.
+int hook_parse_addr(const char *text);
+// Parse a condition. Returns false if it isn't understood.
+bool hook_parse_cond(const char *text, hook_cond *cond);
+
+#endif
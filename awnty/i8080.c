@@ -1,5 +1,5 @@
 #include "i8080.h"
-#include "coverage.h"
+#include "cov_flags.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -26,6 +26,27 @@ static const uint8_t OPCODES_CYCLES[256] = {
     5, 10, 10, 18, 11, 11, 7,  11, 5, 5,  10, 4,  11, 17, 7, 11, // E
     5, 10, 10, 4,  11, 11, 7,  11, 5, 5,  10, 4,  11, 17, 7, 11  // F
 };
+
+// the number of bytes in each instruction, opcode included
+static const uint8_t OPCODES_LENGTHS[256] = {
+//  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 1
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, // 2
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, // 3
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 4
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 5
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 6
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 7
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 8
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 9
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // A
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // B
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1, // C
+    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // D
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1, // E
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1  // F
+};
 // clang-format on
 
 static const char* DISASSEMBLE_TABLE[] = {"nop", "lxi b,#", "stax b", "inx b",
@@ -87,6 +108,8 @@ static inline void i8080_wb(i8080* const c, uint16_t addr, uint8_t val) {
             c->pc != 0x1084) { // exclude memset
         c->coverage[addr] |= COV_WRITE;
     }
+    if (addr < c->rom_end)
+        i8080_invalidate(c, addr);
     c->write_byte(c->userdata, addr, val);
 }
 
@@ -101,6 +124,10 @@ static inline uint16_t i8080_rw(i8080* const c, uint16_t addr) {
 // writes a word to memory
 static inline void i8080_ww(i8080* const c, uint16_t addr, uint16_t val) {
     //if (addr >= 0x2000 && addr < 0x3000) printf("[PC = %04x] ww %04x\n", c->pc, addr);
+    if (addr < c->rom_end) {
+        i8080_invalidate(c, addr);
+        i8080_invalidate(c, addr + 1);
+    }
     c->write_byte(c->userdata, addr, val & 0xFF);
     c->write_byte(c->userdata, addr + 1, val >> 8);
     c->coverage[addr] |= COV_WRITE;
@@ -109,12 +136,16 @@ static inline void i8080_ww(i8080* const c, uint16_t addr, uint16_t val) {
 
 // returns the next byte in memory (and updates the program counter)
 static inline uint8_t i8080_next_byte(i8080* const c) {
+  if (c->op) // already fetched by i8080_decode()
+    return c->op->operand;
   c->coverage[c->pc] |= COV_EXEC;
   return i8080_rb(c, c->pc++);
 }
 
 // returns the next word in memory (and updates the program counter)
 static inline uint16_t i8080_next_word(i8080* const c) {
+  if (c->op)
+    return c->op->operand;
   uint16_t result = i8080_rw(c, c->pc);
   c->coverage[c->pc] |= COV_EXEC;
   c->coverage[c->pc + 1] |= COV_EXEC;
@@ -266,10 +297,19 @@ static inline void i8080_jmp(i8080* const c, uint16_t addr) {
   c->pc = addr;
 }
 
+// records which way a conditional instruction went
+static inline void i8080_branch(i8080* const c, bool condition) {
+  if (c->taken) {
+    uint64_t* const map = condition ? c->taken : c->not_taken;
+    map[c->inst_pc >> 6] |= 1ULL << (c->inst_pc & 63);
+  }
+}
+
 // jumps to next address pointed by the next word in memory if a condition
 // is met
 static inline void i8080_cond_jmp(i8080* const c, bool condition) {
   uint16_t addr = i8080_next_word(c);
+  i8080_branch(c, condition);
   if (condition) {
     c->pc = addr;
   }
@@ -284,6 +324,7 @@ static inline void i8080_call(i8080* const c, uint16_t addr) {
 // calls to next word in memory if a condition is met
 static inline void i8080_cond_call(i8080* const c, bool condition) {
   uint16_t addr = i8080_next_word(c);
+  i8080_branch(c, condition);
   if (condition) {
     i8080_call(c, addr);
     c->cyc += 6;
@@ -297,6 +338,7 @@ static inline void i8080_ret(i8080* const c) {
 
 // returns from subroutine if a condition is met
 static inline void i8080_cond_ret(i8080* const c, bool condition) {
+  i8080_branch(c, condition);
   if (condition) {
     i8080_ret(c);
     c->cyc += 6;
@@ -730,6 +772,7 @@ void i8080_init(i8080* const c) {
 
   c->pc = 0;
   c->sp = 0;
+  c->inst_pc = 0;
 
   c->a = 0;
   c->b = 0;
@@ -753,10 +796,116 @@ void i8080_init(i8080* const c) {
 
   c->coverage = malloc(0x10000);
   memset(c->coverage, 0, 0x10000);
+  c->taken = NULL;
+  c->not_taken = NULL;
+
+  c->decoded = NULL;
+  c->rom_end = 0;
+  c->op = NULL;
+}
+
+// frees the coverage and branch maps and the decode cache, leaving them NULL
+void i8080_free(i8080* const c) {
+  free(c->coverage);
+  free(c->taken);
+  free(c->not_taken);
+  free(c->decoded);
+  c->coverage = NULL;
+  c->taken = c->not_taken = NULL;
+  c->decoded = NULL;
+  c->rom_end = 0;
+}
+
+// copies the registers and state of a saved CPU into `c`, keeping its own
+// callbacks, coverage, branch maps and decode cache
+void i8080_restore_state(i8080* const c, const i8080* saved) {
+  i8080 live = *c;
+  *c = *saved;
+  c->read_byte = live.read_byte;
+  c->write_byte = live.write_byte;
+  c->port_in = live.port_in;
+  c->port_out = live.port_out;
+  c->userdata = live.userdata;
+  c->iack = live.iack;
+  c->coverage = live.coverage;
+  c->taken = live.taken;
+  c->not_taken = live.not_taken;
+  c->decoded = live.decoded;
+  c->rom_end = live.rom_end;
+  c->op = NULL;
+}
+
+// caches the instructions decoded from the first `size` bytes of memory,
+// which must not change other than through the CPU or i8080_invalidate().
+// Calling it again forgets all the instructions decoded so far.
+void i8080_set_rom(i8080* const c, uint16_t size) {
+  free(c->decoded);
+  c->decoded = calloc(size, sizeof(i8080_decoded));
+  c->rom_end = c->decoded ? size : 0;
+}
+
+// starts recording which way each conditional jump, call and return goes.
+// The caller frees the maps, as for the coverage map.
+bool i8080_record_branches(i8080* const c) {
+  free(c->taken);
+  free(c->not_taken);
+  c->taken = calloc(0x10000 / 64, sizeof(uint64_t));
+  c->not_taken = calloc(0x10000 / 64, sizeof(uint64_t));
+  if (!c->taken || !c->not_taken) {
+    free(c->taken);
+    free(c->not_taken);
+    c->taken = c->not_taken = NULL;
+    return false;
+  }
+  return true;
+}
+
+// forgets any decoded instruction that includes the byte at addr
+void i8080_invalidate(i8080* const c, uint16_t addr) {
+  for (int back = 0; back < 3 && back <= addr; back++) {
+    if (addr - back < c->rom_end)
+      c->decoded[addr - back].len = 0;
+  }
+}
+
+// fetches the instruction at pc into the decode cache, marking the coverage
+// that fetching it byte by byte would have done
+static void i8080_decode(i8080* const c, i8080_decoded* const d) {
+  uint16_t pc = c->pc;
+  d->opcode = c->read_byte(c->userdata, pc);
+  d->len = OPCODES_LENGTHS[d->opcode];
+  if (d->len == 2)
+    d->operand = c->read_byte(c->userdata, pc + 1);
+  else if (d->len == 3)
+    d->operand = c->read_byte(c->userdata, pc + 1) |
+                 c->read_byte(c->userdata, pc + 2) << 8;
+
+  for (int i = 0; i < d->len; i++) {
+    uint16_t addr = pc + i;
+    c->coverage[addr] |= COV_EXEC;
+    // see i8080_rb(), which sees pc already past the byte it reads
+    if (d->len == 3 && i > 0)
+      c->coverage[addr] |= COV_READ;
+    else if (addr + 1 != 0x0051 && addr + 1 != 0x0081 && addr + 1 != 0x0092)
+      c->coverage[addr] |= COV_READ;
+  }
+}
+
+// executes the instruction at pc from the decode cache. Coverage was marked
+// when it was decoded, and is only ever added to.
+static void i8080_execute_decoded(i8080* const c) {
+  i8080_decoded* const d = &c->decoded[c->pc];
+  if (d->len == 0)
+    i8080_decode(c, d);
+  c->pc += d->len;
+  c->op = d;
+  i8080_execute(c, d->opcode);
+  c->op = NULL;
 }
 
 // executes one instruction
 void i8080_step(i8080* const c) {
+  c->inst_pc = c->pc;
   // interrupt processing: if an interrupt is pending and IFF is set,
   // we execute the interrupt vector passed by the user.
   if (c->interrupt_pending && c->iff && c->interrupt_delay == 0) {
@@ -767,7 +916,11 @@ void i8080_step(i8080* const c) {
     c->interrupt_vector = c->iack(c);
 
     i8080_execute(c, c->interrupt_vector);
-  } else if (!c->halted) {
+  } else if (c->halted) {
+    return;
+  } else if (c->pc < c->rom_end) {
+    i8080_execute_decoded(c);
+  } else {
     i8080_execute(c, i8080_next_byte(c));
   }
 }
@@ -802,4 +955,32 @@ void i8080_debug_output(i8080* const c, bool print_disassembly) {
   printf("\n");
 }
 
+// returns the mnemonic for an opcode, with # for an immediate operand and $
+// for an address
+const char* i8080_disassemble(uint8_t opcode) {
+  return DISASSEMBLE_TABLE[opcode];
+}
+
+// returns the cycles an opcode takes, without the 6 more for a conditional
+// call or return that goes
+uint8_t i8080_opcode_cycles(uint8_t opcode) {
+  return OPCODES_CYCLES[opcode];
+}
+
+uint8_t i8080_read(i8080* const c, uint16_t addr) {
+  return i8080_rb(c, addr);
+}
+
+void i8080_write(i8080* const c, uint16_t addr, uint8_t val) {
+  i8080_wb(c, addr, val);
+}
+
+uint16_t i8080_read_word(i8080* const c, uint16_t addr) {
+  return i8080_rw(c, addr);
+}
+
+void i8080_write_word(i8080* const c, uint16_t addr, uint16_t val) {
+  i8080_ww(c, addr, val);
+}
+
 #undef SET_ZSP
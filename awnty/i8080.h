@@ -5,6 +5,13 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// An instruction decoded from read-only memory
+typedef struct i8080_decoded {
+  uint8_t opcode;
+  uint8_t len; // 0 until decoded
+  uint16_t operand;
+} i8080_decoded;
+
 typedef struct i8080 {
   // memory + io interface
   uint8_t (*read_byte)(void*, uint16_t); // user function to read from memory
@@ -17,6 +24,7 @@ typedef struct i8080 {
   unsigned long cyc; // cycle count
 
   uint16_t pc, sp; // program counter, stack pointer
+  uint16_t inst_pc; // address of the instruction being executed
   uint8_t a, b, c, d, e, h, l; // registers
   // flags: sign, zero, half-carry, parity, carry, interrupt flip-flop
   bool sf : 1, zf : 1, hf : 1, pf : 1, cf : 1, iff : 1;
@@ -27,12 +35,35 @@ typedef struct i8080 {
   uint8_t interrupt_delay;
 
   uint8_t *coverage;
+  // conditional jumps, calls and returns that went each way: a bit for each
+  // instruction address, 64 to a word. NULL unless i8080_record_branches().
+  uint64_t *taken, *not_taken;
+
+  // decode cache for memory below rom_end, which must read back the same
+  // every time without side effects
+  i8080_decoded *decoded;
+  uint16_t rom_end;
+  const i8080_decoded *op; // cached instruction being executed
 
 } i8080;
 
 void i8080_init(i8080* const c);
+void i8080_free(i8080* const c);
+void i8080_restore_state(i8080* const c, const i8080* saved);
 void i8080_step(i8080* const c);
 void i8080_interrupt(i8080* const c);
+void i8080_set_rom(i8080* const c, uint16_t size);
+bool i8080_record_branches(i8080* const c);
+void i8080_invalidate(i8080* const c, uint16_t addr);
 void i8080_debug_output(i8080* const c, bool print_disassembly);
+const char* i8080_disassemble(uint8_t opcode);
+uint8_t i8080_opcode_cycles(uint8_t opcode);
+
+// memory accesses as instructions make them, coverage included, for code
+// translated from the ROM (see jit.h). pc must be past the instruction.
+uint8_t i8080_read(i8080* const c, uint16_t addr);
+void i8080_write(i8080* const c, uint16_t addr, uint8_t val);
+uint16_t i8080_read_word(i8080* const c, uint16_t addr);
+void i8080_write_word(i8080* const c, uint16_t addr, uint16_t val);
 
 #endif // I8080_I8080_H_
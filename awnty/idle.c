@@ -0,0 +1,864 @@
+#include "idle.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "unused.h"
+
+#define MAX_STEPS 256       // instructions in a pass
+#define MAX_READS 4         // data reads by one instruction (XTHL, LHLD, POP)
+#define MAX_WRITES 2
+#define MAX_CHANGES 32      // locations written in a pass
+#define MAX_TAINTED 32
+#define MAX_INPUTS 64       // locations read before the pass writes them
+#define MAX_MODELS 8        // passes kept for repeating
+
+// Register and flag bits, for following taint
+#define T_A 0x0001
+#define T_B 0x0002
+#define T_C 0x0004
+#define T_D 0x0008
+#define T_E 0x0010
+#define T_H 0x0020
+#define T_L 0x0040
+#define T_SP 0x0080
+#define T_FS 0x0100
+#define T_FZ 0x0200
+#define T_FH 0x0400
+#define T_FP 0x0800
+#define T_FC 0x1000
+#define T_FLAGS (T_FS | T_FZ | T_FH | T_FP | T_FC)
+#define T_BC (T_B | T_C)
+#define T_DE (T_D | T_E)
+#define T_HL (T_H | T_L)
+
+uint8_t idle_map[0x10000 / 8];
+bool idle_tracking = false;
+
+typedef struct regs {
+    uint8_t a, b, c, d, e, h, l;
+    bool sf, zf, hf, pf, cf, iff;
+    uint8_t interrupt_delay;
+    uint16_t sp;
+} regs;
+
+typedef struct step {
+    uint16_t pc;
+    unsigned long end;              // cycles into the pass when it finished
+    regs after;
+    int reads;
+    uint16_t read_addr[MAX_READS];
+    uint8_t read_val[MAX_READS];
+    int writes;
+    uint16_t write_addr[MAX_WRITES];
+    // From the taint analysis
+    bool replay;                    // depends on something that changes between passes
+    uint16_t taint_in;              // registers tainted before it
+    uint8_t read_taint;             // bit per read of a tainted location
+    // After the clock toggles at the end of the step, it next toggles at the
+    // end of step toggle_step, toggle_passes passes on
+    int toggle_step;
+    unsigned long toggle_passes;
+} step;
+
+typedef struct pass {
+    uint16_t head;
+    unsigned long start_cyc;
+    regs start;
+    int steps;
+    step step[MAX_STEPS];
+    int changes;                    // every location written
+    uint16_t addr[MAX_CHANGES];
+    uint8_t first[MAX_CHANGES];     // value before the pass
+    uint8_t last[MAX_CHANGES];      // value after
+    bool taint_end[MAX_CHANGES];
+    uint16_t regs_taint_end;
+    int replays;                    // the steps that run again
+    uint8_t replayed[MAX_STEPS];
+    bool clock_input;               // an instruction that is run again reads the clock
+    bool only_counts;               // ... or they are all INR M or DCR M
+    int inputs;                     // locations read before the pass writes them
+    uint16_t input_addr[MAX_INPUTS];
+    uint8_t input_val[MAX_INPUTS];
+    bool reads_clock;               // an IN from the clock port that isn't run again
+    uint8_t clock_val;              // ... and what it read
+    unsigned long period;
+    unsigned long used;             // when it was last repeated
+} pass;
+
+// The pass being recorded, and the passes kept for repeating. Any of them can
+// be repeated from its head while the registers and its inputs are the same,
+// so it doesn't matter what happened in between.
+static pass slots[MAX_MODELS + 1];
+static pass *current = &slots[0];
+static pass *models[MAX_MODELS];
+static int model_count;
+static unsigned long use_count;
+
+// Locations tainted at the current point of the analysis
+static uint16_t tainted[MAX_TAINTED];
+static int tainted_count;
+
+static int *clock_state = NULL;
+static unsigned long *clock_next = NULL;
+static unsigned long clock_period = 0;
+static uint8_t clock_port, clock_bit;
+
+// Where the toggles have been, to find where they start repeating
+static unsigned visit_stamp[MAX_STEPS], stamp;
+static unsigned long visit_toggles[MAX_STEPS], visit_at[MAX_STEPS];
+
+// Replay state
+static i8080 scratch;
+static const step *replay_step;
+static bool replay_ok;
+static const pass *model;           // the pass being repeated
+static uint8_t *replay_mem;
+static uint8_t (*real_rb)(void *, uint16_t);
+static void *real_userdata;
+static unsigned long replay_base;   // start of the first skipped pass
+static unsigned long replay_period;
+static uint16_t undo_addr[MAX_STEPS * MAX_WRITES];
+static uint8_t undo_val[MAX_STEPS * MAX_WRITES];
+static int undo_count;
+
+static unsigned long cycles_skipped = 0;
+static unsigned long passes_skipped = 0;
+
+void idle_init() {
+    memset(idle_map, 0, sizeof(idle_map));
+    idle_reset();
+    cycles_skipped = passes_skipped = 0;
+}
+
+void idle_load(const char *fname) {
+    FILE *f = fopen(fname, "r");
+    if (!f)
+        return;     // coverage_load has already complained
+
+    char line[256];
+    char type;
+    uint16_t head, end;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%c %04hx %04hx", &type, &head, &end) == 3 && type == 'i')
+            idle_map[head >> 3] |= 1 << (head & 7);
+    }
+    fclose(f);
+}
+
+void idle_reset() {
+    idle_tracking = false;
+    current = &slots[0];
+    model_count = 0;
+}
+
+void idle_clock(int *state, unsigned long *next, unsigned long period, uint8_t port, uint8_t bit) {
+    clock_state = state;
+    clock_next = next;
+    clock_period = period;
+    clock_port = port;
+    clock_bit = bit;
+}
+
+void idle_disturb() {
+    idle_tracking = false;
+}
+
+static void save_regs(const i8080 *c, regs *r) {
+    r->a = c->a; r->b = c->b; r->c = c->c; r->d = c->d; r->e = c->e; r->h = c->h; r->l = c->l;
+    r->sf = c->sf; r->zf = c->zf; r->hf = c->hf; r->pf = c->pf; r->cf = c->cf; r->iff = c->iff;
+    r->interrupt_delay = c->interrupt_delay;
+    r->sp = c->sp;
+}
+
+static void load_regs(i8080 *c, const regs *r) {
+    c->a = r->a; c->b = r->b; c->c = r->c; c->d = r->d; c->e = r->e; c->h = r->h; c->l = r->l;
+    c->sf = r->sf; c->zf = r->zf; c->hf = r->hf; c->pf = r->pf; c->cf = r->cf; c->iff = r->iff;
+    c->interrupt_delay = r->interrupt_delay;
+    c->sp = r->sp;
+}
+
+static bool same_regs(const regs *a, const regs *b) {
+    return a->a == b->a && a->b == b->b && a->c == b->c && a->d == b->d && a->e == b->e &&
+        a->h == b->h && a->l == b->l && a->sf == b->sf && a->zf == b->zf && a->hf == b->hf &&
+        a->pf == b->pf && a->cf == b->cf && a->iff == b->iff &&
+        a->interrupt_delay == b->interrupt_delay && a->sp == b->sp;
+}
+
+// Take the registers in mask from src
+static void merge_regs(regs *dst, const regs *src, uint16_t mask) {
+    if (mask & T_A) dst->a = src->a;
+    if (mask & T_B) dst->b = src->b;
+    if (mask & T_C) dst->c = src->c;
+    if (mask & T_D) dst->d = src->d;
+    if (mask & T_E) dst->e = src->e;
+    if (mask & T_H) dst->h = src->h;
+    if (mask & T_L) dst->l = src->l;
+    if (mask & T_SP) dst->sp = src->sp;
+    if (mask & T_FS) dst->sf = src->sf;
+    if (mask & T_FZ) dst->zf = src->zf;
+    if (mask & T_FH) dst->hf = src->hf;
+    if (mask & T_FP) dst->pf = src->pf;
+    if (mask & T_FC) dst->cf = src->cf;
+}
+
+void idle_read(uint16_t addr, uint8_t val) {
+    step *s = &current->step[current->steps];
+    if (s->reads == MAX_READS) {
+        idle_disturb();
+        return;
+    }
+    s->read_addr[s->reads] = addr;
+    s->read_val[s->reads] = val;
+    ++s->reads;
+}
+
+void idle_write(uint16_t addr, uint8_t oldval, uint8_t newval) {
+    step *s = &current->step[current->steps];
+    if (s->writes == MAX_WRITES) {
+        idle_disturb();
+        return;
+    }
+    s->write_addr[s->writes++] = addr;
+
+    for (int i = 0; i < current->changes; ++i) {
+        if (current->addr[i] == addr) {
+            current->last[i] = newval;
+            return;
+        }
+    }
+    if (current->changes == MAX_CHANGES) {
+        idle_disturb();
+        return;
+    }
+    current->addr[current->changes] = addr;
+    current->first[current->changes] = oldval;
+    current->last[current->changes] = newval;
+    ++current->changes;
+}
+
+void idle_step(const i8080 *c) {
+    step *s = &current->step[current->steps];
+    s->pc = c->inst_pc;
+    s->end = c->cyc - current->start_cyc;
+    save_regs(c, &s->after);
+    if (++current->steps == MAX_STEPS) {
+        idle_disturb();
+        return;
+    }
+    current->step[current->steps].reads = 0;
+    current->step[current->steps].writes = 0;
+}
+
+// What an instruction reads and writes, as taint bits
+typedef struct effects {
+    uint16_t in;        // registers and flags the result depends on
+    uint16_t out;       // registers and flags it sets
+    uint16_t addr;      // registers used as a memory address
+    uint16_t wsrc;      // registers whose values are written to memory
+    bool rmw;           // writes back a value computed from memory (INR M, DCR M)
+    bool input;         // IN
+    bool output;        // OUT
+    bool stop;          // HLT, which we don't follow
+} effects;
+
+static const uint16_t reg_bits[8] = { T_B, T_C, T_D, T_E, T_H, T_L, 0, T_A };
+static const uint16_t pair_bits[4] = { T_BC, T_DE, T_HL, T_SP };
+static const uint16_t cond_bits[4] = { T_FZ, T_FC, T_FP, T_FS };
+
+static void decode(uint8_t op, effects *e) {
+    int y = (op >> 3) & 7, z = op & 7, p = y >> 1;
+    memset(e, 0, sizeof(*e));
+
+    switch (op >> 6) {
+    case 0:
+        switch (z) {
+        case 1:
+            if (y & 1) {                                // DAD
+                e->in = T_HL | pair_bits[p];
+                e->out = T_HL | T_FC;
+            }
+            else                                        // LXI
+                e->out = pair_bits[p];
+            break;
+        case 2:
+            switch (y) {
+            case 0: e->in = e->wsrc = T_A; e->addr = T_BC; break;  // STAX B
+            case 1: e->out = T_A; e->addr = T_BC; break;            // LDAX B
+            case 2: e->in = e->wsrc = T_A; e->addr = T_DE; break;  // STAX D
+            case 3: e->out = T_A; e->addr = T_DE; break;            // LDAX D
+            case 4: e->in = e->wsrc = T_HL; break;                  // SHLD
+            case 5: e->out = T_HL; break;                           // LHLD
+            case 6: e->in = e->wsrc = T_A; break;                   // STA
+            case 7: e->out = T_A; break;                            // LDA
+            }
+            break;
+        case 3:                                         // INX, DCX
+            e->in = e->out = pair_bits[p];
+            break;
+        case 4:                                         // INR
+        case 5:                                         // DCR
+            if (y == 6) {
+                e->addr = T_HL;
+                e->rmw = true;
+            }
+            else
+                e->in = reg_bits[y];
+            e->out = reg_bits[y] | T_FS | T_FZ | T_FH | T_FP;
+            break;
+        case 6:                                         // MVI
+            if (y == 6)
+                e->addr = T_HL;
+            else
+                e->out = reg_bits[y];
+            break;
+        case 7:
+            switch (y) {
+            case 0: case 1: e->in = T_A; e->out = T_A | T_FC; break;           // RLC, RRC
+            case 2: case 3: e->in = e->out = T_A | T_FC; break;                 // RAL, RAR
+            case 4: e->in = T_A | T_FH | T_FC; e->out = T_A | T_FLAGS; break;  // DAA
+            case 5: e->in = e->out = T_A; break;                                // CMA
+            case 6: e->out = T_FC; break;                                       // STC
+            case 7: e->in = e->out = T_FC; break;                               // CMC
+            }
+            break;
+        }
+        break;
+    case 1:
+        if (op == 0x76) {                               // HLT
+            e->stop = true;
+            break;
+        }
+        if (z == 6)                                     // MOV
+            e->addr = T_HL;
+        else
+            e->in = reg_bits[z];
+        if (y == 6) {
+            e->addr = T_HL;
+            e->wsrc = reg_bits[z];
+        }
+        else
+            e->out = reg_bits[y];
+        break;
+    case 2:                                             // ADD ... CMP
+        if (z == 6)
+            e->addr = T_HL;
+        e->in = T_A | reg_bits[z] | (y == 1 || y == 3 ? T_FC : 0);
+        e->out = T_FLAGS | (y == 7 ? 0 : T_A);
+        break;
+    case 3:
+        switch (z) {
+        case 0:                                         // Rcc
+            e->in = cond_bits[p];
+            e->addr = T_SP;
+            break;
+        case 1:
+            if (y == 5)                                 // PCHL
+                e->in = T_HL;
+            else if (y == 7) {                          // SPHL
+                e->in = T_HL;
+                e->out = T_SP;
+            }
+            else if (y & 1)                             // RET
+                e->addr = T_SP;
+            else {                                      // POP
+                e->addr = T_SP;
+                e->out = p == 3 ? T_A | T_FLAGS : pair_bits[p];
+            }
+            break;
+        case 2:                                         // Jcc
+            e->in = cond_bits[p];
+            break;
+        case 3:
+            if (y == 2) {                               // OUT
+                e->in = T_A;
+                e->output = true;
+            }
+            else if (y == 3) {                          // IN
+                e->out = T_A;
+                e->input = true;
+            }
+            else if (y == 4) {                          // XTHL
+                e->in = e->out = e->wsrc = T_HL;
+                e->addr = T_SP;
+            }
+            else if (y == 5)                            // XCHG
+                e->in = e->out = T_DE | T_HL;
+            break;
+        case 4:                                         // Ccc
+            e->in = cond_bits[p];
+            e->addr = T_SP;
+            break;
+        case 5:
+            e->addr = T_SP;
+            if (!(y & 1))                               // PUSH (else CALL)
+                e->in = e->wsrc = p == 3 ? T_A | T_FLAGS : pair_bits[p];
+            break;
+        case 6:                                         // ADI ... CPI
+            e->in = T_A | (y == 1 || y == 3 ? T_FC : 0);
+            e->out = T_FLAGS | (y == 7 ? 0 : T_A);
+            break;
+        case 7:                                         // RST
+            e->addr = T_SP;
+            break;
+        }
+        break;
+    }
+}
+
+static bool is_tainted(uint16_t addr) {
+    for (int i = 0; i < tainted_count; ++i) {
+        if (tainted[i] == addr)
+            return true;
+    }
+    return false;
+}
+
+static bool set_taint(uint16_t addr, bool on) {
+    for (int i = 0; i < tainted_count; ++i) {
+        if (tainted[i] == addr) {
+            if (!on)
+                tainted[i] = tainted[--tainted_count];
+            return true;
+        }
+    }
+    if (!on)
+        return true;
+    if (tainted_count == MAX_TAINTED)
+        return false;
+    tainted[tainted_count++] = addr;
+    return true;
+}
+
+// Note what the pass reads that it hasn't written, other than the locations
+// that change from pass to pass, so it can be repeated later if they are the
+// same. Fails if there are too many.
+static bool find_inputs(const uint8_t *mem) {
+    uint16_t written[MAX_STEPS * MAX_WRITES];
+    int written_count = 0;
+    current->inputs = 0;
+    current->reads_clock = false;
+    for (int i = 0; i < current->steps; ++i) {
+        const step *s = &current->step[i];
+        for (int r = 0; r < s->reads; ++r) {
+            bool known = (s->read_taint & (1 << r)) != 0;
+            for (int w = 0; w < written_count && !known; ++w)
+                known = written[w] == s->read_addr[r];
+            for (int k = 0; k < current->inputs && !known; ++k)
+                known = current->input_addr[k] == s->read_addr[r];
+            if (known)
+                continue;
+            if (current->inputs == MAX_INPUTS)
+                return false;
+            current->input_addr[current->inputs] = s->read_addr[r];
+            current->input_val[current->inputs++] = s->read_val[r];
+        }
+        for (int w = 0; w < s->writes; ++w)
+            written[written_count++] = s->write_addr[w];
+        if (mem[s->pc] == 0xdb && !s->replay) {
+            current->reads_clock = true;
+            current->clock_val = s->after.a;
+        }
+    }
+    return true;
+}
+
+// Follow taint through the recorded pass, from the locations the pass changes
+// and from port input, marking the instructions that need running again.
+// Input from the clock port only taints the clock bit, so an IN followed by
+// an ANI that masks it out reads the same every pass. Fails if taint reaches
+// an address, the stack pointer, an output or a HLT.
+static bool analyse(const uint8_t *mem) {
+    uint16_t sources[MAX_TAINTED];
+    int source_count = 0;
+    for (int i = 0; i < current->changes && source_count < MAX_TAINTED; ++i) {
+        if (current->first[i] != current->last[i])
+            sources[source_count++] = current->addr[i];
+    }
+
+    // Whatever is tainted at the end of a pass is where the next one starts,
+    // so go round until that settles.
+    for (int round = 0; round < 4; ++round) {
+        uint16_t regs_taint = 0;
+        int clock_read = -1;        // the IN that A holds, if only the clock bit is tainted
+        memcpy(tainted, sources, source_count * sizeof(sources[0]));
+        tainted_count = source_count;
+
+        for (int i = 0; i < current->steps; ++i) {
+            step *s = &current->step[i];
+            effects e;
+            decode(mem[s->pc], &e);
+            if (e.stop || (e.addr & regs_taint) != 0)
+                return false;
+
+            if (clock_read >= 0 && ((e.in | e.wsrc) & T_A)) {
+                if (mem[s->pc] == 0xe6 && !(mem[s->pc + 1] & clock_bit)) {    // ANI
+                    s->read_taint = 0;
+                    s->taint_in = regs_taint;
+                    s->replay = false;
+                    regs_taint &= ~e.out;
+                    clock_read = -1;
+                    continue;
+                }
+                current->step[clock_read].replay = true;
+                clock_read = -1;
+            }
+            if (e.out & T_A)
+                clock_read = -1;
+            bool clock_in = e.input && clock_state && mem[s->pc + 1] == clock_port;
+
+            bool from_memory = false;
+            s->read_taint = 0;
+            for (int r = 0; r < s->reads; ++r) {
+                if (is_tainted(s->read_addr[r])) {
+                    s->read_taint |= 1 << r;
+                    from_memory = true;
+                }
+            }
+            s->taint_in = regs_taint;
+            s->replay = (e.in & regs_taint) != 0 || from_memory || (e.input && !clock_in);
+            if (s->replay && e.output)
+                return false;
+
+            bool write_taint = (e.wsrc & regs_taint) != 0 || (e.rmw && from_memory);
+            for (int w = 0; w < s->writes; ++w) {
+                if (!set_taint(s->write_addr[w], write_taint))
+                    return false;
+            }
+            if (s->replay)
+                regs_taint |= e.out;
+            else
+                regs_taint &= ~e.out;
+            if (clock_in) {
+                regs_taint |= T_A;
+                clock_read = i;
+            }
+        }
+        if (clock_read >= 0 && (regs_taint & T_A))
+            current->step[clock_read].replay = true;
+        if (regs_taint & T_SP)
+            return false;
+        current->regs_taint_end = regs_taint;
+
+        bool settled = true;
+        for (int i = 0; i < tainted_count; ++i) {
+            bool known = false;
+            for (int j = 0; j < source_count; ++j)
+                known = known || sources[j] == tainted[i];
+            if (!known) {
+                if (source_count == MAX_TAINTED)
+                    return false;
+                sources[source_count++] = tainted[i];
+                settled = false;
+            }
+        }
+        if (settled) {
+            for (int i = 0; i < current->changes; ++i)
+                current->taint_end[i] = is_tainted(current->addr[i]);
+            current->replays = 0;
+            current->clock_input = false;
+            current->only_counts = regs_taint == 0;
+            for (int i = 0; i < current->steps; ++i) {
+                uint8_t op = mem[current->step[i].pc];
+                if (!current->step[i].replay)
+                    continue;
+                current->replayed[current->replays++] = i;
+                current->clock_input = current->clock_input || op == 0xdb;
+                current->only_counts = current->only_counts && (op == 0x34 || op == 0x35);
+            }
+            return find_inputs(mem);
+        }
+    }
+    return false;
+}
+
+// Work out where the clock toggles in the passes, from each instruction
+// boundary it can toggle at
+static void clock_setup(pass *p) {
+    int k = 0;
+    unsigned long passes = 0;
+    for (int i = 0; i < p->steps; ++i) {
+        unsigned long next = p->step[i].end + clock_period;
+        // Later boundaries toggle later, so k only moves on
+        while (passes * p->period + p->step[k].end <= next) {
+            if (++k == p->steps) {
+                k = 0;
+                ++passes;
+            }
+        }
+        p->step[i].toggle_step = k;
+        p->step[i].toggle_passes = passes;
+    }
+}
+
+// Run the clock through the instruction boundaries up to cycle cyc, as the
+// run loop would have done after each instruction. Once the toggles come
+// round to a boundary they have toggled at before, they repeat, so whole
+// rounds of them are counted at once.
+static void clock_through(unsigned long cyc) {
+    if (!clock_state || *clock_next >= cyc)
+        return;
+
+    // The first boundary after clock_next
+    unsigned long into = *clock_next - replay_base;
+    unsigned long pass = into / replay_period, offset = into % replay_period;
+    int i = 0, hi = model->steps - 1;
+    while (i < hi) {
+        int mid = (i + hi) / 2;
+        if (model->step[mid].end <= offset)
+            i = mid + 1;
+        else
+            hi = mid;
+    }
+    unsigned long at = replay_base + pass * replay_period + model->step[i].end;
+
+    unsigned long toggles = 0, last = 0;
+    bool repeated = false;
+    ++stamp;
+    while (at <= cyc) {
+        ++toggles;
+        if (!repeated && visit_stamp[i] == stamp) {
+            unsigned long round = at - visit_at[i];
+            unsigned long rounds = (cyc - at) / round;
+            toggles += rounds * (toggles - visit_toggles[i]);
+            at += rounds * round;
+            repeated = true;
+        }
+        visit_stamp[i] = stamp;
+        visit_toggles[i] = toggles;
+        visit_at[i] = at;
+        last = at;
+
+        const step *s = &model->step[i];
+        at += s->toggle_passes * replay_period + model->step[s->toggle_step].end - s->end;
+        i = s->toggle_step;
+    }
+    if (toggles > 0) {
+        *clock_state ^= toggles & 1;
+        *clock_next = last + clock_period;
+    }
+}
+
+static uint8_t replay_rb(void *userdata UNUSED, uint16_t addr) {
+    if (addr < 0x2000)
+        return replay_mem[addr];        // ROM: the instruction itself
+    for (int r = 0; r < replay_step->reads; ++r) {
+        if (replay_step->read_addr[r] == addr) {
+            if (replay_step->read_taint & (1 << r))
+                return real_rb(real_userdata, addr);
+            return replay_step->read_val[r];
+        }
+    }
+    replay_ok = false;
+    return 0;
+}
+
+static void replay_wb(void *userdata UNUSED, uint16_t addr, uint8_t val) {
+    undo_addr[undo_count] = addr;
+    undo_val[undo_count++] = replay_mem[addr];
+    replay_mem[addr] = val;
+}
+
+static void replay_out(void *userdata UNUSED, uint8_t port UNUSED, uint8_t val UNUSED) {
+    replay_ok = false;
+}
+
+// Repeat the recorded pass from cycle start, running only the instructions
+// marked by analyse(). If anything goes differently, memory and the clock are
+// put back and the result is false. The clock is only run on here if one of
+// them reads it; otherwise the caller catches it up afterwards.
+static bool replay_pass(unsigned long start) {
+    int clock_was = clock_state ? *clock_state : 0;
+    unsigned long clock_next_was = clock_next ? *clock_next : 0;
+    regs live = model->start;
+    undo_count = 0;
+    replay_ok = true;
+
+    for (int k = 0; k < model->replays && replay_ok; ++k) {
+        int i = model->replayed[k];
+        const step *s = &model->step[i];
+        unsigned long from = start + (i > 0 ? model->step[i - 1].end : 0);
+        if (model->clock_input)
+            clock_through(from);
+
+        regs r = i > 0 ? model->step[i - 1].after : model->start;
+        merge_regs(&r, &live, s->taint_in);
+        load_regs(&scratch, &r);
+        scratch.pc = s->pc;
+        scratch.cyc = from;
+        replay_step = s;
+        i8080_step(&scratch);
+
+        uint16_t next_pc = i + 1 < model->steps ? model->step[i + 1].pc : model->head;
+        if (scratch.pc != next_pc || scratch.cyc != start + s->end)
+            replay_ok = false;
+        save_regs(&scratch, &live);
+    }
+
+    if (replay_ok) {
+        // The pass must leave the registers ready for the next one
+        regs end = model->step[model->steps - 1].after;
+        merge_regs(&end, &live, model->regs_taint_end);
+        replay_ok = same_regs(&end, &model->start);
+    }
+    if (!replay_ok) {
+        while (undo_count > 0) {
+            --undo_count;
+            replay_mem[undo_addr[undo_count]] = undo_val[undo_count];
+        }
+        if (clock_state) {
+            *clock_state = clock_was;
+            *clock_next = clock_next_was;
+        }
+        return false;
+    }
+    return true;
+}
+
+// Leave the locations that don't change from pass to pass as the pass leaves
+// them
+static void skip_constants() {
+    for (int i = 0; i < model->changes; ++i) {
+        if (!model->taint_end[i])
+            replay_mem[model->addr[i]] = model->last[i];
+    }
+}
+
+// Skip passes whose only instructions run again count locations up or down:
+// the counts move on by the same amount every pass.
+static void skip_counts(unsigned long passes) {
+    for (int i = 0; i < model->changes; ++i) {
+        if (model->taint_end[i])
+            replay_mem[model->addr[i]] += passes * (uint8_t)(model->last[i] - model->first[i]);
+    }
+}
+
+// Keep the pass just recorded, in place of the one least recently repeated
+static int keep_current() {
+    int i = 0;
+    pass *spare;
+    if (model_count < MAX_MODELS) {
+        // Until they are all in use, the slots are in order
+        i = model_count++;
+        spare = &slots[model_count];
+    }
+    else {
+        for (int k = 1; k < MAX_MODELS; ++k) {
+            if (models[k]->used < models[i]->used)
+                i = k;
+        }
+        spare = models[i];
+    }
+    models[i] = current;
+    current = spare;
+
+    pass *p = models[i];
+    p->period = p->step[p->steps - 1].end;
+    p->used = ++use_count;
+    if (clock_state)
+        clock_setup(p);
+    return i;
+}
+
+// A kept pass that can be repeated from here: it starts at the same place with
+// the same registers, fits before limit, and reads what it read before. The
+// most recently repeated are tried first.
+static int find_model(i8080 *c, const regs *now, unsigned long limit, unsigned tried) {
+    for (;;) {
+        int i = -1;
+        for (int k = 0; k < model_count; ++k) {
+            if (!(tried & (1u << k)) && (i < 0 || models[k]->used > models[i]->used))
+                i = k;
+        }
+        if (i < 0)
+            return -1;
+        tried |= 1u << i;
+
+        const pass *p = models[i];
+        if (p->head != c->pc || !same_regs(now, &p->start) || c->cyc + p->period > limit)
+            continue;
+        bool same = true;
+        for (int k = 0; k < p->inputs && same; ++k)
+            same = c->read_byte(c->userdata, p->input_addr[k]) == p->input_val[k];
+        if (same && p->reads_clock)
+            same = ((c->port_in(c->userdata, clock_port) ^ p->clock_val) & ~clock_bit) == 0;
+        if (same)
+            return i;
+    }
+}
+
+unsigned long idle_head(i8080 *c, uint8_t *mem, unsigned long limit) {
+    unsigned long skipped = 0;
+    regs now;
+    save_regs(c, &now);
+
+    if (limit > c->cyc) {
+        int i = -1;
+        if (idle_tracking && current->head == c->pc && current->steps > 0 &&
+            same_regs(&now, &current->start) && analyse(mem))
+            i = keep_current();
+        idle_tracking = false;
+        if (i < 0)
+            i = find_model(c, &now, limit, 0);
+
+        if (i >= 0) {
+            replay_mem = mem;
+            real_rb = c->read_byte;
+            real_userdata = c->userdata;
+            scratch = *c;
+            scratch.read_byte = replay_rb;
+            scratch.write_byte = replay_wb;
+            scratch.port_out = replay_out;
+            scratch.userdata = &scratch;
+            scratch.interrupt_pending = false;
+            scratch.halted = false;
+        }
+
+        // When one pass can't be repeated any more, another might take over
+        unsigned tried = 0;
+        while (i >= 0) {
+            models[i]->used = ++use_count;
+            model = models[i];
+            replay_base = c->cyc;
+            replay_period = model->period;
+
+            unsigned long passes = (limit - c->cyc) / replay_period, n = 0;
+            if (model->only_counts) {
+                skip_counts(passes);
+                n = passes;
+            }
+            else {
+                while (n < passes && replay_pass(c->cyc + n * replay_period))
+                    ++n;
+            }
+            if (n > 0)
+                skip_constants();
+            c->cyc += n * replay_period;
+            clock_through(c->cyc);
+            skipped += n * replay_period;
+            passes_skipped += n;
+
+            tried = (n > 0 ? 0 : tried) | 1u << i;
+            i = find_model(c, &now, limit, tried);
+        }
+        cycles_skipped += skipped;
+    }
+
+    current->head = c->pc;
+    current->start_cyc = c->cyc;
+    current->start = now;
+    current->steps = 0;
+    current->changes = 0;
+    current->step[0].reads = 0;
+    current->step[0].writes = 0;
+    idle_tracking = true;
+    return skipped;
+}
+
+unsigned long idle_cycles_skipped() {
+    return cycles_skipped;
+}
+
+unsigned long idle_passes_skipped() {
+    return passes_skipped;
+}
@@ -0,0 +1,79 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include "i8080.h"
+
+// Fast-forward through idle loops.
+//
+// The firmware spends most of its time going round idle_loop, or waiting in
+// wait_n_frames or wait_scroll, until an interrupt changes something. Loop
+// heads are annotated in vt100-coverage.txt as
+//   i <head> <head> description
+//
+// The run loop reports every instruction executed from a loop head, and while
+// a pass is being tracked, every instruction, memory access and register
+// state. A pass that gets back to its head with the registers it started
+// with, without I/O that has side effects, interrupts, hooks or watched
+// writes, becomes the model for the passes that follow.
+//
+// The passes aren't quite identical: each one counts num_kbd_updates and
+// cursor_timer down or up, and reads LBA7 from the flags buffer. Taint from
+// the locations the pass changes, and from port input, is followed through
+// the recorded instructions, so the only instructions that need executing
+// again are the few that depend on those. Every other instruction would do
+// exactly what it did before. Skipped passes run just those instructions,
+// check they take the recorded branches in the recorded cycles, and move the
+// cycle count on by the pass length. The first pass that would go another
+// way, or would end past the caller's next scheduled event, runs normally.
+//
+// When the only instructions left are INR M or DCR M, every pass up to the
+// caller's limit is skipped at once, by moving the counts on. The clock is
+// worked out from where its toggles start repeating, rather than toggle by
+// toggle.
+//
+// A few recorded passes are kept, along with what each read from memory that
+// it didn't write itself. When one can't be repeated any more (the cursor
+// timer sends it another way, or an interrupt has been and gone), another
+// that starts with the same registers and would read the same takes over,
+// without waiting for a fresh pass to be recorded.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+extern uint8_t idle_map[0x10000 / 8];
+extern bool idle_tracking;
+
+static inline bool idle_hit(uint16_t pc) {
+    return (idle_map[pc >> 3] & (1 << (pc & 7))) != 0;
+}
+
+void idle_init();
+// Read the "i" lines of a coverage annotation file
+void idle_load(const char *fname);
+// Forget the pass in progress, e.g. after the machine has been rewound
+void idle_reset();
+
+// A clock that toggles state at the first instruction boundary at least
+// period cycles after it last toggled (LBA7), kept going through skipped
+// passes. next is the cycle after which it next toggles. It reads as bit of
+// port, whose other bits must not change while passes are skipped.
+void idle_clock(int *state, unsigned long *next, unsigned long period, uint8_t port, uint8_t bit);
+
+// The pass in progress can't be repeated: I/O with side effects, an
+// interrupt, a watched write or a hook.
+void idle_disturb();
+// Called for each memory access while idle_tracking
+void idle_read(uint16_t addr, uint8_t val);
+void idle_write(uint16_t addr, uint8_t oldval, uint8_t newval);
+// Called after each instruction while idle_tracking
+void idle_step(const i8080 *c);
+
+// Called just before executing the instruction at a loop head. Skips as many
+// passes as will end no later than cycle limit, updating memory through mem,
+// and returns the number of cycles skipped.
+unsigned long idle_head(i8080 *c, uint8_t *mem, unsigned long limit);
+
+unsigned long idle_cycles_skipped();
+unsigned long idle_passes_skipped();
+
+#endif
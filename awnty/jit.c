@@ -0,0 +1,1034 @@
+#include "jit.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unused.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_X64
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+#define MAX_INSNS 32            // instructions in a block
+#define MAX_INSN_CODE 256       // bytes of native code for one instruction
+#define CODE_SIZE (4 << 20)     // code buffer, flushed when full
+#define HEADER 4096             // flag table and exit flag, away from the code
+#define MAX_STOP_BYTES 13       // map bytes that a block's instructions span
+
+typedef void (*block_fn)(i8080 *c);
+
+typedef struct block {
+    block_fn code;              // NULL until translated
+    uint16_t cut;               // instruction not yet decoded that ended the block, or 0
+    uint16_t inner_cycles;      // all the instructions but the last
+    uint16_t stop_first;        // map byte of the second instruction
+    uint8_t stop_count;
+    uint8_t stop_mask[MAX_STOP_BYTES]; // instructions after the first
+} block;
+
+// For stopping a block part way, kept apart from what every run needs
+typedef struct block_detail {
+    uint8_t count;
+    uint16_t addr[MAX_INSNS];
+    uint16_t done[MAX_INSNS];   // cycles to the end of each instruction
+} block_detail;
+
+uint16_t jit_rom_end = 0;
+
+static block *blocks;
+static block_detail *details;
+static uint8_t *buffer;         // the header, then code
+static uint8_t *code_end;       // where the next block goes
+// The block stops after the instruction with this index, or any after it
+static volatile uint8_t *exit_at;
+
+#define MAX_STOP_MAPS 4
+static const uint8_t *stop_maps[MAX_STOP_MAPS];
+static int stop_map_count = 0;
+static bool (*stop_when)(void) = NULL;
+
+static unsigned long blocks_translated, blocks_run, cycles_run, flushes;
+
+void jit_flush() {
+    if (!blocks)
+        return;
+    memset(blocks, 0, jit_rom_end * sizeof(block));
+    code_end = buffer + HEADER;
+    *exit_at = 0;
+    ++flushes;
+}
+
+void jit_stop_at(const uint8_t *map) {
+    if (stop_map_count < MAX_STOP_MAPS)
+        stop_maps[stop_map_count++] = map;
+}
+
+void jit_stop_when(bool (*stop)(void)) {
+    stop_when = stop;
+}
+
+void jit_report(unsigned long total_cycles) {
+    if (!blocks)
+        return;
+    printf("JIT: translated %lu blocks, ran %lu, %lu cycles (%.1f%%), flushed %lu times\n",
+        blocks_translated, blocks_run, cycles_run,
+        total_cycles ? 100.0 * cycles_run / total_cycles : 0.0, flushes);
+}
+
+#ifdef JIT_X64
+
+// Where the flags are: the bit fields in i8080, and the 8080's flags byte
+// (as PUSH PSW has it), which is also the low byte of x86 EFLAGS
+#define PSW_S 0x80
+#define PSW_Z 0x40
+#define PSW_H 0x10
+#define PSW_P 0x04
+#define PSW_C 0x01
+#define PSW_ALL (PSW_S | PSW_Z | PSW_H | PSW_P | PSW_C)
+
+static int flags_offset;
+static uint8_t sf_bit, zf_bit, hf_bit, pf_bit, cf_bit, iff_bit;
+
+// The header: bit fields for each flags byte, then exit_at
+static uint8_t *flag_table;
+
+// The byte and bit that a flag set in an otherwise zeroed i8080 occupies,
+// which must be the same byte for every flag
+static bool find_flag(const i8080 *x, uint8_t *bit) {
+    const uint8_t *bytes = (const uint8_t *)x;
+    for (size_t i = 0; i < sizeof(*x); ++i) {
+        if (bytes[i] != 0) {
+            if (flags_offset >= 0 && flags_offset != (int)i)
+                return false;
+            flags_offset = i;
+            *bit = bytes[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+#define FIND_FLAG(field, bit)            \
+    do {                                 \
+        i8080 x;                         \
+        memset(&x, 0, sizeof(x));        \
+        x.field = 1;                     \
+        if (!find_flag(&x, &bit))        \
+            return false;                \
+    } while (0)
+
+static bool find_flags() {
+    flags_offset = -1;
+    FIND_FLAG(sf, sf_bit);
+    FIND_FLAG(zf, zf_bit);
+    FIND_FLAG(hf, hf_bit);
+    FIND_FLAG(pf, pf_bit);
+    FIND_FLAG(cf, cf_bit);
+    FIND_FLAG(iff, iff_bit);
+    return true;
+}
+
+static uint8_t flag_bits(uint8_t psw) {
+    return (psw & PSW_S ? sf_bit : 0) | (psw & PSW_Z ? zf_bit : 0) | (psw & PSW_H ? hf_bit : 0) |
+           (psw & PSW_P ? pf_bit : 0) | (psw & PSW_C ? cf_bit : 0);
+}
+
+static int bit_index(uint8_t bit) {
+    int i = 0;
+    while (bit > 1) {
+        bit >>= 1;
+        ++i;
+    }
+    return i;
+}
+
+// Helpers that translated code calls, with the checks the run loop makes
+// after each instruction
+
+static void check_stop() {
+    if (stop_when && stop_when())
+        *exit_at = 0;
+}
+
+static void jit_write(i8080 *c, uint16_t addr, uint8_t val) {
+    i8080_write(c, addr, val);
+    check_stop();
+}
+
+static void jit_write_word(i8080 *c, uint16_t addr, uint16_t val) {
+    i8080_write_word(c, addr, val);
+    check_stop();
+}
+
+static void jit_in(i8080 *c, uint8_t port) {
+    c->a = c->port_in(c->userdata, port);
+    check_stop();
+}
+
+static void jit_out(i8080 *c, uint8_t port) {
+    c->port_out(c->userdata, port, c->a);
+    check_stop();
+}
+
+static void jit_interpret(i8080 *c) {
+    i8080_step(c);
+    check_stop();
+}
+
+// x86-64 code generation. The block's i8080 is in rbx throughout; eax, ecx,
+// edx and r8d are scratch. Helpers are called with their second and third
+// arguments in eax and edx.
+
+#define EAX 0
+#define ECX 1
+#define EDX 2
+
+static uint8_t *p;
+
+static void emit(int byte) {
+    *p++ = byte;
+}
+
+static void emit16(uint16_t v) {
+    memcpy(p, &v, 2);
+    p += 2;
+}
+
+static void emit32(uint32_t v) {
+    memcpy(p, &v, 4);
+    p += 4;
+}
+
+static void emit64(uint64_t v) {
+    memcpy(p, &v, 8);
+    p += 8;
+}
+
+// ModRM for [rbx + disp]
+static void mem(int reg, int disp) {
+    if (disp < 128) {
+        emit(0x43 | reg << 3);
+        emit(disp);
+    }
+    else {
+        emit(0x83 | reg << 3);
+        emit32(disp);
+    }
+}
+
+// disp32 from the end of an instruction, tail bytes after this field
+static void rip(const void *target, int tail) {
+    emit32((uint32_t)((const uint8_t *)target - (p + 4 + tail)));
+}
+
+#define OFF(field) ((int)offsetof(i8080, field))
+
+static void load8(int reg, int off) {           // mov r8, [rbx+off]
+    emit(0x8a);
+    mem(reg, off);
+}
+
+static void store8(int off, int reg) {          // mov [rbx+off], r8
+    emit(0x88);
+    mem(reg, off);
+}
+
+static void load8z(int reg, int off) {          // movzx r32, byte [rbx+off]
+    emit(0x0f);
+    emit(0xb6);
+    mem(reg, off);
+}
+
+static void load16z(int reg, int off) {         // movzx r32, word [rbx+off]
+    emit(0x0f);
+    emit(0xb7);
+    mem(reg, off);
+}
+
+static void store16(int off, int reg) {         // mov [rbx+off], r16
+    emit(0x66);
+    emit(0x89);
+    mem(reg, off);
+}
+
+static void store8_imm(int off, uint8_t v) {    // mov byte [rbx+off], imm8
+    emit(0xc6);
+    mem(0, off);
+    emit(v);
+}
+
+static void store16_imm(int off, uint16_t v) {  // mov word [rbx+off], imm16
+    emit(0x66);
+    emit(0xc7);
+    mem(0, off);
+    emit16(v);
+}
+
+static void add16_imm(int off, int v) {         // add/sub word [rbx+off], imm8
+    emit(0x66);
+    emit(0x83);
+    mem(v < 0 ? 5 : 0, off);
+    emit(v < 0 ? -v : v);
+}
+
+static void swap16(int reg) {                   // rol r16, 8
+    emit(0x66);
+    emit(0xc1);
+    emit(0xc0 | reg);
+    emit(8);
+}
+
+static void mov_imm(int reg, uint32_t v) {      // mov r32, imm32
+    emit(0xb8 | reg);
+    emit32(v);
+}
+
+// A register pair, high register first in memory, as a value in reg
+static void load_pair(int reg, int off) {
+    load16z(reg, off);
+    if (off != OFF(sp))
+        swap16(reg);
+}
+
+static void store_pair(int off, int reg) {
+    if (off != OFF(sp))
+        swap16(reg);
+    store16(off, reg);
+}
+
+static void epilogue() {
+    emit(0x48); emit(0x83); emit(0xc4); emit(0x20);    // add rsp, 32
+    emit(0x5b);                                         // pop rbx
+    emit(0xc3);                                         // ret
+}
+
+static void call(uintptr_t fn) {
+#ifdef _WIN32
+    emit(0x41); emit(0x89); emit(0xd0);                 // mov r8d, edx
+    emit(0x89); emit(0xc2);                             // mov edx, eax
+    emit(0x48); emit(0x89); emit(0xd9);                 // mov rcx, rbx
+#else
+    emit(0x89); emit(0xc6);                             // mov esi, eax
+    emit(0x48); emit(0x89); emit(0xdf);                 // mov rdi, rbx
+#endif
+    emit(0x48); emit(0xb8); emit64(fn);                 // mov rax, fn
+    emit(0xff); emit(0xd0);                             // call rax
+}
+
+// 8080 flags from EFLAGS in edx, adjusted by the caller, into the bit fields
+static void store_flags(uint8_t psw) {
+    emit(0x81); emit(0xe2); emit32(psw);                // and edx, psw
+    emit(0x48); emit(0x8d); emit(0x0d);                 // lea rcx, [rip+flag_table]
+    rip(flag_table, 0);
+    emit(0x0f); emit(0xb6); emit(0x14); emit(0x11);     // movzx edx, byte [rcx+rdx]
+    emit(0x80);                                         // and byte [flags], ~bits
+    mem(4, flags_offset);
+    emit((uint8_t)~flag_bits(psw));
+    emit(0x08);                                         // or [flags], dl
+    mem(EDX, flags_offset);
+}
+
+static void save_flags() {
+    emit(0x9c);                                         // pushfq
+    emit(0x5a);                                         // pop rdx
+}
+
+static void invert_half_carry() {
+    emit(0x83); emit(0xf2); emit(PSW_H);                // xor edx, 0x10
+}
+
+static void load_carry() {
+    load8z(EDX, flags_offset);
+    emit(0x0f); emit(0xba); emit(0xe2);                 // bt edx, cf
+    emit(bit_index(cf_bit));
+}
+
+// A block being translated
+static uint16_t pc_known, inst_pc_known; // what the i8080 has so far
+static int pending;                      // cycles not yet added to cyc
+
+static void flush_cycles() {
+    if (pending == 0)
+        return;
+    emit(0x48);
+    emit(pending < 128 ? 0x83 : 0x81);                  // add qword [cyc], pending
+    mem(0, OFF(cyc));
+    if (pending < 128)
+        emit(pending);
+    else
+        emit32(pending);
+    pending = 0;
+}
+
+static void set_pc(uint16_t pc) {
+    if (pc_known != pc)
+        store16_imm(OFF(pc), pc);
+    pc_known = pc;
+}
+
+static void set_inst_pc(uint16_t inst) {
+    if (inst_pc_known != inst)
+        store16_imm(OFF(inst_pc), inst);
+    inst_pc_known = inst;
+}
+
+// The machine as the interpreter has it while executing the instruction at
+// inst, before a helper sees it
+static void sync(uint16_t inst, uint16_t next) {
+    flush_cycles();
+    set_pc(next);
+    set_inst_pc(inst);
+}
+
+// Points the rel32 at rel to here
+static void patch(uint8_t *rel) {
+    uint32_t v = (uint32_t)(p - (rel + 4));
+    memcpy(rel, &v, 4);
+}
+
+// Ways out of a block between its instructions, emitted after the block's
+// last: the machine as it stands after an instruction
+typedef struct side_exit {
+    uint8_t *rel;
+    int pending;
+    uint16_t pc, inst_pc;
+    bool pc_known, inst_pc_known;
+} side_exit;
+
+static side_exit side_exits[MAX_INSNS];
+static int side_exit_count;
+
+// Leaves the block after instruction index, at inst, if exit_at says so
+static void exit_check(int index, uint16_t inst, uint16_t next) {
+    side_exit *x = &side_exits[side_exit_count++];
+    emit(0x80); emit(0x3d);                             // cmp byte [rip+exit_at], index
+    rip((const void *)exit_at, 1);
+    emit(index);
+    emit(0x0f); emit(0x86);                             // jbe rel32
+    x->rel = p;
+    emit32(0);
+    x->pending = pending;
+    x->pc = next;
+    x->inst_pc = inst;
+    x->pc_known = pc_known == next;
+    x->inst_pc_known = inst_pc_known == inst;
+}
+
+static void side_exit_code(const side_exit *x) {
+    patch(x->rel);
+    pending = x->pending;
+    flush_cycles();
+    if (!x->pc_known)
+        store16_imm(OFF(pc), x->pc);
+    if (!x->inst_pc_known)
+        store16_imm(OFF(inst_pc), x->inst_pc);
+    epilogue();
+}
+
+// Records a conditional instruction's direction in the branch maps, if any
+static void record_branch(uint16_t inst, bool taken) {
+    emit(0x48); emit(0x8b);                             // mov rax, [taken]
+    mem(EAX, taken ? OFF(taken) : OFF(not_taken));
+    emit(0x48); emit(0x85); emit(0xc0);                 // test rax, rax
+    emit(0x74); emit(9);                                // jz over the bts
+    emit(0x48); emit(0x0f); emit(0xba); emit(0xa8);     // bts qword [rax+disp32], bit
+    emit32((inst >> 6) * 8);
+    emit(inst & 63);
+}
+
+// Tests the condition of a conditional jump, call or return, and jumps to the
+// returned rel32 (to be patched) if it doesn't hold
+static uint8_t *condition_fails(uint8_t op) {
+    int cc = (op >> 3) & 7;
+    uint8_t bits[4] = { zf_bit, cf_bit, pf_bit, sf_bit };
+    emit(0xf6);                                         // test byte [flags], bit
+    mem(0, flags_offset);
+    emit(bits[cc >> 1]);
+    emit(0x0f);
+    emit(cc & 1 ? 0x84 : 0x85);                         // jz/jnz rel32
+    uint8_t *rel = p;
+    emit32(0);
+    return rel;
+}
+
+// Offsets of the 8080 registers by their number in opcodes; M is memory
+static int reg_off(int r) {
+    switch (r) {
+    case 0: return OFF(b);
+    case 1: return OFF(c);
+    case 2: return OFF(d);
+    case 3: return OFF(e);
+    case 4: return OFF(h);
+    case 5: return OFF(l);
+    case 7: return OFF(a);
+    }
+    return -1;
+}
+
+// Register pairs by their number in opcodes
+static int pair_off(int rp) {
+    switch (rp) {
+    case 0: return OFF(b);
+    case 1: return OFF(d);
+    case 2: return OFF(h);
+    }
+    return OFF(sp);
+}
+
+static void push(uint16_t inst, uint16_t next) {
+    sync(inst, next);
+    add16_imm(OFF(sp), -2);
+    load16z(EAX, OFF(sp));
+    call((uintptr_t)jit_write_word);
+}
+
+static void pop() {
+    load16z(EAX, OFF(sp));
+    call((uintptr_t)i8080_read_word);
+    add16_imm(OFF(sp), 2);
+}
+
+// Memory at HL into al
+static void read_m(uint16_t inst, uint16_t next) {
+    sync(inst, next);
+    load_pair(EAX, OFF(h));
+    call((uintptr_t)i8080_read);
+}
+
+// ADD, ADC, SUB, SBB, ANA, XRA, ORA, CMP of cl into A
+static void alu(int kind) {
+    load8(EAX, OFF(a));
+    switch (kind) {
+    case 0: emit(0x00); break;                          // add al, cl
+    case 1: load_carry(); emit(0x10); break;            // adc al, cl
+    case 2: emit(0x28); break;                          // sub al, cl
+    case 3: load_carry(); emit(0x18); break;            // sbb al, cl
+    case 4:
+        // the half carry is bit 3 of either operand
+        emit(0x41); emit(0x89); emit(0xc0);             // mov r8d, eax
+        emit(0x41); emit(0x09); emit(0xc8);             // or r8d, ecx
+        emit(0x41); emit(0x83); emit(0xe0); emit(0x08); // and r8d, 8
+        emit(0x41); emit(0xd1); emit(0xe0);             // shl r8d, 1
+        emit(0x20);                                     // and al, cl
+        break;
+    case 5: emit(0x30); break;                          // xor al, cl
+    case 6: emit(0x08); break;                          // or al, cl
+    case 7: emit(0x38); break;                          // cmp al, cl
+    }
+    emit(0xc8);
+    if (kind != 7)
+        store8(OFF(a), EAX);
+    save_flags();
+    if (kind == 2 || kind == 3 || kind == 7)
+        invert_half_carry();
+    else if (kind >= 4) {
+        emit(0x83); emit(0xe2); emit(PSW_ALL & ~PSW_H); // and edx, ~H
+        if (kind == 4) {
+            emit(0x44); emit(0x09); emit(0xc2);         // or edx, r8d
+        }
+    }
+    store_flags(PSW_ALL);
+}
+
+// INR or DCR of al
+static void inr_dcr(bool dcr) {
+    emit(0xfe);
+    emit(dcr ? 0xc8 : 0xc0);                            // dec al / inc al
+}
+
+static bool terminates(uint8_t op) {
+    switch (op) {
+    case 0xc3: case 0xcb: case 0xc9: case 0xd9: case 0xe9:
+    case 0xcd: case 0xdd: case 0xed: case 0xfd:
+    case 0xfb: case 0x76:
+        return true;
+    }
+    return (op & 0xc7) == 0xc0 || (op & 0xc7) == 0xc2 || (op & 0xc7) == 0xc4 || (op & 0xc7) == 0xc7;
+}
+
+// Left to the interpreter: rare, or changing how the CPU runs
+static bool interpreted(uint8_t op) {
+    switch (op) {
+    case 0x27: case 0xe3: case 0xf5: case 0xf1:         // DAA, XTHL, PUSH/POP PSW
+    case 0xfb: case 0x76:                               // EI, HLT
+        return true;
+    }
+    return false;
+}
+
+// Translates one instruction, with the exit if it ends the block
+static void translate_insn(const i8080_decoded *d, uint16_t inst) {
+    uint8_t op = d->opcode;
+    uint16_t next = inst + d->len;
+    uint16_t v = d->operand;
+
+    if (interpreted(op)) {
+        flush_cycles();
+        set_pc(inst);
+        call((uintptr_t)jit_interpret);
+        pc_known = next;
+        inst_pc_known = inst;
+        return;
+    }
+    pending += i8080_opcode_cycles(op);
+
+    if (op >= 0x40 && op < 0x80) { // MOV
+        int dst = reg_off((op >> 3) & 7), src = reg_off(op & 7);
+        if (src < 0) {
+            read_m(inst, next);
+            store8(dst, EAX);
+        }
+        else if (dst < 0) {
+            sync(inst, next);
+            load8z(EDX, src);
+            load_pair(EAX, OFF(h));
+            call((uintptr_t)jit_write);
+        }
+        else if (dst != src) {
+            load8(EAX, src);
+            store8(dst, EAX);
+        }
+        return;
+    }
+    if (op >= 0x80 && op < 0xc0) { // ALU on a register or memory
+        int src = reg_off(op & 7);
+        if (src < 0) {
+            read_m(inst, next);
+            emit(0x88); emit(0xc1);                     // mov cl, al
+        }
+        else
+            load8(ECX, src);
+        alu((op >> 3) & 7);
+        return;
+    }
+    if (op >= 0xc0 && (op & 7) == 6) { // ALU on an immediate
+        emit(0xb1);                                     // mov cl, imm8
+        emit(v);
+        alu((op >> 3) & 7);
+        return;
+    }
+    if (op < 0x40 && (op & 7) >= 4 && (op & 7) <= 6) { // INR, DCR, MVI
+        int r = reg_off((op >> 3) & 7);
+        if ((op & 7) == 6) {
+            if (r >= 0)
+                store8_imm(r, v);
+            else {
+                sync(inst, next);
+                mov_imm(EDX, v & 0xff);
+                load_pair(EAX, OFF(h));
+                call((uintptr_t)jit_write);
+            }
+            return;
+        }
+        bool dcr = (op & 7) == 5;
+        if (r >= 0) {
+            load8(EAX, r);
+            inr_dcr(dcr);
+            store8(r, EAX);
+        }
+        else {
+            read_m(inst, next);
+            inr_dcr(dcr);
+        }
+        save_flags();
+        if (dcr)
+            invert_half_carry();
+        store_flags(PSW_ALL & ~PSW_C);
+        if (r < 0) {
+            emit(0x0f); emit(0xb6); emit(0xd0);         // movzx edx, al
+            load_pair(EAX, OFF(h));
+            call((uintptr_t)jit_write);
+        }
+        return;
+    }
+    if (op < 0x40) {
+        int rp = pair_off(op >> 4);
+        switch (op & 0x0f) {
+        case 0x01: // LXI
+            store16_imm(rp, rp == OFF(sp) ? v : (uint16_t)(v << 8 | v >> 8));
+            return;
+        case 0x03: // INX
+        case 0x0b: // DCX
+            if (rp == OFF(sp))
+                add16_imm(rp, op & 8 ? -1 : 1);
+            else {
+                load_pair(EAX, rp);
+                emit(0x66); emit(0x83); emit(op & 8 ? 0xe8 : 0xc0); emit(1); // add/sub ax, 1
+                store_pair(rp, EAX);
+            }
+            return;
+        case 0x09: // DAD
+            load_pair(EAX, OFF(h));
+            if (rp == OFF(h)) {
+                emit(0x66); emit(0x01); emit(0xc0);     // add ax, ax
+            }
+            else {
+                load_pair(ECX, rp);
+                emit(0x66); emit(0x01); emit(0xc8);     // add ax, cx
+            }
+            save_flags();
+            store_pair(OFF(h), EAX);
+            store_flags(PSW_C);
+            return;
+        }
+        switch (op) {
+        case 0x02: // STAX
+        case 0x12:
+        case 0x32: // STA
+            sync(inst, next);
+            load8z(EDX, OFF(a));
+            if (op == 0x32)
+                mov_imm(EAX, v);
+            else
+                load_pair(EAX, rp);
+            call((uintptr_t)jit_write);
+            return;
+        case 0x0a: // LDAX
+        case 0x1a:
+        case 0x3a: // LDA
+            sync(inst, next);
+            if (op == 0x3a)
+                mov_imm(EAX, v);
+            else
+                load_pair(EAX, pair_off(op >> 4));
+            call((uintptr_t)i8080_read);
+            store8(OFF(a), EAX);
+            return;
+        case 0x22: // SHLD
+            sync(inst, next);
+            load_pair(EDX, OFF(h));
+            mov_imm(EAX, v);
+            call((uintptr_t)jit_write_word);
+            return;
+        case 0x2a: // LHLD
+            sync(inst, next);
+            mov_imm(EAX, v);
+            call((uintptr_t)i8080_read_word);
+            store_pair(OFF(h), EAX);
+            return;
+        case 0x07: // RLC
+        case 0x0f: // RRC
+        case 0x17: // RAL
+        case 0x1f: // RAR
+            load8(EAX, OFF(a));
+            if (op == 0x17 || op == 0x1f)
+                load_carry();
+            emit(0xd0);
+            emit(op == 0x07 ? 0xc0 : op == 0x0f ? 0xc8 : op == 0x17 ? 0xd0 : 0xd8); // rol/ror/rcl/rcr al, 1
+            store8(OFF(a), EAX);
+            save_flags();
+            store_flags(PSW_C);
+            return;
+        case 0x2f: // CMA
+            emit(0xf6);
+            mem(2, OFF(a));
+            return;
+        case 0x37: // STC
+            emit(0x80);
+            mem(1, flags_offset);
+            emit(cf_bit);
+            return;
+        case 0x3f: // CMC
+            emit(0x80);
+            mem(6, flags_offset);
+            emit(cf_bit);
+            return;
+        }
+        return; // NOP, and the undocumented ones
+    }
+
+    switch (op) {
+    case 0xdb: // IN
+    case 0xd3: // OUT
+        sync(inst, next);
+        mov_imm(EAX, v);
+        call(op == 0xdb ? (uintptr_t)jit_in : (uintptr_t)jit_out);
+        return;
+    case 0xf3: // DI
+        emit(0x80);
+        mem(4, flags_offset);
+        emit((uint8_t)~iff_bit);
+        return;
+    case 0xeb: // XCHG
+        load16z(EAX, OFF(d));
+        load16z(ECX, OFF(h));
+        store16(OFF(h), EAX);
+        store16(OFF(d), ECX);
+        return;
+    case 0xf9: // SPHL
+        load_pair(EAX, OFF(h));
+        store16(OFF(sp), EAX);
+        return;
+    case 0xc5: // PUSH
+    case 0xd5:
+    case 0xe5:
+        load_pair(EDX, pair_off((op >> 4) & 3));
+        push(inst, next);
+        return;
+    case 0xc1: // POP
+    case 0xd1:
+    case 0xe1:
+        sync(inst, next);
+        pop();
+        store_pair(pair_off((op >> 4) & 3), EAX);
+        return;
+    }
+
+    // The rest end the block
+    flush_cycles();
+    set_inst_pc(inst);
+    switch (op) {
+    case 0xc3: // JMP
+    case 0xcb:
+        store16_imm(OFF(pc), v);
+        epilogue();
+        return;
+    case 0xe9: // PCHL
+        load_pair(EAX, OFF(h));
+        store16(OFF(pc), EAX);
+        epilogue();
+        return;
+    case 0xc9: // RET
+    case 0xd9:
+        set_pc(next);
+        pop();
+        store16(OFF(pc), EAX);
+        epilogue();
+        return;
+    case 0xcd: // CALL
+    case 0xdd:
+    case 0xed:
+    case 0xfd:
+        mov_imm(EDX, next);
+        push(inst, next);
+        store16_imm(OFF(pc), v);
+        epilogue();
+        return;
+    }
+    if ((op & 7) == 7) { // RST
+        mov_imm(EDX, next);
+        push(inst, next);
+        store16_imm(OFF(pc), op & 0x38);
+        epilogue();
+        return;
+    }
+
+    // Conditional jumps, calls and returns
+    uint8_t *fails = condition_fails(op);
+    record_branch(inst, true);
+    switch (op & 7) {
+    case 0: // Rcc
+        set_pc(next);
+        pop();
+        store16(OFF(pc), EAX);
+        pending = 6;
+        flush_cycles();
+        break;
+    case 2: // Jcc
+        store16_imm(OFF(pc), v);
+        break;
+    case 4: // Ccc
+        mov_imm(EDX, next);
+        push(inst, next);
+        store16_imm(OFF(pc), v);
+        pending = 6;
+        flush_cycles();
+        break;
+    }
+    epilogue();
+    patch(fails);
+    record_branch(inst, false);
+    // pc_known is as it was before the condition, on this path
+    store16_imm(OFF(pc), next);
+    epilogue();
+}
+
+// Translates the block at start. Returns false if the code buffer is full.
+static bool translate(const i8080 *c, uint16_t start) {
+    block *b = &blocks[start];
+    uint16_t insts[MAX_INSNS];
+    int n = 0;
+    uint16_t addr = start;
+
+    memset(b, 0, sizeof(*b));
+    while (n < MAX_INSNS && addr < jit_rom_end) {
+        const i8080_decoded *d = &c->decoded[addr];
+        if (d->len == 0) {
+            b->cut = addr;
+            break;
+        }
+        insts[n++] = addr;
+        addr += d->len;
+        if (terminates(d->opcode))
+            break;
+    }
+    if (buffer + CODE_SIZE - code_end < n * MAX_INSN_CODE + 64)
+        return false;
+
+    block_detail *bd = &details[start];
+    bd->count = n;
+    for (int i = 0; i < n; ++i) {
+        bd->addr[i] = insts[i];
+        bd->done[i] = (i > 0 ? bd->done[i - 1] : 0) + i8080_opcode_cycles(c->decoded[insts[i]].opcode);
+    }
+    b->inner_cycles = n > 1 ? bd->done[n - 2] : 0;
+    if (n > 1) {
+        b->stop_first = insts[1] >> 3;
+        for (int i = 1; i < n; ++i)
+            b->stop_mask[(insts[i] >> 3) - b->stop_first] |= 1 << (insts[i] & 7);
+        b->stop_count = (insts[n - 1] >> 3) - b->stop_first + 1;
+    }
+
+    p = code_end;
+    emit(0x53);                                         // push rbx
+    emit(0x48); emit(0x83); emit(0xec); emit(0x20);    // sub rsp, 32
+#ifdef _WIN32
+    emit(0x48); emit(0x89); emit(0xcb);                 // mov rbx, rcx
+#else
+    emit(0x48); emit(0x89); emit(0xfb);                 // mov rbx, rdi
+#endif
+    pc_known = start;
+    inst_pc_known = 0xffff; // not an instruction address in the ROM
+    pending = 0;
+    side_exit_count = 0;
+    for (int i = 0; i < n; ++i) {
+        const i8080_decoded *d = &c->decoded[insts[i]];
+        translate_insn(d, insts[i]);
+        if (i + 1 < n)
+            exit_check(i, insts[i], insts[i] + d->len);
+    }
+    const i8080_decoded *d = &c->decoded[insts[n - 1]];
+    if (!terminates(d->opcode) || interpreted(d->opcode)) {
+        flush_cycles();
+        set_pc(addr);
+        set_inst_pc(insts[n - 1]);
+        epilogue();
+    }
+    for (int i = 0; i < side_exit_count; ++i)
+        side_exit_code(&side_exits[i]);
+
+    b->code = (block_fn)code_end;
+    code_end = p;
+    ++blocks_translated;
+    return true;
+}
+
+bool jit_init(const i8080 *c) {
+    jit_free();
+    if (!c->decoded || !find_flags())
+        return false;
+#ifdef _WIN32
+    buffer = VirtualAlloc(NULL, CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    buffer = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+        buffer = NULL;
+#endif
+    blocks = calloc(c->rom_end, sizeof(block));
+    details = calloc(c->rom_end, sizeof(block_detail));
+    if (!buffer || !blocks || !details) {
+        jit_free();
+        return false;
+    }
+    flag_table = buffer;
+    for (int psw = 0; psw < 256; ++psw)
+        flag_table[psw] = flag_bits(psw);
+    exit_at = buffer + 256;
+    code_end = buffer + HEADER;
+    jit_rom_end = c->rom_end;
+    stop_map_count = 0;
+    stop_when = NULL;
+    blocks_translated = blocks_run = cycles_run = flushes = 0;
+    return true;
+}
+
+void jit_free() {
+    if (buffer) {
+#ifdef _WIN32
+        VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+        munmap(buffer, CODE_SIZE);
+#endif
+    }
+    free(blocks);
+    free(details);
+    buffer = NULL;
+    blocks = NULL;
+    details = NULL;
+    jit_rom_end = 0;
+}
+
+// Whether any instruction in b after the first is in a stop map
+static bool stops_in(const block *b) {
+    for (int m = 0; m < stop_map_count; ++m) {
+        const uint8_t *map = stop_maps[m] + b->stop_first;
+        for (int i = 0; i < b->stop_count; ++i) {
+            if (map[i] & b->stop_mask[i])
+                return true;
+        }
+    }
+    return false;
+}
+
+// The index of the instruction in a block after which the run must stop
+static int stop_index(const block_detail *bd, unsigned long cyc, unsigned long until) {
+    for (int i = 1; i < bd->count; ++i) {
+        if (cyc + bd->done[i - 1] > until)
+            return i - 1;
+        for (int m = 0; m < stop_map_count; ++m) {
+            if (stop_maps[m][bd->addr[i] >> 3] & (1 << (bd->addr[i] & 7)))
+                return i - 1;
+        }
+    }
+    return bd->count - 1;
+}
+
+bool jit_step(i8080 *c, unsigned long until) {
+    uint16_t pc = c->pc;
+    if (pc >= jit_rom_end || c->halted || c->interrupt_delay || (c->interrupt_pending && c->iff))
+        return false;
+    block *b = &blocks[pc];
+    if (!b->code || (b->cut && c->decoded[b->cut].len)) {
+        if (c->decoded[pc].len == 0)
+            return false;
+        if (!translate(c, pc)) {
+            jit_flush();
+            if (!translate(c, pc))
+                return false;
+        }
+    }
+    // As run_ahead() would, stop past until or before a hooked instruction.
+    // Usually the whole block runs.
+    int last = MAX_INSNS;
+    if (c->cyc + b->inner_cycles > until || stops_in(b))
+        last = stop_index(&details[pc], c->cyc, until);
+
+    unsigned long start = c->cyc;
+    *exit_at = last;
+    b->code(c);
+    ++blocks_run;
+    cycles_run += c->cyc - start;
+    return true;
+}
+
+#else
+
+bool jit_init(const i8080 *c UNUSED) {
+    return false;
+}
+
+void jit_free() {
+}
+
+bool jit_step(i8080 *c UNUSED, unsigned long until UNUSED) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "i8080.h"
+
+// Native code for the ROM: basic blocks from the decode cache translated into
+// x86-64, for runs that go a long way between events.
+//
+// A block is a straight run of instructions that have all been decoded, up to
+// and including the first that transfers control (a jump, call, return, RST,
+// PCHL, EI or HLT). Registers and flags live in the i8080 structure, as for the
+// interpreter; memory reads and writes go through the CPU's callbacks, with
+// the same coverage marks. Port I/O and the rarer instructions call back into
+// the interpreter for that one instruction. Cycles are added as each block
+// goes, so that callbacks see the count the interpreter would have.
+//
+// Interrupts are only taken between blocks: a block doesn't start while an
+// interrupt could be taken, and EI ends one. The interpreter stays the
+// reference, and runs everything a block can't.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Code below this address has been translated; 0 if there's no translator
+extern uint16_t jit_rom_end;
+
+// Start translating the code in c's decode cache. Returns false, and
+// translates nothing, if this isn't an x86-64 host or there's no decode cache.
+bool jit_init(const i8080 *c);
+void jit_free();
+
+// Forget every translation, e.g. when memory below rom_end has changed other
+// than through the CPU. A block running at the time stops after the current
+// instruction.
+void jit_flush();
+
+// The CPU has written addr. Translations of ROM that has changed are dropped.
+static inline void jit_written(uint16_t addr) {
+    if (addr < jit_rom_end)
+        jit_flush();
+}
+
+// A bitmap of addresses that execution must stop at, as a run loop stops
+// before an instruction it has hooked. A block stops before any of its
+// instructions after the first that is in such a map.
+void jit_stop_at(const uint8_t *map);
+
+// Asked after each write and each instruction run by the interpreter: if it
+// returns true, the block stops there
+void jit_stop_when(bool (*stop)(void));
+
+// Run the block at c->pc, translating it if need be, stopping after the first
+// instruction to end past cycle until. Returns false, having done nothing, if
+// the interpreter should step instead.
+bool jit_step(i8080 *c, unsigned long until);
+
+// Blocks translated and run, and the share of total_cycles spent in them
+void jit_report(unsigned long total_cycles);
+
+#endif
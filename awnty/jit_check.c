@@ -0,0 +1,204 @@
+// Runs random code through the translator (jit.c) and the interpreter side by
+// side, checking that the two machines agree after every block. The firmware
+// never executes some instructions (ADC and SBB among them), so the scripts
+// alone can't show that their translations are right.
+//
+// Each trial fills the ROM area with random instructions and the rest of
+// memory with RSTs back into it, starts both machines with the same random
+// registers, and runs them for a number of steps. The translated machine runs
+// a block where it can, and otherwise steps; the reference machine then steps
+// until it has run as many cycles. Registers, flags, memory, coverage and
+// branch maps must then be the same.
+//
+// Options: --trials N (default 20), --steps N per trial (default 20000),
+// --seed N. The result is 1 if the machines disagreed, and 2 if this host has
+// no translator.
+
+#include "i8080.h"
+#include "jit.h"
+#include "unused.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROM_SIZE 0x2000
+
+typedef struct machine {
+    i8080 cpu;
+    uint8_t memory[0x10000];
+    bool translated;
+} machine;
+
+static machine reference, translated;
+
+static uint8_t rb(void *userdata, uint16_t addr) {
+    return ((machine *)userdata)->memory[addr];
+}
+
+static void wb(void *userdata, uint16_t addr, uint8_t val) {
+    machine *m = userdata;
+    if (m->translated)
+        jit_written(addr);
+    m->memory[addr] = val;
+}
+
+static uint8_t port_in(void *userdata UNUSED, uint8_t port) {
+    return port * 7 + 3;
+}
+
+// Leaves a mark in memory, so that the order and values of writes are checked
+static void port_out(void *userdata, uint8_t port, uint8_t value) {
+    ((machine *)userdata)->memory[ROM_SIZE + port] ^= value;
+}
+
+static uint8_t iack(void *userdata UNUSED) {
+    return 0xff;
+}
+
+static void start(machine *m, bool translate) {
+    i8080_init(&m->cpu);
+    m->cpu.userdata = m;
+    m->cpu.read_byte = rb;
+    m->cpu.write_byte = wb;
+    m->cpu.port_in = port_in;
+    m->cpu.port_out = port_out;
+    m->cpu.iack = iack;
+    m->translated = translate;
+    i8080_set_rom(&m->cpu, ROM_SIZE);
+    i8080_record_branches(&m->cpu);
+    // i8080_ww marks the byte past a word at 0xffff
+    m->cpu.coverage = realloc(m->cpu.coverage, 0x10001);
+    m->cpu.coverage[0x10000] = 0;
+}
+
+static bool same() {
+    const i8080 *r = &reference.cpu, *t = &translated.cpu;
+    return r->pc == t->pc && r->sp == t->sp && r->inst_pc == t->inst_pc &&
+        r->a == t->a && r->b == t->b && r->c == t->c && r->d == t->d &&
+        r->e == t->e && r->h == t->h && r->l == t->l &&
+        r->sf == t->sf && r->zf == t->zf && r->hf == t->hf && r->pf == t->pf &&
+        r->cf == t->cf && r->iff == t->iff && r->halted == t->halted &&
+        r->interrupt_delay == t->interrupt_delay && r->cyc == t->cyc &&
+        memcmp(reference.memory, translated.memory, 0x10000) == 0 &&
+        memcmp(r->coverage, t->coverage, 0x10001) == 0 &&
+        memcmp(r->taken, t->taken, 0x10000 / 8) == 0 &&
+        memcmp(r->not_taken, t->not_taken, 0x10000 / 8) == 0;
+}
+
+static void print_cpu(const char *name, const i8080 *c) {
+    printf("  %-10s pc %04x sp %04x a %02x bc %02x%02x de %02x%02x hl %02x%02x "
+        "flags %c%c%c%c%c%c cycles %lu\n", name, c->pc, c->sp, c->a, c->b, c->c,
+        c->d, c->e, c->h, c->l, c->sf ? 'S' : '-', c->zf ? 'Z' : '-',
+        c->hf ? 'H' : '-', c->pf ? 'P' : '-', c->cf ? 'C' : '-',
+        c->iff ? 'I' : '-', c->cyc);
+}
+
+// Runs one trial, returning true if the machines agreed throughout
+static bool trial(int number, unsigned long steps) {
+    for (int addr = 0; addr < 0x10000; ++addr)
+        reference.memory[addr] = addr < ROM_SIZE ? rand() : 0xc7 | (rand() & 0x38);
+    // Halting or enabling interrupts often would end most blocks early
+    for (int addr = 0; addr < ROM_SIZE; ++addr) {
+        if (reference.memory[addr] == 0x76 || reference.memory[addr] == 0xfb)
+            reference.memory[addr] = rand() & 0x3f;
+    }
+    memcpy(translated.memory, reference.memory, 0x10000);
+
+    start(&reference, false);
+    start(&translated, true);
+    if (!jit_init(&translated.cpu)) {
+        i8080_free(&reference.cpu);
+        i8080_free(&translated.cpu);
+        return false;
+    }
+    i8080 *r = &reference.cpu, *t = &translated.cpu;
+    r->pc = rand() % ROM_SIZE;
+    r->sp = 0x8000 + rand() % 0x100;
+    r->a = rand();
+    r->b = rand();
+    r->c = rand();
+    r->d = rand();
+    r->e = rand();
+    r->h = rand();
+    r->l = rand();
+    r->cf = rand() & 1;
+    r->hf = rand() & 1;
+    r->zf = rand() & 1;
+    t->pc = r->pc;
+    t->sp = r->sp;
+    t->a = r->a;
+    t->b = r->b;
+    t->c = r->c;
+    t->d = r->d;
+    t->e = r->e;
+    t->h = r->h;
+    t->l = r->l;
+    t->cf = r->cf;
+    t->hf = r->hf;
+    t->zf = r->zf;
+
+    bool agreed = true;
+    for (unsigned long step = 0; step < steps && agreed; ++step) {
+        if (t->halted)
+            r->halted = t->halted = false;
+        // Sometimes stop partway through a block, as a run loop does
+        unsigned long until = rand() % 4 ? ULONG_MAX : t->cyc + rand() % 64;
+        uint16_t pc = t->pc;
+        if (!jit_step(t, until))
+            i8080_step(t);
+        while (r->cyc < t->cyc && !r->halted)
+            i8080_step(r);
+        if (!same()) {
+            printf("Trial %d, step %lu: the machines disagree after running from %04x\n",
+                number, step, pc);
+            print_cpu("reference", r);
+            print_cpu("translated", t);
+            agreed = false;
+        }
+    }
+    jit_free();
+    i8080_free(&reference.cpu);
+    i8080_free(&translated.cpu);
+    return agreed;
+}
+
+int main(int argc, char *argv[]) {
+    int trials = 20;
+    unsigned long steps = 20000;
+    unsigned seed = 1;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "--trials") == 0 && arg + 1 < argc)
+            trials = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "--steps") == 0 && arg + 1 < argc)
+            steps = strtoul(argv[++arg], NULL, 0);
+        else if (strcmp(argv[arg], "--seed") == 0 && arg + 1 < argc)
+            seed = strtoul(argv[++arg], NULL, 0);
+        else {
+            fprintf(stderr, "Usage: %s [--trials N] [--steps N] [--seed N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    i8080 probe;
+    i8080_init(&probe);
+    i8080_set_rom(&probe, ROM_SIZE);
+    bool can_translate = jit_init(&probe);
+    jit_free();
+    i8080_free(&probe);
+    if (!can_translate) {
+        printf("Can't translate here\n");
+        return 2;
+    }
+
+    srand(seed);
+    int failures = 0;
+    for (int number = 0; number < trials; ++number) {
+        if (!trial(number, steps))
+            ++failures;
+    }
+    printf("%d of %d trials agreed\n", trials - failures, trials);
+    return failures > 0 ? 1 : 0;
+}
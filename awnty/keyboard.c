@@ -0,0 +1,57 @@
+#include "keyboard.h"
+
+#include <ctype.h>
+#include <string.h>
+
+// Unshifted ASCII for each key code, following key_scan_map in the firmware.
+// Keys that don't produce ASCII (arrows, PF keys, keypad) are left as zero.
+static const char key_ascii[128] = {
+    [0x03] = 0x7f, [0x05] = 'p', [0x06] = 'o', [0x07] = 'y', [0x08] = 't', [0x09] = 'w', [0x0a] = 'q',
+    [0x14] = ']', [0x15] = '[', [0x16] = 'i', [0x17] = 'u', [0x18] = 'r', [0x19] = 'e', [0x1a] = '1',
+    [0x24] = '`', [0x25] = '-', [0x26] = '9', [0x27] = '7', [0x28] = '4', [0x29] = '3', [0x2a] = 0x1b,
+    [0x33] = 0x08, [0x34] = '=', [0x35] = '0', [0x36] = '8', [0x37] = '6', [0x38] = '5', [0x39] = '2', [0x3a] = 0x09,
+    [0x44] = 0x0a, [0x45] = '\\', [0x46] = 'l', [0x47] = 'k', [0x48] = 'g', [0x49] = 'f', [0x4a] = 'a',
+    [0x55] = '\'', [0x56] = ';', [0x57] = 'j', [0x58] = 'h', [0x59] = 'd', [0x5a] = 's',
+    [0x64] = 0x0d, [0x65] = '.', [0x66] = ',', [0x67] = 'n', [0x68] = 'b', [0x69] = 'x',
+    [0x75] = '/', [0x76] = 'm', [0x77] = ' ', [0x78] = 'v', [0x79] = 'c', [0x7a] = 'z',
+};
+
+// Pairs of unshifted and shifted characters, as key_shift_map
+static const char shift_pairs[] = "0)1!2@3#4$5%6^7&8*9(-_=+`~[{]};:/?'\",<.>\\|";
+
+static int key_for_ascii(int ch) {
+    for (int key = 0; key < 128; ++key) {
+        if (key_ascii[key] == ch)
+            return key;
+    }
+    return -1;
+}
+
+int keyboard_keys_for_char(int ch, uint8_t keys[3]) {
+    int key;
+    if (ch <= 0 || ch > 0x7f)
+        return 0;
+
+    if ((key = key_for_ascii(ch)) >= 0) {
+        keys[0] = key;
+        return 1;
+    }
+    if (isupper(ch)) {
+        keys[0] = KEY_SHIFT;
+        keys[1] = key_for_ascii(tolower(ch));
+        return 2;
+    }
+    const char *pair = strchr(shift_pairs, ch);
+    if (pair && (pair - shift_pairs) % 2 == 1 && (key = key_for_ascii(pair[-1])) >= 0) {
+        keys[0] = KEY_SHIFT;
+        keys[1] = key;
+        return 2;
+    }
+    // Control characters without keys of their own are CTRL + letter
+    if (ch < 0x20 && (key = key_for_ascii(ch | 0x60)) >= 0) {
+        keys[0] = KEY_CTRL;
+        keys[1] = key;
+        return 2;
+    }
+    return 0;
+}
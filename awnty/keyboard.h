@@ -0,0 +1,22 @@
+#ifndef KEYBOARD_H
+#define KEYBOARD_H
+
+// Translation from host characters to VT100 key codes, as returned from the
+// keyboard port (0x82). Key codes are column << 4 | row, from the Keyboard
+// Switch Array in TM Figure 4-4-4.
+
+#include <stdint.h>
+
+#define KEY_UP 0x30
+#define KEY_DOWN 0x22
+#define KEY_LEFT 0x20
+#define KEY_RIGHT 0x10
+#define KEY_SETUP 0x7b
+#define KEY_CTRL 0x7c
+#define KEY_SHIFT 0x7d
+
+// Fills keys with the modifiers and key needed to type ch and returns the
+// number of key codes, or 0 if the character can't be typed.
+int keyboard_keys_for_char(int ch, uint8_t keys[3]);
+
+#endif
@@ -0,0 +1,218 @@
+#include "lockstep.h"
+#include "unused.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_ACCESSES 128 // more than any one translated block, or interrupt
+
+typedef struct access {
+    uint16_t addr; // or port
+    uint8_t val;
+    bool used; // already handed to the reference
+} access;
+
+typedef struct access_log {
+    access a[MAX_ACCESSES];
+    int n;
+} access_log;
+
+bool lockstep_active = false;
+
+static i8080 ref;
+static const uint8_t *memory;
+static uint16_t rom_end;
+static unsigned long checked = 0;
+static int failures = 0;
+static uint16_t block_pc; // where the block being checked starts
+
+// What the VT100's core did during the instruction, and what the reference did
+static access_log reads, ins, writes, outs;
+static access_log ref_writes, ref_outs;
+static int vector = -1;
+static char problem[100];
+
+static void log_access(access_log *log, uint16_t addr, uint8_t val) {
+    if (log->n < MAX_ACCESSES) {
+        log->a[log->n].addr = addr;
+        log->a[log->n].val = val;
+        log->a[log->n].used = false;
+    }
+    ++log->n;
+}
+
+// Hands out the accesses to each address in order, as a block may read the
+// same one more than once
+static bool find_access(access_log *log, uint16_t addr, uint8_t *val) {
+    for (int i = 0; i < log->n && i < MAX_ACCESSES; ++i) {
+        if (log->a[i].addr == addr && !log->a[i].used) {
+            log->a[i].used = true;
+            *val = log->a[i].val;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool same_log(const access_log *x, const access_log *y) {
+    return x->n == y->n && memcmp(x->a, y->a, sizeof(access) * (x->n < MAX_ACCESSES ? x->n : MAX_ACCESSES)) == 0;
+}
+
+static uint8_t ref_rb(void *userdata UNUSED, uint16_t addr) {
+    uint8_t val = 0xff;
+    if (addr < rom_end)
+        return memory[addr];
+    if (!find_access(&reads, addr, &val) && !problem[0])
+        snprintf(problem, sizeof(problem), "reference read %04x, which the VT100's core didn't", addr);
+    return val;
+}
+
+static void ref_wb(void *userdata UNUSED, uint16_t addr, uint8_t val) {
+    log_access(&ref_writes, addr, val);
+}
+
+static uint8_t ref_in(void *userdata UNUSED, uint8_t port) {
+    uint8_t val = 0xff;
+    if (!find_access(&ins, port, &val) && !problem[0])
+        snprintf(problem, sizeof(problem), "reference read port %02x, which the VT100's core didn't", port);
+    return val;
+}
+
+static void ref_out(void *userdata UNUSED, uint8_t port, uint8_t val) {
+    log_access(&ref_outs, port, val);
+}
+
+static uint8_t ref_iack(void *userdata UNUSED) {
+    if (vector < 0 && !problem[0])
+        snprintf(problem, sizeof(problem), "reference took an interrupt the VT100's core didn't");
+    return vector < 0 ? 0 : vector;
+}
+
+void lockstep_start(const uint8_t *mem, uint16_t rom_size) {
+    uint8_t *coverage = ref.coverage;
+    i8080_init(&ref);
+    free(coverage);
+    ref.read_byte = ref_rb;
+    ref.write_byte = ref_wb;
+    ref.port_in = ref_in;
+    ref.port_out = ref_out;
+    ref.iack = ref_iack;
+    memory = mem;
+    rom_end = rom_size;
+    checked = 0;
+    failures = 0;
+    lockstep_active = true;
+}
+
+void lockstep_read(uint16_t addr, uint8_t val) {
+    log_access(&reads, addr, val);
+}
+
+void lockstep_write(uint16_t addr, uint8_t val) {
+    log_access(&writes, addr, val);
+}
+
+void lockstep_in(uint8_t port, uint8_t val) {
+    log_access(&ins, port, val);
+}
+
+void lockstep_out(uint8_t port, uint8_t val) {
+    log_access(&outs, port, val);
+}
+
+void lockstep_iack(uint8_t v) {
+    vector = v;
+}
+
+void lockstep_before(const i8080 *c) {
+    // Everything but the interface and coverage. The reference has no branch
+    // maps or decode cache.
+    i8080_restore_state(&ref, c);
+    block_pc = c->pc;
+
+    reads.n = ins.n = writes.n = outs.n = 0;
+    ref_writes.n = ref_outs.n = 0;
+    vector = -1;
+    problem[0] = 0;
+}
+
+static uint8_t flags(const i8080 *c) {
+    return c->sf << 4 | c->zf << 3 | c->hf << 2 | c->pf << 1 | c->cf;
+}
+
+static bool same_state(const i8080 *x, const i8080 *y) {
+    return x->pc == y->pc && x->sp == y->sp && x->cyc == y->cyc &&
+        x->a == y->a && x->b == y->b && x->c == y->c && x->d == y->d &&
+        x->e == y->e && x->h == y->h && x->l == y->l &&
+        flags(x) == flags(y) && x->iff == y->iff && x->halted == y->halted &&
+        x->interrupt_pending == y->interrupt_pending &&
+        x->interrupt_delay == y->interrupt_delay;
+}
+
+static void print_state(const char *name, const i8080 *c) {
+    printf("  %-10s %04x %04x %02x %02x %02x %02x %02x %02x %02x %c%c%c%c%c %d %lu\n",
+        name, c->pc, c->sp, c->a, c->b, c->c, c->d, c->e, c->h, c->l,
+        c->sf ? 'S' : '-', c->zf ? 'Z' : '-', c->hf ? 'H' : '-', c->pf ? 'P' : '-', c->cf ? 'C' : '-',
+        c->iff, c->cyc);
+}
+
+static void print_log(const char *name, const access_log *log, int width) {
+    printf("  %-10s", name);
+    for (int i = 0; i < log->n && i < MAX_ACCESSES; ++i)
+        printf(" %0*x=%02x", width, log->a[i].addr, log->a[i].val);
+    printf(log->n ? "\n" : " none\n");
+}
+
+static bool report(const i8080 *c, bool block) {
+    if (!problem[0] && same_state(c, &ref) && same_log(&writes, &ref_writes) && same_log(&outs, &ref_outs))
+        return true;
+
+    uint16_t pc = c->inst_pc;
+    printf("Lockstep: cores differ at cycle %lu, after ", c->cyc);
+    if (block)
+        printf("the translated block from %04x to %04x\n", block_pc, pc);
+    else if (vector >= 0)
+        printf("an interrupt at %04x (%s)\n", pc, i8080_disassemble(vector));
+    else
+        printf("the instruction at %04x: %02x %02x %02x (%s)\n", pc,
+            memory[pc], memory[(uint16_t)(pc + 1)], memory[(uint16_t)(pc + 2)], i8080_disassemble(memory[pc]));
+    if (problem[0])
+        printf("  %s\n", problem);
+    printf("             PC   SP  A  B  C  D  E  H  L  flags I cycles\n");
+    print_state(block ? "translated" : "decoded", c);
+    print_state("reference", &ref);
+    print_log("writes", &writes, 4);
+    print_log("reference", &ref_writes, 4);
+    print_log("output", &outs, 2);
+    print_log("reference", &ref_outs, 2);
+
+    ++failures;
+    lockstep_active = false;
+    return false;
+}
+
+bool lockstep_after(const i8080 *c) {
+    i8080_step(&ref);
+    ++checked;
+    return report(c, false);
+}
+
+bool lockstep_after_block(const i8080 *c) {
+    while (ref.cyc < c->cyc && !ref.halted && !problem[0]) {
+        i8080_step(&ref);
+        ++checked;
+    }
+    return report(c, true);
+}
+
+void lockstep_finish() {
+    printf("Lockstep: %lu instructions checked, %s\n", checked, failures ? "cores differ" : "no differences");
+    free(ref.coverage);
+    ref.coverage = NULL;
+    lockstep_active = false;
+}
+
+int lockstep_failures() {
+    return failures;
+}
@@ -0,0 +1,44 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+// Runs a reference 8080 core in lockstep with the one driving the VT100, and
+// checks after every instruction, or every block translated by --jit, that
+// the two agree on registers, flags, cycle count, memory writes and port
+// output. The reference is the plain interpreter, i8080.c without the ROM
+// decode cache.
+//
+// The reference has no devices or RAM of its own. It reads ROM directly, and
+// is handed the RAM reads, port input and interrupt vector the VT100's core
+// saw during the same instruction or block, in order; reading anything else
+// is a divergence.
+// Each instruction starts from the VT100 core's state, so changes made from
+// outside the CPU (commands, hooks, skipped idle loop passes) carry across.
+
+#include "i8080.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+extern bool lockstep_active;
+
+void lockstep_start(const uint8_t *mem, uint16_t rom_size);
+
+// Called by the VT100's memory and I/O callbacks while lockstep_active
+void lockstep_read(uint16_t addr, uint8_t val);
+void lockstep_write(uint16_t addr, uint8_t val);
+void lockstep_in(uint8_t port, uint8_t val);
+void lockstep_out(uint8_t port, uint8_t val);
+void lockstep_iack(uint8_t vector);
+
+// Called around each instruction. lockstep_after() reports the first
+// divergence, stops checking and returns false.
+void lockstep_before(const i8080 *c);
+bool lockstep_after(const i8080 *c);
+// Called after a translated block (jit.c) instead, once the block has run.
+// The reference steps until it has run as many cycles.
+bool lockstep_after_block(const i8080 *c);
+
+void lockstep_finish();
+int lockstep_failures();
+
+#endif
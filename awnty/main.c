@@ -0,0 +1,144 @@
+// awnty's command line: options, then the script to run (t/vt100-tests.txt
+// if none is given). The emulator itself is in awnty.c.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "awnty.h"
+#include "coverage.h"
+#include "i8080.h"
+#include "script.h"
+#include "vt100_memory.h"
+
+int main(int argc, char *argv[]) {
+    if (!memory_init()) {
+        fputs("Couldn't allocate 64K memory\n", stderr);
+        return 1;
+    }
+
+    //logmem = fopen("logmem.txt", "w");
+
+    i8080 cpu = { 0 };
+    char testfile[255];
+    bool have_testfile = false;
+    bool opt_check = false;
+    const char *compile_to = NULL;
+    strcpy(testfile, "t/vt100-tests.txt");
+    for (int arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "--serial-stdin") == 0)
+            opt_serial_stdin = true;
+        else if (strcmp(argv[arg], "--pty") == 0)
+            opt_pty = true;
+        else if (strncmp(argv[arg], "--pty=", 6) == 0) {
+            opt_pty = true;
+            pty_command = &argv[arg][6];
+        }
+        else if (strcmp(argv[arg], "--headless") == 0)
+            opt_headless = true;
+        else if (strcmp(argv[arg], "--no-fast-idle") == 0)
+            opt_fast_idle = false;
+        else if (strcmp(argv[arg], "--no-run-ahead") == 0)
+            opt_run_ahead = false;
+        else if (strcmp(argv[arg], "--jit") == 0)
+            opt_jit = true;
+        else if (strcmp(argv[arg], "--no-decode-cache") == 0)
+            opt_decode_cache = false;
+        else if (strcmp(argv[arg], "--final-state") == 0)
+            opt_final_state = true;
+        else if (strcmp(argv[arg], "--lockstep") == 0)
+            opt_lockstep = true;
+        else if (strcmp(argv[arg], "--stack-monitor") == 0)
+            opt_stack_monitor = true;
+        else if (strcmp(argv[arg], "--no-pace") == 0)
+            opt_pace = false;
+        else if (strcmp(argv[arg], "--no-auto-start") == 0)
+            opt_auto_start = false;
+        else if (strcmp(argv[arg], "--fast-boot") == 0)
+            opt_fast_boot = true;
+        else if (strcmp(argv[arg], "--branches") == 0)
+            opt_branches = true;
+        else if (strcmp(argv[arg], "--coverage-deltas") == 0)
+            opt_coverage_deltas = true;
+        else if (strcmp(argv[arg], "--quit-at") == 0 && arg + 1 < argc)
+            opt_quit_at = argv[++arg];
+        else if (strcmp(argv[arg], "--check") == 0)
+            opt_check = true;
+        else if (strcmp(argv[arg], "--compile") == 0 && arg + 1 < argc)
+            compile_to = argv[++arg];
+        else {
+            snprintf(testfile, sizeof(testfile), "%s", argv[arg]);
+            have_testfile = true;
+        }
+    }
+    // A shell session runs without a script unless one is given
+    if (opt_pty && !have_testfile)
+        testfile[0] = 0;
+
+    // Check or compile the script without running it. Symbols are needed to
+    // resolve break and trace addresses.
+    if (opt_check || compile_to) {
+        script cmds = { NULL, 0, 0, 0 };
+        coverage_read_sym("vt100.sym");
+        coverage_read_equ("vt100.equ");
+        bool ok = script_load(&cmds, testfile);
+        if (ok && compile_to)
+            ok = script_save(&cmds, compile_to);
+        if (ok)
+            printf("%s: %zu bytes compiled\n", testfile, cmds.len);
+        script_free(&cmds);
+        return ok ? 0 : 1;
+    }
+  
+    FILE *charf = fopen("../bin/23-018E2.bin", "rb");
+    if (charf) {
+        fread(chargen, 1, 2048, charf);
+        fclose(charf);
+    }
+    else {
+        fputs("Missing chargen ROM ../bin/23-018E2.bin\n", stderr);
+    }
+
+    charf = fopen("alt-chargen.bin", "rb");
+    if (charf) {
+        fread(alt_chargen, 1, 2048, charf);
+        fclose(charf);
+    }
+    else {
+        fputs("Missing alt chargen ROM alt-chargen.bin\n", stderr);
+        memset(alt_chargen, 0xff, 2048);
+    }
+
+    // Headless runs have no windows, but can still capture the screen
+    if (!opt_headless && SDL_Init(SDL_INIT_VIDEO) < 0) {
+        fprintf(stderr, "Could not init: %s\n", SDL_GetError());
+    }
+
+    if (opt_coverage && !opt_headless) {
+        if (SDL_CreateWindowAndRenderer(129 * 7 - 1 + 20, 98 * 7 - 1 + 8, 0, &cov_window, &cov_renderer) < 0) {
+            fprintf(stderr, "Could not create window: %s\n", SDL_GetError());
+        }
+        SDL_SetWindowTitle(cov_window, "Awnty Coverage");
+    }
+
+    int screen_scale = 1;
+    if (!opt_headless) {
+        if (SDL_CreateWindowAndRenderer(screen_scale * (20 + 10 * 80 + 2 * 6), screen_scale * (0 + SCREEN_LINES * 20 + 40 + 2 * 6), 0, &scr_window, &scr_renderer) < 0) {
+            fprintf(stderr, "Could not create window: %s\n", SDL_GetError());
+        }
+        SDL_SetWindowTitle(scr_window, "Awnty Screen");
+        SDL_RenderSetScale(scr_renderer, screen_scale, screen_scale);
+    }
+
+    run_test(&cpu, "../bin/vt100.bin", testfile);
+
+    free(memory);
+    i8080_free(&cpu);
+
+    SDL_Quit();
+
+    return run_failures() > 0 ? 1 : 0;
+}
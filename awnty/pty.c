@@ -0,0 +1,185 @@
+// decl to get posix_openpt() and friends
+#define _XOPEN_SOURCE 600
+
+#include "pty.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+bool pty_open(const char *command) {
+    (void)command;
+    fputs("No pseudo-terminal support on this platform\n", stderr);
+    return false;
+}
+void pty_close() {}
+bool pty_active() { return false; }
+bool pty_poll() { return false; }
+bool pty_more() { return false; }
+int pty_next() { return -1; }
+void pty_write(uint8_t val) { (void)val; }
+void pty_flush() {}
+unsigned long pty_bytes_received() { return 0; }
+unsigned long pty_bytes_sent() { return 0; }
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+static int master_fd = -1;
+static pid_t child_pid = -1;
+
+static uint8_t buffer[256];
+static int buf_len = 0;
+static int buf_pos = 0;
+
+// Bytes for the shell that it hasn't taken yet
+static uint8_t out_buffer[4096];
+static int out_len = 0;
+
+static unsigned long bytes_received = 0;
+static unsigned long bytes_sent = 0;
+
+bool pty_open(const char *command) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+        perror("Can't allocate pseudo-terminal");
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    const char *slave_name = ptsname(fd);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Can't fork shell");
+        close(fd);
+        return false;
+    }
+    if (pid == 0) {
+        setsid();
+        int slave = open(slave_name, O_RDWR);
+        if (slave < 0)
+            _exit(127);
+        struct winsize ws = { 24, 80, 0, 0 };
+        ioctl(slave, TIOCSWINSZ, &ws);
+        // IXON is on by default, so the line discipline itself honours the
+        // XOFF and XON that the terminal sends.
+        dup2(slave, 0);
+        dup2(slave, 1);
+        dup2(slave, 2);
+        if (slave > 2)
+            close(slave);
+        close(fd);
+        setenv("TERM", "vt100", 1);
+        if (command) {
+            execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        }
+        else {
+            const char *shell = getenv("SHELL");
+            if (!shell)
+                shell = "/bin/sh";
+            execl(shell, shell, (char *)NULL);
+        }
+        _exit(127);
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    master_fd = fd;
+    child_pid = pid;
+    buf_len = buf_pos = 0;
+    out_len = 0;
+    bytes_received = bytes_sent = 0;
+    return true;
+}
+
+void pty_close() {
+    if (master_fd >= 0) {
+        close(master_fd);
+        master_fd = -1;
+    }
+    if (child_pid > 0) {
+        kill(child_pid, SIGHUP);
+        waitpid(child_pid, NULL, 0);
+        child_pid = -1;
+    }
+}
+
+bool pty_active() {
+    return master_fd >= 0;
+}
+
+void pty_flush() {
+    if (master_fd < 0)
+        return;
+    int done = 0;
+    while (done < out_len) {
+        ssize_t put = write(master_fd, &out_buffer[done], out_len - done);
+        if (put > 0)
+            done += put;
+        else if (put < 0 && errno == EINTR)
+            continue;
+        else
+            break;
+    }
+    bytes_sent += done;
+    out_len -= done;
+    memmove(out_buffer, &out_buffer[done], out_len);
+}
+
+bool pty_poll() {
+    if (master_fd < 0)
+        return false;
+    if (buf_pos < buf_len)
+        return true;
+    ssize_t got = read(master_fd, buffer, sizeof(buffer));
+    if (got > 0) {
+        buf_len = got;
+        buf_pos = 0;
+        return true;
+    }
+    // EIO is what Linux gives us once the shell has gone and closed the slave
+    if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        pty_close();
+    return false;
+}
+
+bool pty_more() {
+    return buf_pos < buf_len;
+}
+
+int pty_next() {
+    if (buf_pos >= buf_len)
+        return -1;
+    ++bytes_received;
+    return buffer[buf_pos++];
+}
+
+void pty_write(uint8_t val) {
+    if (master_fd < 0)
+        return;
+    if (out_len == (int)sizeof(out_buffer))
+        pty_flush();
+    if (out_len < (int)sizeof(out_buffer))
+        out_buffer[out_len++] = val;
+    pty_flush();
+}
+
+unsigned long pty_bytes_received() {
+    return bytes_received;
+}
+
+unsigned long pty_bytes_sent() {
+    return bytes_sent;
+}
+
+#endif
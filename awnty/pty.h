@@ -0,0 +1,30 @@
+#ifndef PTY_H
+#define PTY_H
+
+// Pseudo-terminal bridge, so that the emulated VT100 can host a real shell.
+// Bytes the shell writes arrive at the receiver, and bytes the firmware
+// transmits (including XON/XOFF) go back to the shell's terminal.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Start command (NULL for the user's shell) on a new pseudo-terminal
+bool pty_open(const char *command);
+void pty_close();
+
+bool pty_active();
+// Read whatever the shell has written, without blocking. Returns true if
+// there is a byte ready for the receiver.
+bool pty_poll();
+bool pty_more();
+int pty_next();
+// Bytes the shell isn't ready for are kept, and tried again by pty_flush().
+// Only if it stops reading for a long while are they dropped.
+void pty_write(uint8_t val);
+void pty_flush();
+
+// Totals for the whole session
+unsigned long pty_bytes_received();
+unsigned long pty_bytes_sent();
+
+#endif
@@ -0,0 +1,48 @@
+#include "pusart.h"
+
+// Output of the COM5016 baud rate generator for each speed code
+static const double baud_rates[16] = {
+    50, 75, 110, 134.5, 150, 200, 300, 600,
+    1200, 1800, 2000, 2400, 3600, 4800, 9600, 19200
+};
+
+double pusart_baud(uint8_t code) {
+    return baud_rates[code & 0x0f];
+}
+
+double pusart_rx_baud(uint8_t speed) {
+    return pusart_baud(speed & 0x0f);
+}
+
+double pusart_tx_baud(uint8_t speed) {
+    return pusart_baud(speed >> 4);
+}
+
+int pusart_baud_code(double baud) {
+    for (int code = 0; code < 16; ++code) {
+        if ((int)baud_rates[code] == (int)baud)
+            return code;
+    }
+    return -1;
+}
+
+// Mode byte (async):  |S2|S1|EP|PEN|L2|L1|B2|B1|
+//   S2 S1   stop bits: 01 = 1, 10 = 1.5, 11 = 2 (00 is invalid)
+//   EP PEN  PEN adds a parity bit
+//   L2 L1   character length 5 + L
+//   B2 B1   baud rate factor (00 selects sync mode)
+double pusart_frame_bits(uint8_t mode) {
+    double bits = 1 + 5 + ((mode >> 2) & 0x03); // start and data bits
+    if (mode & 0x10)
+        bits += 1;
+    switch (mode >> 6) {
+        case 2:  bits += 1.5; break;
+        case 3:  bits += 2;   break;
+        default: bits += 1;   break;
+    }
+    return bits;
+}
+
+unsigned long pusart_char_cycles(double baud, uint8_t mode) {
+    return (unsigned long)(CPU_HZ * pusart_frame_bits(mode) / baud + 0.5);
+}
@@ -0,0 +1,25 @@
+#ifndef PUSART_H
+#define PUSART_H
+
+// Line timing for the 8251A PUSART, from the speeds written to the baud rate
+// generator (port 0x02) and the framing in the PUSART mode byte.
+
+#include <stdint.h>
+
+#define CPU_HZ 2764800
+
+// Speed codes are the same 0-15 values as SET-UP B shows. Port 0x02 takes the
+// transmit speed in bits 7-4 and the receive speed in bits 3-0.
+double pusart_baud(uint8_t code);
+double pusart_rx_baud(uint8_t speed);
+double pusart_tx_baud(uint8_t speed);
+// Speed code for a baud rate, or -1 if the generator can't produce it
+int pusart_baud_code(double baud);
+
+// Bits in an asynchronous character: start, data, parity and stop bits
+double pusart_frame_bits(uint8_t mode);
+
+// CPU cycles between characters arriving back-to-back at baud
+unsigned long pusart_char_cycles(double baud, uint8_t mode);
+
+#endif
@@ -0,0 +1,31 @@
+#include "quiet.h"
+
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define NULL_DEVICE "NUL"
+#else
+#include <unistd.h>
+#define NULL_DEVICE "/dev/null"
+#endif
+
+static int saved_stdout = -1;
+
+void quiet_begin() {
+    fflush(stdout);
+    saved_stdout = dup(fileno(stdout));
+    if (!freopen(NULL_DEVICE, "w", stdout))
+        fprintf(stderr, "Can't open %s\n", NULL_DEVICE);
+}
+
+void quiet_end() {
+    fflush(stdout);
+    if (saved_stdout >= 0) {
+        dup2(saved_stdout, fileno(stdout));
+        close(saved_stdout);
+        saved_stdout = -1;
+    }
+}
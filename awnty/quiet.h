@@ -0,0 +1,10 @@
+#ifndef QUIET_H
+#define QUIET_H
+
+// Tools that run the emulator send its output to the null device while it
+// runs, so that it doesn't get mixed up with their own
+
+void quiet_begin();
+void quiet_end();
+
+#endif
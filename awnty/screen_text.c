@@ -0,0 +1,93 @@
+#include "screen_text.h"
+#include "vt100_memory.h"
+
+#include <string.h>
+
+// Firmware locations for the blinking cursor, which is drawn by flipping the
+// character and attribute at the cursor address
+static const uint16_t LOC_CURSOR_ADDRESS = 0x20f6;
+static const uint16_t LOC_CURS_CHAR_REND = 0x2159;
+static const uint16_t LOC_CURS_ATTR_REND = 0x215a;
+static const uint16_t LOC_CURSOR_VISIBLE = 0x21ba;
+
+static const char attr_chars[] = ".123456789abcdefghijklmnopqrstuv";
+
+// Like the DMA reads in sdl_screen, but without marking coverage
+static uint16_t link_address(uint16_t addr) {
+    return (memory[addr] << 8) | memory[(addr + 1) & 0xffff];
+}
+
+// Glyphs 01-1f are the special graphics, which are shown as the characters
+// that select them (` to ~)
+static char text_char(uint8_t code) {
+    code &= 0x7f;
+    if (code == 0)
+        return ' ';
+    if (code < 0x20)
+        return code + 0x5f;
+    return code;
+}
+
+int screen_text_read(screen_text_row *rows, bool have_avo) {
+    // The first line, at 0x2000 itself, is above the top of the screen
+    uint16_t addr = 0x2000;
+    uint16_t dmad = link_address(addr + 1);
+    // Read through the cursor, so that checks don't depend on its blink phase
+    uint16_t cursor = memory[LOC_CURSOR_ADDRESS] | memory[LOC_CURSOR_ADDRESS + 1] << 8;
+    bool cursor_on = memory[LOC_CURSOR_VISIBLE] != 0;
+    int nrows;
+    for (nrows = -1; nrows < SCREEN_TEXT_ROWS; ++nrows) {
+        uint8_t line_attr = dmad >> 12;
+        addr = 0x2000 | (dmad & 0xfff);
+        screen_text_row *row = nrows >= 0 ? &rows[nrows] : NULL;
+        int n = 0;
+        uint8_t ch;
+        while (n < 255 && (ch = memory[addr]) != 0x7f) {
+            if (row && n < SCREEN_TEXT_COLS) {
+                uint8_t avo = have_avo ? memory[addr + 0x1000] & 0x0f : 0x0f;
+                if (cursor_on && addr == cursor) {
+                    ch ^= memory[LOC_CURS_CHAR_REND];
+                    avo ^= have_avo ? memory[LOC_CURS_ATTR_REND] & 0x0f : 0;
+                }
+                int attr = (~avo & 0x0f) | ((ch & 0x80) ? SCREEN_ATTR_BASE : 0);
+                row->text[n] = text_char(ch);
+                row->attrs[n] = attr_chars[attr];
+            }
+            ++n;
+            addr = 0x2000 | ((addr + 1) & 0xfff);
+        }
+        if (n == 255) // no terminator, so the chain is broken
+            break;
+        if (row) {
+            if (n > SCREEN_TEXT_COLS)
+                n = SCREEN_TEXT_COLS;
+            row->line_attr = line_attr;
+            row->len = n;
+            row->text[n] = 0;
+            row->attrs[n] = 0;
+        }
+        dmad = link_address(addr + 1);
+    }
+    return nrows < 0 ? 0 : nrows;
+}
+
+// FNV-1a
+uint64_t screen_text_hash(const screen_text_row *rows, int nrows) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int r = 0; r < nrows; ++r) {
+        h = (h ^ rows[r].line_attr) * 0x100000001b3ULL;
+        for (int i = 0; i < rows[r].len; ++i) {
+            h = (h ^ (uint8_t)rows[r].text[i]) * 0x100000001b3ULL;
+            h = (h ^ (uint8_t)rows[r].attrs[i]) * 0x100000001b3ULL;
+        }
+        h = (h ^ 0x7f) * 0x100000001b3ULL; // line terminator
+    }
+    return h;
+}
+
+int screen_text_trimmed(const char *text) {
+    int len = strlen(text);
+    while (len > 0 && text[len - 1] == ' ')
+        --len;
+    return len;
+}
@@ -0,0 +1,37 @@
+#ifndef SCREEN_TEXT_H
+#define SCREEN_TEXT_H
+
+// Text and attributes of the screen, read by following the video RAM line
+// chain from 0x2000 as the video processor's DMA does, so that scripts can
+// check what's displayed without rendering anything. The cursor is left out,
+// so that what's read doesn't depend on its blink phase.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SCREEN_TEXT_ROWS 24
+#define SCREEN_TEXT_COLS 132
+
+// Each attribute is shown as a character: '.' for none, otherwise a digit or
+// letter (base 32) of these bits
+#define SCREEN_ATTR_BLINK 1
+#define SCREEN_ATTR_UNDERLINE 2
+#define SCREEN_ATTR_BOLD 4
+#define SCREEN_ATTR_ALT 8       // alternate character ROM
+#define SCREEN_ATTR_BASE 16     // bit 7 of the character: reverse or underline, per DC012
+
+typedef struct screen_text_row {
+    uint8_t line_attr;          // top 4 bits of the address that linked to this line
+    int len;
+    char text[SCREEN_TEXT_COLS + 1];
+    char attrs[SCREEN_TEXT_COLS + 1];
+} screen_text_row;
+
+// Reads up to SCREEN_TEXT_ROWS rows, returning how many could be followed
+int screen_text_read(screen_text_row *rows, bool have_avo);
+uint64_t screen_text_hash(const screen_text_row *rows, int nrows);
+
+// Length of the row's text without trailing spaces
+int screen_text_trimmed(const char *text);
+
+#endif
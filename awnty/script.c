@@ -0,0 +1,530 @@
+#include "script.h"
+#include "hooks.h"
+#include "screen_text.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char magic[8] = "AWNTYSC1";
+
+#define HEADER_SIZE 7
+
+static int errors;
+
+static void script_error(const char *name, int line, const char *fmt, ...) {
+    va_list args;
+    fprintf(stderr, "%s:%d: ", name, line);
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+    ++errors;
+}
+
+static bool grow(script *s, size_t more) {
+    if (s->len + more <= s->alloc)
+        return true;
+    size_t new_alloc = s->alloc ? 2 * s->alloc : 4096;
+    while (new_alloc < s->len + more)
+        new_alloc *= 2;
+    uint8_t *grown = realloc(s->data, new_alloc);
+    if (!grown) {
+        fputs("Couldn't grow compiled script\n", stderr);
+        return false;
+    }
+    s->data = grown;
+    s->alloc = new_alloc;
+    return true;
+}
+
+static void emit(script *s, int opcode, int line, const uint8_t *payload, int payload_len, const char *text) {
+    int text_len = strlen(text) + 1;
+    if (!grow(s, HEADER_SIZE + payload_len + text_len))
+        return;
+    uint8_t *p = &s->data[s->len];
+    p[0] = opcode;
+    p[1] = line & 0xff;
+    p[2] = line >> 8;
+    p[3] = payload_len & 0xff;
+    p[4] = payload_len >> 8;
+    p[5] = text_len & 0xff;
+    p[6] = text_len >> 8;
+    memcpy(&p[HEADER_SIZE], payload, payload_len);
+    memcpy(&p[HEADER_SIZE + payload_len], text, text_len);
+    s->len += HEADER_SIZE + payload_len + text_len;
+}
+
+static int put_u16(uint8_t *p, int n, uint16_t v) {
+    p[n] = v & 0xff;
+    p[n + 1] = v >> 8;
+    return n + 2;
+}
+
+static int put_u32(uint8_t *p, int n, uint32_t v) {
+    n = put_u16(p, n, v & 0xffff);
+    return put_u16(p, n, v >> 16);
+}
+
+// Hex pairs, separated by spaces or commas. Anything after them is commentary.
+static int parse_key(const char *args, uint8_t *hex, int maxhex) {
+    int nhex = 0;
+    int idx = 0;
+    while (nhex <= maxhex) {
+        while (args[idx] == ' ' || args[idx] == ',')
+            ++idx;
+        if (isxdigit((unsigned char)args[idx]) && isxdigit((unsigned char)args[idx + 1])) {
+            char strhex[3] = { args[idx], args[idx + 1], 0 };
+            if (nhex < maxhex)
+                hex[nhex] = strtol(strhex, NULL, 16);
+            ++nhex;
+            idx += 2;
+        }
+        else
+            break;
+    }
+    return nhex;
+}
+
+// As keys, but also "quoted text". Returns more than maxhex if it doesn't fit,
+// and -1 if a quote isn't closed.
+static int parse_serial(const char *args, uint8_t *hex, int maxhex) {
+    int nhex = 0;
+    size_t idx = 0;
+    size_t len = strlen(args);
+    while (nhex <= maxhex) {
+        while (args[idx] == ' ' || args[idx] == ',')
+            ++idx;
+        if (isxdigit((unsigned char)args[idx]) && isxdigit((unsigned char)args[idx + 1])) {
+            char strhex[3] = { args[idx], args[idx + 1], 0 };
+            if (nhex < maxhex)
+                hex[nhex] = strtol(strhex, NULL, 16);
+            ++nhex;
+            idx += 2;
+        }
+        else if (args[idx] == '"') {
+            while (++idx < len && args[idx] != '"' && args[idx] != '\n' && args[idx] != '\r') {
+                if (nhex < maxhex)
+                    hex[nhex] = args[idx];
+                ++nhex;
+            }
+            if (args[idx] != '"')
+                return -1;
+            ++idx;
+            if (idx >= len)
+                break;
+        }
+        else
+            break;
+    }
+    return nhex;
+}
+
+// Decimal number, which must be present. Anything after it is commentary.
+static bool parse_number(const char *args, unsigned long *value) {
+    while (*args == ' ')
+        ++args;
+    if (!isdigit((unsigned char)*args))
+        return false;
+    *value = strtoul(args, NULL, 10);
+    return true;
+}
+
+static int parse_option(const char *args) {
+    if (strncmp(args, "avo", 3) == 0)
+        return OPTION_AVO;
+    if (strncmp(args, "gpo", 3) == 0)
+        return OPTION_GPO;
+    if (strncmp(args, "stp", 3) == 0)
+        return OPTION_STP;
+    if (strncmp(args, "loopback", 8) == 0)
+        return OPTION_LOOPBACK;
+    return -1;
+}
+
+static int parse_bug(const char *args) {
+    if (strncmp(args, "nvr", 3) == 0)
+        return BUG_NVR;
+    if (strncmp(args, "ram", 3) == 0)
+        return BUG_RAM;
+    if (strncmp(args, "pusart", 6) == 0)
+        return BUG_PUSART;
+    return -1;
+}
+
+static void compile_line(script *s, const char *name, int line, const char *text) {
+    uint8_t payload[512];
+    int n = 0;
+    unsigned long value;
+    char word[20];
+    int wlen = 0;
+
+    while (text[wlen] && !isspace((unsigned char)text[wlen]) && wlen < (int)sizeof(word) - 1) {
+        word[wlen] = text[wlen];
+        ++wlen;
+    }
+    word[wlen] = 0;
+    const char *args = &text[wlen];
+    while (*args == ' ' || *args == '\t')
+        ++args;
+
+    if (word[0] == 0 || word[0] == '#' || strcmp(word, "log") == 0) {
+        emit(s, CMD_NOTE, line, payload, 0, text);
+    }
+    else if (strcmp(word, "key") == 0) {
+        n = parse_key(args, payload, SCRIPT_MAX_KEYS);
+        if (n == 0)
+            script_error(name, line, "key needs hex key codes");
+        else if (n > SCRIPT_MAX_KEYS)
+            script_error(name, line, "more than %d keys at once", SCRIPT_MAX_KEYS);
+        else
+            emit(s, CMD_KEY, line, payload, n, text);
+    }
+    else if (strcmp(word, "serial") == 0) {
+        n = parse_serial(args, payload, SCRIPT_MAX_SERIAL);
+        if (n < 0)
+            script_error(name, line, "serial text has no closing quote");
+        else if (n == 0)
+            script_error(name, line, "serial needs hex bytes or \"text\"");
+        else if (n > SCRIPT_MAX_SERIAL)
+            script_error(name, line, "more than %d bytes of serial data", SCRIPT_MAX_SERIAL);
+        else
+            emit(s, CMD_SERIAL, line, payload, n, text);
+    }
+    else if (strcmp(word, "serial-file") == 0) {
+        while (args[n] && !isspace((unsigned char)args[n]) && n < 255) {
+            payload[n] = args[n];
+            ++n;
+        }
+        payload[n++] = 0;
+        if (n == 1)
+            script_error(name, line, "serial-file needs a path");
+        else
+            emit(s, CMD_SERIAL_FILE, line, payload, n, text);
+    }
+    else if (strcmp(word, "pause") == 0) {
+        if (!parse_number(args, &value))
+            script_error(name, line, "pause needs a number of cycles");
+        else if (value == 0) // as before, a zero pause is no pause
+            emit(s, CMD_NOTE, line, payload, 0, text);
+        else
+            emit(s, CMD_PAUSE, line, payload, put_u32(payload, 0, value), text);
+    }
+    else if (strcmp(word, "keygap") == 0) {
+        if (!parse_number(args, &value))
+            script_error(name, line, "keygap needs a number");
+        else
+            emit(s, CMD_KEYGAP, line, payload, put_u32(payload, 0, value), text);
+    }
+    else if (strcmp(word, "rxgap") == 0) {
+        if (strncmp(args, "baud", 4) == 0) {
+            double baud = strtod(&args[4], NULL);
+            emit(s, CMD_RXBAUD, line, payload, put_u32(payload, 0, (uint32_t)(baud * 10 + 0.5)), text);
+        }
+        else if (!parse_number(args, &value))
+            script_error(name, line, "rxgap needs a number of cycles, or baud [rate]");
+        else
+            emit(s, CMD_RXGAP, line, payload, put_u32(payload, 0, value), text);
+    }
+    else if (strcmp(word, "reset") == 0) {
+        emit(s, CMD_RESET, line, payload, 0, text);
+    }
+    else if (strcmp(word, "local") == 0) {
+        emit(s, CMD_LOCAL, line, payload, 0, text);
+    }
+    else if (strcmp(word, "online") == 0) {
+        emit(s, CMD_ONLINE, line, payload, 0, text);
+    }
+    else if (strcmp(word, "dumpx") == 0) {
+        emit(s, CMD_DUMPX, line, payload, 0, text);
+    }
+    else if (strcmp(word, "switches") == 0) {
+        emit(s, CMD_SWITCHES, line, payload, 0, text);
+    }
+    else if (strcmp(word, "stack") == 0) {
+        emit(s, CMD_STACK, line, payload, 0, text);
+    }
+    else if (strcmp(word, "dump") == 0) {
+        uint16_t addr;
+        uint8_t len;
+        if (sscanf(args, "%hx,%hhx", &addr, &len) != 2)
+            script_error(name, line, "dump needs <addr>,<len>");
+        else {
+            n = put_u16(payload, 0, addr);
+            payload[n++] = len;
+            emit(s, CMD_DUMP, line, payload, n, text);
+        }
+    }
+    else if (strcmp(word, "poke") == 0) {
+        uint16_t addr;
+        uint8_t val;
+        if (sscanf(args, "%4hx,%2hhx", &addr, &val) != 2)
+            script_error(name, line, "poke needs <addr>,<value>");
+        else {
+            n = put_u16(payload, 0, addr);
+            payload[n++] = val;
+            emit(s, CMD_POKE, line, payload, n, text);
+        }
+    }
+    else if (strcmp(word, "covrw") == 0) {
+        uint16_t addr, len;
+        if (sscanf(args, "%4hx,%4hx", &addr, &len) != 2)
+            script_error(name, line, "covrw needs <addr>,<len>");
+        else {
+            n = put_u16(payload, 0, addr);
+            emit(s, CMD_COVRW, line, payload, put_u16(payload, n, len), text);
+        }
+    }
+    else if (strcmp(word, "watch") == 0) {
+        uint16_t addr;
+        int interp = 0;
+        if (sscanf(args, "%4hx,%d", &addr, &interp) < 1)
+            script_error(name, line, "watch needs <addr>[,<interp>]");
+        else {
+            n = put_u16(payload, 0, addr);
+            payload[n++] = interp;
+            emit(s, CMD_WATCH, line, payload, n, text);
+        }
+    }
+    else if (strcmp(word, "have") == 0 || strcmp(word, "missing") == 0) {
+        int option = parse_option(args);
+        if (option < 0)
+            script_error(name, line, "%s needs avo, gpo, stp or loopback", word);
+        else {
+            payload[n++] = option;
+            emit(s, word[0] == 'h' ? CMD_HAVE : CMD_MISSING, line, payload, n, text);
+        }
+    }
+    else if (strcmp(word, "bug") == 0 || strcmp(word, "nobug") == 0) {
+        int bug = parse_bug(args);
+        if (bug < 0)
+            script_error(name, line, "%s needs nvr, ram or pusart", word);
+        else {
+            payload[n++] = bug;
+            emit(s, word[0] == 'b' ? CMD_BUG : CMD_NOBUG, line, payload, n, text);
+        }
+    }
+    else if (strcmp(word, "break") == 0 || strcmp(word, "trace") == 0) {
+        // break <sym|addr> [cond]
+        // trace <sym|addr> [cond]
+        char where[50];
+        char cond_text[50];
+        hook_cond cond = { HOOK_NONE, 0, 0, 0 };
+        int fields = sscanf(args, "%49s %49s", where, cond_text);
+        int addr = fields >= 1 ? hook_parse_addr(where) : -1;
+        if (addr < 0)
+            script_error(name, line, "%s needs a ROM symbol or address", word);
+        else if (fields == 2 && cond_text[0] != '#' && !hook_parse_cond(cond_text, &cond))
+            script_error(name, line, "can't understand condition '%s'", cond_text);
+        else {
+            n = put_u16(payload, 0, addr);
+            payload[n++] = cond.operand;
+            n = put_u16(payload, n, cond.mem_addr);
+            payload[n++] = cond.op;
+            n = put_u16(payload, n, cond.value);
+            strcpy((char *)&payload[n], where);
+            n += strlen(where) + 1;
+            emit(s, word[0] == 'b' ? CMD_BREAK : CMD_TRACE, line, payload, n, text);
+        }
+    }
+    else if (strcmp(word, "snapshot") == 0) {
+        if (!parse_number(args, &value))
+            script_error(name, line, "snapshot needs a number of frames");
+        else
+            emit(s, CMD_SNAPSHOT, line, payload, put_u32(payload, 0, value), text);
+    }
+    else if (strcmp(word, "rewind") == 0) {
+        if (!parse_number(args, &value))
+            script_error(name, line, "rewind needs a number of cycles");
+        else
+            emit(s, CMD_REWIND, line, payload, put_u32(payload, 0, value), text);
+    }
+    else if (strcmp(word, "expect-screen") == 0) {
+        // expect-screen                    show rows and hash
+        // expect-screen <row> "text"
+        // expect-screen <row> attr "attrs"
+        // expect-screen hash <hex>
+        unsigned row = 0;
+        int used = 0;
+        const char *open, *close;
+        if (args[0] == 0 || args[0] == '\n' || args[0] == '#') {
+            payload[n++] = EXPECT_SHOW;
+            payload[n++] = 0;
+            emit(s, CMD_EXPECT_SCREEN, line, payload, n, text);
+        }
+        else if (strncmp(args, "hash ", 5) == 0) {
+            unsigned long long hash;
+            if (sscanf(&args[5], "%llx", &hash) != 1)
+                script_error(name, line, "expect-screen hash needs a hex value");
+            else {
+                payload[n++] = EXPECT_HASH;
+                payload[n++] = 0;
+                n = put_u32(payload, n, hash & 0xffffffff);
+                emit(s, CMD_EXPECT_SCREEN, line, payload, put_u32(payload, n, hash >> 32), text);
+            }
+        }
+        else if (sscanf(args, "%u%n", &row, &used) != 1 || row < 1 || row > SCREEN_TEXT_ROWS)
+            script_error(name, line, "expect-screen needs a row from 1 to %d, or hash", SCREEN_TEXT_ROWS);
+        // Text is everything between the first and last quotes
+        else if ((open = strchr(&args[used], '"')) == NULL || (close = strrchr(open + 1, '"')) == NULL
+                || close - open - 1 > SCREEN_TEXT_COLS)
+            script_error(name, line, "expect-screen needs \"text\" of up to %d characters", SCREEN_TEXT_COLS);
+        else {
+            const char *kind = &args[used];
+            while (*kind == ' ')
+                ++kind;
+            payload[n++] = strncmp(kind, "attr", 4) == 0 ? EXPECT_ATTR : EXPECT_TEXT;
+            payload[n++] = row;
+            memcpy(&payload[n], open + 1, close - open - 1);
+            n += close - open - 1;
+            payload[n++] = 0;
+            emit(s, CMD_EXPECT_SCREEN, line, payload, n, text);
+        }
+    }
+    else if (strcmp(word, "screenshot") == 0) {
+        char path[256];
+        if (sscanf(args, "%255s", path) != 1 || path[0] == '#')
+            script_error(name, line, "screenshot needs a file name");
+        else {
+            strcpy((char *)payload, path);
+            emit(s, CMD_SCREENSHOT, line, payload, strlen(path) + 1, text);
+        }
+    }
+    else if (strcmp(word, "record") == 0) {
+        char path[256];
+        unsigned frames;
+        if (sscanf(args, "%255s %u", path, &frames) != 2 || frames == 0)
+            script_error(name, line, "record needs <file> <frames>");
+        else {
+            n = put_u32(payload, 0, frames);
+            strcpy((char *)&payload[n], path);
+            emit(s, CMD_RECORD, line, payload, n + strlen(path) + 1, text);
+        }
+    }
+    else if (strcmp(word, "frames-save") == 0 || strcmp(word, "frames-check") == 0) {
+        // frames-save <dir> <frames>
+        // frames-check <dir> <frames> [tolerance]
+        char dir[256];
+        unsigned frames, tolerance = 0;
+        if (sscanf(args, "%255s %u %u", dir, &frames, &tolerance) < 2 || frames == 0)
+            script_error(name, line, "%s needs <dir> <frames>", word);
+        else {
+            payload[n++] = word[7] == 's';
+            n = put_u32(payload, n, frames);
+            n = put_u32(payload, n, tolerance);
+            strcpy((char *)&payload[n], dir);
+            emit(s, CMD_FRAMES, line, payload, n + strlen(dir) + 1, text);
+        }
+    }
+    else if (strcmp(word, "wait-idle") == 0 || strcmp(word, "wait-scroll-done") == 0 ||
+             strcmp(word, "wait-rx-empty") == 0) {
+        payload[n++] = word[5] == 'i' ? WAIT_IDLE : word[5] == 's' ? WAIT_SCROLL : WAIT_RX_EMPTY;
+        emit(s, CMD_WAIT, line, payload, put_u32(payload, n, 0), text);
+    }
+    else if (strcmp(word, "wait-frame") == 0) {
+        if (!parse_number(args, &value) || value == 0)
+            script_error(name, line, "wait-frame needs a number of frames");
+        else {
+            payload[n++] = WAIT_FRAME;
+            emit(s, CMD_WAIT, line, payload, put_u32(payload, n, value), text);
+        }
+    }
+    else {
+        script_error(name, line, "unknown command '%s'", word);
+    }
+}
+
+bool script_compile(script *s, FILE *f, const char *name) {
+    char buffer[4096];
+    int line = 0;
+    errors = 0;
+    while (fgets(buffer, sizeof(buffer), f) != NULL)
+        compile_line(s, name, ++line, buffer);
+    if (errors > 0)
+        fprintf(stderr, "%s: %d error%s\n", name, errors, errors == 1 ? "" : "s");
+    return errors == 0;
+}
+
+// Check every record fits, so script_next needn't
+static bool script_valid(const script *s) {
+    size_t pos = 0;
+    while (pos + HEADER_SIZE <= s->len) {
+        const uint8_t *p = &s->data[pos];
+        size_t payload_len = p[3] | p[4] << 8;
+        size_t text_len = p[5] | p[6] << 8;
+        if (text_len == 0 || pos + HEADER_SIZE + payload_len + text_len > s->len)
+            return false;
+        if (p[HEADER_SIZE + payload_len + text_len - 1] != 0)
+            return false;
+        pos += HEADER_SIZE + payload_len + text_len;
+    }
+    return pos == s->len;
+}
+
+bool script_load(script *s, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Can't open script '%s'\n", path);
+        return false;
+    }
+    char header[sizeof(magic)];
+    bool ok;
+    if (fread(header, 1, sizeof(header), f) == sizeof(header) && memcmp(header, magic, sizeof(magic)) == 0) {
+        uint8_t chunk[4096];
+        size_t got;
+        ok = true;
+        while (ok && (got = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+            ok = grow(s, got);
+            if (ok) {
+                memcpy(&s->data[s->len], chunk, got);
+                s->len += got;
+            }
+        }
+        if (ok && !script_valid(s)) {
+            fprintf(stderr, "%s: corrupt compiled script\n", path);
+            ok = false;
+        }
+    }
+    else {
+        rewind(f);
+        ok = script_compile(s, f, path);
+    }
+    fclose(f);
+    s->pos = 0;
+    return ok;
+}
+
+bool script_save(const script *s, const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Can't create '%s'\n", path);
+        return false;
+    }
+    bool ok = fwrite(magic, 1, sizeof(magic), f) == sizeof(magic)
+           && fwrite(s->data, 1, s->len, f) == s->len;
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Couldn't write '%s'\n", path);
+        return false;
+    }
+    return true;
+}
+
+void script_free(script *s) {
+    free(s->data);
+    s->data = NULL;
+    s->len = s->alloc = s->pos = 0;
+}
+
+bool script_next(script *s, script_cmd *cmd) {
+    if (s->pos + HEADER_SIZE > s->len)
+        return false;
+    const uint8_t *p = &s->data[s->pos];
+    cmd->opcode = p[0];
+    cmd->line = p[1] | p[2] << 8;
+    cmd->payload_len = p[3] | p[4] << 8;
+    cmd->payload = &p[HEADER_SIZE];
+    cmd->text = (const char *)&p[HEADER_SIZE + cmd->payload_len];
+    s->pos += HEADER_SIZE + cmd->payload_len + (p[5] | p[6] << 8);
+    return true;
+}
@@ -0,0 +1,109 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+// Test scripts are compiled before the run into a compact stream of commands,
+// so the run loop never parses text, and a mistake anywhere in a script is
+// reported with its line number before anything runs.
+//
+// Each command is a record of
+//   opcode (1 byte), source line (2), payload length (2), text length (2),
+//   payload, source text
+// with numbers little-endian. The source text is only kept for echoing each
+// command as it executes. A compiled script can be saved and loaded again.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Payloads are listed after each opcode
+enum {
+    CMD_NOTE,           // comment, blank line or log: echoed only
+    CMD_KEY,            // key codes
+    CMD_RESET,
+    CMD_KEYGAP,         // u32 pause between key scans
+    CMD_RXGAP,          // u32 cycles between received characters
+    CMD_RXBAUD,         // u32 forced line speed in tenths of a baud, 0 for programmed speed
+    CMD_SERIAL,         // bytes to receive
+    CMD_SERIAL_FILE,    // path
+    CMD_PAUSE,          // u32 cycles
+    CMD_LOCAL,
+    CMD_ONLINE,
+    CMD_DUMP,           // u16 addr, u8 length
+    CMD_DUMPX,
+    CMD_SWITCHES,
+    CMD_HAVE,           // u8 OPTION_*
+    CMD_MISSING,        // u8 OPTION_*
+    CMD_BUG,            // u8 BUG_*
+    CMD_NOBUG,          // u8 BUG_*
+    CMD_POKE,           // u16 addr, u8 value
+    CMD_COVRW,          // u16 addr, u16 length
+    CMD_WATCH,          // u16 addr, u8 interpretation
+    CMD_STACK,
+    CMD_BREAK,          // u16 addr, u8 operand, u16 mem addr, u8 comparison, u16 value, name
+    CMD_TRACE,          // as CMD_BREAK
+    CMD_SNAPSHOT,       // u32 frames
+    CMD_REWIND,         // u32 cycles
+    CMD_EXPECT_SCREEN,  // u8 EXPECT_*, u8 row, then u32 low, u32 high hash or text
+    CMD_SCREENSHOT,     // path
+    CMD_RECORD,         // u32 frames, path
+    CMD_FRAMES,         // u8 save, u32 frames, u32 tolerance, reference directory
+    CMD_WAIT,           // u8 WAIT_*, u32 frames
+};
+
+#define EXPECT_SHOW 0       // print the screen rows and hash, for writing checks
+#define EXPECT_TEXT 1
+#define EXPECT_ATTR 2
+#define EXPECT_HASH 3
+
+#define OPTION_AVO 0
+#define OPTION_GPO 1
+#define OPTION_STP 2
+#define OPTION_LOOPBACK 3
+
+#define WAIT_IDLE 0          // receiver drained and firmware back in idle_loop
+#define WAIT_SCROLL 1        // idle, with no scroll pending, in progress or to shuffle
+#define WAIT_RX_EMPTY 2      // nothing left to receive, firmware's buffer empty
+#define WAIT_FRAME 3         // that many vertical blanks
+
+#define BUG_NVR 0
+#define BUG_RAM 1
+#define BUG_PUSART 2
+
+#define SCRIPT_MAX_KEYS 4       // key_feed
+#define SCRIPT_MAX_SERIAL 100
+
+typedef struct script {
+    uint8_t *data;
+    size_t len, alloc;
+    size_t pos;         // next command
+} script;
+
+typedef struct script_cmd {
+    int opcode;
+    int line;
+    const uint8_t *payload;
+    int payload_len;
+    const char *text;   // source line, including its newline
+} script_cmd;
+
+// Compile script text. Every error is reported, as name:line, and the result
+// is false if there were any.
+bool script_compile(script *s, FILE *f, const char *name);
+// Load a compiled script, or compile a text one
+bool script_load(script *s, const char *path);
+bool script_save(const script *s, const char *path);
+void script_free(script *s);
+
+// Command at s->pos, advancing past it. Returns false at the end.
+bool script_next(script *s, script_cmd *cmd);
+
+static inline uint16_t script_u16(const script_cmd *cmd, int offset) {
+    return cmd->payload[offset] | cmd->payload[offset + 1] << 8;
+}
+
+static inline uint32_t script_u32(const script_cmd *cmd, int offset) {
+    return script_u16(cmd, offset) | (uint32_t)script_u16(cmd, offset + 2) << 16;
+}
+
+#endif
@@ -0,0 +1,147 @@
+#include "serial_stream.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define RING_SIZE 4096 // power of 2
+
+static FILE *stream = NULL;
+static bool stream_eof = false;
+static char stream_path[256];
+static long stream_consumed = 0;
+#ifndef _WIN32
+static int stdin_flags = -1; // as they were before we made reads not wait
+#endif
+
+static uint8_t ring[RING_SIZE];
+static unsigned ring_head = 0; // next byte to hand out
+static unsigned ring_tail = 0; // next free slot
+
+static unsigned ring_used() {
+    return (ring_tail - ring_head) & (RING_SIZE - 1);
+}
+
+// Top up the ring from the file, leaving one slot free to tell full from empty.
+// Standard input takes only what has arrived, so that a slow pipe doesn't hold
+// up the emulator until it has filled the ring.
+static void ring_fill() {
+    while (!stream_eof && ring_used() < RING_SIZE - 1) {
+        unsigned space = RING_SIZE - 1 - ring_used();
+        unsigned contig = RING_SIZE - ring_tail;
+        if (contig > space)
+            contig = space;
+#ifndef _WIN32
+        if (stream == stdin) {
+            ssize_t got = read(STDIN_FILENO, &ring[ring_tail], contig);
+            if (got > 0)
+                ring_tail = (ring_tail + got) & (RING_SIZE - 1);
+            else if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                stream_eof = true;
+            if (got < (ssize_t)contig)
+                return;
+            continue;
+        }
+#endif
+        size_t got = fread(&ring[ring_tail], 1, contig, stream);
+        ring_tail = (ring_tail + got) & (RING_SIZE - 1);
+        if (got < contig)
+            stream_eof = true;
+    }
+}
+
+bool serial_stream_open(const char *path) {
+    serial_stream_close();
+    if (strcmp(path, "-") == 0) {
+        stream = stdin;
+#ifndef _WIN32
+        stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
+        if (stdin_flags >= 0)
+            fcntl(STDIN_FILENO, F_SETFL, stdin_flags | O_NONBLOCK);
+#endif
+    }
+    else
+        stream = fopen(path, "rb");
+    if (!stream) {
+        fprintf(stderr, "Can't open serial stream '%s'\n", path);
+        return false;
+    }
+    snprintf(stream_path, sizeof(stream_path), "%s", path);
+    stream_eof = false;
+    stream_consumed = 0;
+    ring_head = ring_tail = 0;
+    ring_fill();
+    return true;
+}
+
+void serial_stream_close() {
+    if (stream && stream != stdin)
+        fclose(stream);
+#ifndef _WIN32
+    if (stream == stdin && stdin_flags >= 0)
+        fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+    stdin_flags = -1;
+#endif
+    stream = NULL;
+    ring_head = ring_tail = 0;
+}
+
+bool serial_stream_active() {
+    return stream != NULL;
+}
+
+bool serial_stream_more() {
+    if (stream != NULL && ring_used() == 0)
+        ring_fill();
+    return stream != NULL && ring_used() > 0;
+}
+
+bool serial_stream_ended() {
+    return stream != NULL && stream_eof && ring_used() == 0;
+}
+
+int serial_stream_next() {
+    if (!serial_stream_more())
+        return -1;
+    uint8_t val = ring[ring_head];
+    ring_head = (ring_head + 1) & (RING_SIZE - 1);
+    ++stream_consumed;
+    // Refill in large reads rather than a byte at a time
+    if (ring_used() < RING_SIZE / 2)
+        ring_fill();
+    return val;
+}
+
+void serial_stream_snapshot(serial_stream_snap *snap) {
+    snap->active = stream != NULL;
+    snprintf(snap->path, sizeof(snap->path), "%s", snap->active ? stream_path : "");
+    snap->consumed = stream_consumed;
+}
+
+// Reopen the stream and skip what had been consumed. Standard input can't be
+// rewound, so a snapshot of it can't be restored.
+void serial_stream_restore(const serial_stream_snap *snap) {
+    if (!snap->active) {
+        serial_stream_close();
+        return;
+    }
+    if (strcmp(snap->path, "-") == 0) {
+        fputs("Can't rewind a serial stream from standard input\n", stderr);
+        return;
+    }
+    if (!serial_stream_open(snap->path))
+        return;
+    if (fseek(stream, snap->consumed, SEEK_SET) != 0) {
+        fprintf(stderr, "Can't seek serial stream '%s'\n", snap->path);
+        return;
+    }
+    stream_eof = false;
+    ring_head = ring_tail = 0;
+    stream_consumed = snap->consumed;
+    ring_fill();
+}
@@ -0,0 +1,35 @@
+#ifndef SERIAL_STREAM_H
+#define SERIAL_STREAM_H
+
+// Stream received data from a file or pipe, through a bounded ring buffer, so
+// that large workloads can be fed to the terminal without going through the
+// test script.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Opens a file for streaming. A path of "-" streams standard input, which is
+// read without waiting for more than has arrived.
+bool serial_stream_open(const char *path);
+void serial_stream_close();
+
+bool serial_stream_active();
+// true if there is at least one byte ready. A pipe can have none ready for now
+// without having ended.
+bool serial_stream_more();
+// true once everything has been read
+bool serial_stream_ended();
+// Next byte, or -1 if there is none ready
+int serial_stream_next();
+
+// Stream position, for machine snapshots
+typedef struct serial_stream_snap {
+    bool active;
+    char path[256];
+    long consumed;
+} serial_stream_snap;
+
+void serial_stream_snapshot(serial_stream_snap *snap);
+void serial_stream_restore(const serial_stream_snap *snap);
+
+#endif
@@ -0,0 +1,183 @@
+#include "snapshot.h"
+
+#include "vt100_memory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct snap_page {
+    int refs;
+    uint8_t data[SNAP_PAGE_SIZE];
+} snap_page;
+
+typedef struct snapshot {
+    unsigned long cyc;
+    i8080 cpu;
+    snap_page *pages[SNAP_PAGES];
+    void *devices;
+    size_t log_index;
+} snapshot;
+
+static snapshot *snaps = NULL;
+static int max_snaps = 0;
+static int num_snaps = 0;
+static int oldest_snap = 0; // ring buffer, so oldest is overwritten first
+static size_t snap_device_size = 0;
+static size_t pages_in_use = 0;
+
+typedef struct input_entry {
+    unsigned long cyc;
+    size_t input;
+} input_entry;
+
+static input_entry *input_log = NULL;
+static size_t input_count = 0;
+static size_t input_alloc = 0;
+
+static void page_release(snap_page *page) {
+    if (page && --page->refs == 0) {
+        free(page);
+        --pages_in_use;
+    }
+}
+
+static void snapshot_release(snapshot *s) {
+    for (int p = 0; p < SNAP_PAGES; ++p) {
+        page_release(s->pages[p]);
+        s->pages[p] = NULL;
+    }
+}
+
+void snapshot_init(size_t device_size, int max_snapshots) {
+    snapshot_free();
+    snaps = calloc(max_snapshots, sizeof(snapshot));
+    if (!snaps) {
+        fputs("Couldn't allocate snapshots\n", stderr);
+        return;
+    }
+    for (int s = 0; s < max_snapshots; ++s) {
+        snaps[s].devices = malloc(device_size);
+    }
+    max_snaps = max_snapshots;
+    snap_device_size = device_size;
+}
+
+void snapshot_free() {
+    for (int s = 0; s < max_snaps; ++s) {
+        snapshot_release(&snaps[s]);
+        free(snaps[s].devices);
+    }
+    free(snaps);
+    snaps = NULL;
+    max_snaps = num_snaps = oldest_snap = 0;
+
+    free(input_log);
+    input_log = NULL;
+    input_count = input_alloc = 0;
+}
+
+void snapshot_take(const i8080 *c, const void *devices, size_t log_index) {
+    if (max_snaps == 0)
+        return;
+
+    // Newest snapshot, which we'll try to share pages with
+    const snapshot *prev = num_snaps > 0 ? &snaps[(oldest_snap + num_snaps - 1) % max_snaps] : NULL;
+    snapshot *s;
+    if (num_snaps < max_snaps) {
+        s = &snaps[(oldest_snap + num_snaps) % max_snaps];
+        ++num_snaps;
+    }
+    else {
+        s = &snaps[oldest_snap];
+        oldest_snap = (oldest_snap + 1) % max_snaps;
+    }
+    // prev may be the slot we're about to reuse only if max_snaps is 1, in which
+    // case there is no sharing to be had.
+    if (prev == s)
+        prev = NULL;
+
+    snap_page *pages[SNAP_PAGES];
+    for (int p = 0; p < SNAP_PAGES; ++p) {
+        const uint8_t *mem = &memory[p * SNAP_PAGE_SIZE];
+        if (prev && memcmp(prev->pages[p]->data, mem, SNAP_PAGE_SIZE) == 0) {
+            pages[p] = prev->pages[p];
+            ++pages[p]->refs;
+        }
+        else {
+            pages[p] = malloc(sizeof(snap_page));
+            if (!pages[p]) {
+                fputs("Couldn't allocate snapshot page\n", stderr);
+                exit(1);
+            }
+            pages[p]->refs = 1;
+            memcpy(pages[p]->data, mem, SNAP_PAGE_SIZE);
+            ++pages_in_use;
+        }
+    }
+    snapshot_release(s);
+    memcpy(s->pages, pages, sizeof(pages));
+
+    s->cyc = c->cyc;
+    s->cpu = *c;
+    memcpy(s->devices, devices, snap_device_size);
+    s->log_index = log_index;
+}
+
+bool snapshot_restore(unsigned long cyc, i8080 *c, void *devices, size_t *log_index) {
+    // Snapshots taken while replaying after a rewind come after those from
+    // the same stretch first time round, so the newest isn't the nearest
+    const snapshot *best = NULL;
+    for (int n = 0; n < num_snaps; ++n) {
+        const snapshot *s = &snaps[(oldest_snap + n) % max_snaps];
+        if (s->cyc <= cyc && (!best || s->cyc >= best->cyc))
+            best = s;
+    }
+    if (!best)
+        return false;
+
+    for (int p = 0; p < SNAP_PAGES; ++p)
+        memcpy(&memory[p * SNAP_PAGE_SIZE], best->pages[p]->data, SNAP_PAGE_SIZE);
+    // Keep the live coverage and branch maps, which only ever accumulate, and
+    // the live decode cache, which the caller clears
+    i8080_restore_state(c, &best->cpu);
+    memcpy(devices, best->devices, snap_device_size);
+    *log_index = best->log_index;
+    return true;
+}
+
+int snapshot_count() {
+    return num_snaps;
+}
+
+size_t snapshot_pages_in_use() {
+    return pages_in_use;
+}
+
+void inputlog_record(unsigned long cyc, size_t input) {
+    if (input_count == input_alloc) {
+        size_t new_alloc = input_alloc ? 2 * input_alloc : 256;
+        input_entry *grown = realloc(input_log, new_alloc * sizeof(input_entry));
+        if (!grown) {
+            fputs("Couldn't grow input log\n", stderr);
+            return;
+        }
+        input_log = grown;
+        input_alloc = new_alloc;
+    }
+    input_log[input_count].cyc = cyc;
+    input_log[input_count].input = input;
+    ++input_count;
+}
+
+size_t inputlog_count() {
+    return input_count;
+}
+
+size_t inputlog_entry(size_t index, unsigned long *cyc) {
+    if (index >= input_count)
+        return 0;
+    if (cyc)
+        *cyc = input_log[index].cyc;
+    return input_log[index].input;
+}
@@ -0,0 +1,44 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "i8080.h"
+
+// Periodic machine snapshots and a log of the inputs that drove the machine,
+// so that a run can be rewound and re-executed deterministically.
+//
+// Memory is held as pages, and a page that hasn't changed since the previous
+// snapshot is shared with it rather than copied, so snapshots of a terminal
+// that is mostly redrawing the same screen cost very little.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SNAP_PAGE_SIZE 256
+#define SNAP_PAGES (0x10000 / SNAP_PAGE_SIZE)
+
+// device_size is the size of the opaque block of peripheral state that the
+// caller wants saved alongside the CPU and memory.
+void snapshot_init(size_t device_size, int max_snapshots);
+void snapshot_free();
+
+// log_index is the input log position the machine has reached: while commands
+// are replayed after a rewind, that is short of the end of the log.
+void snapshot_take(const i8080 *c, const void *devices, size_t log_index);
+
+// Restore the snapshot nearest before or at cycle cyc. On success, returns
+// true and sets *log_index to the input log position at the time of the snapshot.
+// The CPU's coverage and branch maps and decode cache are kept, not restored.
+bool snapshot_restore(unsigned long cyc, i8080 *c, void *devices, size_t *log_index);
+
+int snapshot_count();
+size_t snapshot_pages_in_use();
+
+// Input log. Every input fed to the machine is recorded with the cycle it was
+// consumed at, so a rewound machine can be fed the same inputs again. An input
+// is the position of a command in the compiled script.
+void inputlog_record(unsigned long cyc, size_t input);
+size_t inputlog_count();
+size_t inputlog_entry(size_t index, unsigned long *cyc);
+
+#endif
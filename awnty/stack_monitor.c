@@ -0,0 +1,161 @@
+#include "stack_monitor.h"
+
+#include "coverage.h"
+#include "vt100_memory.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_FRAMES 64       // deeper calls aren't followed, but unwind correctly
+#define MAX_LEVELS 4        // interrupt nesting beyond this counts as the last
+#define DEEPEST_ROUTINES 10
+
+typedef struct frame {
+    uint16_t entry;     // where the call or interrupt went
+    uint16_t from;      // the call, or the instruction interrupted
+    uint16_t sp;        // where the return address is
+    bool interrupt;
+} frame;
+
+bool stack_monitor_active = false;
+
+static frame frames[MAX_FRAMES];
+static int depth;
+static int level;       // interrupt frames in the shadow stack
+static bool armed;
+static bool below;      // SP is below STACK_BOTTOM, and has been reported
+static int alerts;
+
+static uint16_t lowest_sp;
+static uint16_t lowest_entry;
+static unsigned long lowest_cyc;
+static uint16_t min_sp_level[MAX_LEVELS];
+static uint16_t min_sp_routine[0x2000]; // by entry; 0 for code outside any call
+
+static uint16_t before_pc, before_sp;
+static bool before_interrupt;
+
+void stack_monitor_start() {
+    depth = level = 0;
+    armed = below = false;
+    alerts = 0;
+    lowest_sp = 0xffff;
+    lowest_entry = 0;
+    lowest_cyc = 0;
+    for (int l = 0; l < MAX_LEVELS; ++l)
+        min_sp_level[l] = 0xffff;
+    for (int r = 0; r < 0x2000; ++r)
+        min_sp_routine[r] = 0xffff;
+    stack_monitor_active = true;
+}
+
+void stack_monitor_before(const i8080 *c) {
+    before_pc = c->pc;
+    before_sp = c->sp;
+    // as i8080_step() decides
+    before_interrupt = c->interrupt_pending && c->iff && c->interrupt_delay == 0;
+}
+
+static bool is_call(uint8_t op) {
+    return op == 0xcd || op == 0xdd || op == 0xed || op == 0xfd || // CALL, and undocumented
+        (op & 0xc7) == 0xc4 ||  // conditional calls
+        (op & 0xc7) == 0xc7;    // RST
+}
+
+void stack_monitor_after(const i8080 *c) {
+    if (!armed) {
+        if (c->sp < STACK_BOTTOM || c->sp > STACK_TOP)
+            return;
+        armed = true;
+    }
+
+    // SP has risen past these return addresses
+    while (depth > 0 && frames[depth - 1].sp < c->sp) {
+        --depth;
+        if (frames[depth].interrupt)
+            --level;
+    }
+    if (c->sp == (uint16_t)(before_sp - 2) && (before_interrupt || is_call(memory[before_pc])) &&
+            depth < MAX_FRAMES) {
+        frame *f = &frames[depth++];
+        f->entry = c->pc;
+        f->from = before_pc;
+        f->sp = c->sp;
+        f->interrupt = before_interrupt;
+        if (f->interrupt)
+            ++level;
+    }
+
+    uint16_t entry = depth > 0 ? frames[depth - 1].entry : 0;
+    if (entry < 0x2000 && c->sp < min_sp_routine[entry])
+        min_sp_routine[entry] = c->sp;
+    int l = level < MAX_LEVELS ? level : MAX_LEVELS - 1;
+    if (c->sp < min_sp_level[l])
+        min_sp_level[l] = c->sp;
+    if (c->sp < lowest_sp) {
+        lowest_sp = c->sp;
+        lowest_entry = entry;
+        lowest_cyc = c->cyc;
+    }
+
+    if (c->sp >= STACK_BOTTOM)
+        below = false;
+    else if (!below) {
+        below = true;
+        ++alerts;
+        printf("Stack: SP %04x is below %04x at cycle %lu\n", c->sp, STACK_BOTTOM, c->cyc);
+        stack_monitor_print_path(c);
+    }
+}
+
+void stack_monitor_print_path(const i8080 *c) {
+    char st[40];
+    rom_symbol(c->pc, st, sizeof(st));
+    printf("  at           %04x %s\n", c->pc, st);
+    for (int d = depth - 1; d >= 0; --d) {
+        const frame *f = &frames[d];
+        char to[40];
+        rom_symbol(f->from, st, sizeof(st));
+        rom_symbol(f->entry, to, sizeof(to));
+        printf("  %-12s %04x %-24s -> %04x %s (SP %04x)\n", f->interrupt ? "interrupted" : "called from",
+            f->from, st, f->entry, to, f->sp);
+    }
+}
+
+void stack_monitor_finish() {
+    stack_monitor_active = false;
+    if (!armed)
+        return;
+    char st[40];
+    rom_symbol(lowest_entry, st, sizeof(st));
+    printf("Stack: lowest SP %04x (%d bytes used) in %04x %s at cycle %lu\n",
+        lowest_sp, STACK_TOP - lowest_sp, lowest_entry, st, lowest_cyc);
+    printf("Stack: lowest SP by interrupt level:");
+    for (int l = 0; l < MAX_LEVELS; ++l) {
+        if (min_sp_level[l] != 0xffff)
+            printf(" %d: %04x", l, min_sp_level[l]);
+    }
+    printf("\n");
+
+    // Deepest first, by selection: there are few enough to ask for
+    static bool shown[0x2000];
+    memset(shown, 0, sizeof(shown));
+    printf("Stack: deepest routines\n");
+    for (int n = 0; n < DEEPEST_ROUTINES; ++n) {
+        int best = -1;
+        for (int r = 0; r < 0x2000; ++r) {
+            if (!shown[r] && min_sp_routine[r] != 0xffff && (best < 0 || min_sp_routine[r] < min_sp_routine[best]))
+                best = r;
+        }
+        if (best < 0)
+            break;
+        shown[best] = true;
+        rom_symbol(best, st, sizeof(st));
+        printf("  %04x %4d bytes  %04x %s\n", min_sp_routine[best], STACK_TOP - min_sp_routine[best], best, st);
+    }
+    printf("Stack: %d alerts\n", alerts);
+}
+
+int stack_monitor_alerts() {
+    return alerts;
+}
@@ -0,0 +1,38 @@
+#ifndef STACK_MONITOR_H
+#define STACK_MONITOR_H
+
+// Watches the stack as the firmware runs. A shadow stack follows calls,
+// restarts and interrupts, and is unwound whenever SP rises past a return
+// address, so that returns, pop_to_ground and anything else that resets SP
+// are all handled the same way. The lowest SP is kept for each routine (the
+// innermost call's destination) and for each depth of interrupt nesting.
+//
+// The stack runs down from STACK_TOP. Below STACK_BOTTOM are the links for
+// the screen's first lines, and below those the ROM: an alert, with the call
+// path, is printed whenever SP drops below STACK_BOTTOM. Nothing is checked
+// until SP first lies within the stack, as it doesn't during the self test.
+
+#include "i8080.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STACK_TOP 0x204e
+#define STACK_BOTTOM 0x2006
+
+extern bool stack_monitor_active;
+
+void stack_monitor_start();
+
+// Called around each instruction while stack_monitor_active
+void stack_monitor_before(const i8080 *c);
+void stack_monitor_after(const i8080 *c);
+
+// The shadow stack, innermost call first
+void stack_monitor_print_path(const i8080 *c);
+
+// The lowest SP seen, by interrupt level and for the deepest routines
+void stack_monitor_finish();
+int stack_monitor_alerts();
+
+#endif